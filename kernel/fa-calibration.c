@@ -107,7 +107,8 @@ void fa_read_eeprom_calib(struct fa_dev *fa)
 }
 
 /**
- * Calculate calibrated values for offset and range using current values
+ * Calculate calibrated values for range using current values. The
+ * offsets are applied afterwards, for all channels at once
  * @fa: FMC ADC device
  * @chan: channel
  */
@@ -116,8 +117,7 @@ static void fa_apply_calib(struct fa_dev *fa, struct zio_channel *chan)
 	int reg = zfad_get_chx_index(ZFA_CHx_CTL_RANGE, chan);
 	int range = fa_readl(fa, fa->fa_adc_csr_base, &zfad_regs[reg]);
 
-	zfad_set_range(fa, chan, range);
-	zfad_apply_offset(chan);
+	__zfad_set_range(fa, chan, range);
 }
 
 static ssize_t fa_write_eeprom(struct file *file, struct kobject *kobj,
@@ -142,6 +142,7 @@ static ssize_t fa_write_eeprom(struct file *file, struct kobject *kobj,
 	memcpy(&fa->calib, calib, sizeof(*calib));
 	for (i = 0; i < FA100M14B4C_NCHAN; ++i)
 		fa_apply_calib(fa, &fa->zdev->cset->chan[i]);
+	zfad_apply_offsets(fa);
 
 	return count;
 }
@@ -7,7 +7,6 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/init.h>
-#include <linux/version.h>
 
 #include "fmc-adc-100m14b4cha.h"
 
@@ -20,6 +19,10 @@ static int fa_enable_test_data_fpga;
 module_param_named(enable_test_data_fpga, fa_enable_test_data_fpga, int, 0444);
 int fa_enable_test_data_adc = 0;
 module_param_named(enable_test_data_adc, fa_enable_test_data_adc, int, 0444);
+int fa_work_cpu = -1;
+module_param_named(work_cpu, fa_work_cpu, int, 0444);
+MODULE_PARM_DESC(work_cpu,
+		 "Default CPU of the acquisition workers, -1 for the IRQ one");
 
 static const int zfad_hw_range[] = {
 	[FA100M14B4C_RANGE_10V_CAL]   = 0x44,
@@ -31,8 +34,6 @@ static const int zfad_hw_range[] = {
 	[FA100M14B4C_RANGE_OPEN]      = 0x00,
 };
 
-/* fmc-adc specific workqueue */
-struct workqueue_struct *fa_workqueue;
 
 /*
  * zfad_convert_hw_range
@@ -66,43 +67,27 @@ int zfad_get_chx_index(unsigned long addr, struct zio_channel *chan)
  * @fa The ADC device instance
  * @pattern the pattern data to get from the ADC
  * @enable 0 to disable, 1 to enable
+ *
+ * It sleeps, see zfad_spi_work() for atomic callers
  */
 int zfad_pattern_data_enable(struct fa_dev *fa, uint16_t pattern,
 			     unsigned int enable)
 {
-	uint32_t frame_tx;
-	int err;
-
-	frame_tx  = 0x0000; /* write mode */
-	frame_tx |= 0x0400; /* A4 pattern */
-	frame_tx |= pattern & 0xFF; /* LSB pattern */
-	err = fa_spi_xfer(fa, FA_SPI_SS_ADC, 16, frame_tx, NULL);
-	if (err)
-		return err;
+	struct fa_spi_msg msg[2] = {
+		{ .cs = FA_SPI_SS_ADC, .num_bits = 16, },
+		{ .cs = FA_SPI_SS_ADC, .num_bits = 16, },
+	};
 
-	frame_tx  = 0x0000; /* write mode */
-	frame_tx |= 0x0300; /* A3 pattern + enable */
-	frame_tx |= (pattern & 0xFF00) >> 8; /* MSB pattern */
-	frame_tx |= (enable ? 0x80 : 0x00); /* Enable the pattern data */
-	err = fa_spi_xfer(fa, FA_SPI_SS_ADC, 16, frame_tx, NULL);
-	if (err)
-		return err;
-
-	return 0;
-}
+	msg[0].tx  = 0x0000; /* write mode */
+	msg[0].tx |= 0x0400; /* A4 pattern */
+	msg[0].tx |= pattern & 0xFF; /* LSB pattern */
 
-/**
- * It sets the DAC voltage to apply an offset on the input channel
- * @chan
- * @val DAC values (-5V: 0x0000, 0V: 0x8000, +5V: 0x7FFF)
- *
- * Return: 0 on success, otherwise a negative error number
- */
-static int zfad_dac_set(struct zio_channel *chan, uint32_t val)
-{
-	struct fa_dev *fa = get_zfadc(&chan->cset->zdev->head.dev);
+	msg[1].tx  = 0x0000; /* write mode */
+	msg[1].tx |= 0x0300; /* A3 pattern + enable */
+	msg[1].tx |= (pattern & 0xFF00) >> 8; /* MSB pattern */
+	msg[1].tx |= (enable ? 0x80 : 0x00); /* Enable the pattern data */
 
-	return fa_spi_xfer(fa, FA_SPI_SS_DAC(chan->index), 16, val, NULL);
+	return fa_spi_xfer_batch(fa, msg, ARRAY_SIZE(msg));
 }
 
 static int zfad_offset_to_dac(struct zio_channel *chan,
@@ -131,21 +116,20 @@ static int zfad_offset_to_dac(struct zio_channel *chan,
 }
 
 /*
- * zfad_apply_user_offset
- * @chan: the channel where apply offset
- *
- * Apply user offset to the channel input. Before apply the user offset it must
- * be corrected with offset and gain calibration value.
+ * It prepares the DAC transfer that applies the user offset to the
+ * channel input. Before apply the user offset it must be corrected with
+ * offset and gain calibration value. The DAC value goes from -5V
+ * (0x0000) to +5V (0xFFFF), 0V is 0x8000.
  *
  * Offset values are taken from `struct fa_dev`, so they must be there before
  * calling this function
  */
-int zfad_apply_offset(struct zio_channel *chan)
+static int zfad_offset_msg(struct zio_channel *chan, struct fa_spi_msg *msg)
 {
 	struct fa_dev *fa = get_zfadc(&chan->cset->zdev->head.dev);
 	uint32_t range_reg;
 	int32_t off_uv;
-	int hwval, i, range;
+	int i, range;
 
 	off_uv = fa->user_offset[chan->index] + fa->zero_offset[chan->index];
 	if (off_uv < -5000000 || off_uv > 5000000)
@@ -163,15 +147,63 @@ int zfad_apply_offset(struct zio_channel *chan)
 	else if (range >= FA100M14B4C_RANGE_10V_CAL)
 		range -= FA100M14B4C_RANGE_10V_CAL;
 
-	hwval = zfad_offset_to_dac(chan, off_uv, range);
-	return zfad_dac_set(chan, hwval);
+	msg->cs = FA_SPI_SS_DAC(chan->index);
+	msg->num_bits = 16;
+	msg->tx = zfad_offset_to_dac(chan, off_uv, range);
+
+	return 0;
+}
+
+/*
+ * zfad_apply_offset
+ * @chan: the channel where apply offset
+ *
+ * Apply user offset to the channel input. It runs on the conf_set path,
+ * which may be atomic: it checks the offset and zfad_spi_work() writes
+ * the DAC
+ */
+int zfad_apply_offset(struct zio_channel *chan)
+{
+	struct fa_dev *fa = get_zfadc(&chan->cset->zdev->head.dev);
+	struct fa_spi_msg msg;
+	int err;
+
+	err = zfad_offset_msg(chan, &msg);
+	if (err)
+		return err;
+
+	set_bit(chan->index, &fa->spi.pending);
+	schedule_work(&fa->spi.work);
+
+	return 0;
+}
+
+/*
+ * zfad_apply_offsets
+ * @fa: the fmc-adc descriptor
+ *
+ * Apply user offset to all the channel inputs, with a single SPI
+ * submission. It sleeps
+ */
+int zfad_apply_offsets(struct fa_dev *fa)
+{
+	struct fa_spi_msg msg[FA100M14B4C_NCHAN];
+	int i, err;
+
+	for (i = 0; i < FA100M14B4C_NCHAN; ++i) {
+		err = zfad_offset_msg(&fa->zdev->cset->chan[i], &msg[i]);
+		if (err)
+			return err;
+	}
+
+	return fa_spi_xfer_batch(fa, msg, FA100M14B4C_NCHAN);
 }
 
 /*
  * zfad_reset_offset
  * @fa: the fmc-adc descriptor
  *
- * Reset channel's offsets
+ * Reset channel's offsets. It sleeps
  */
 void zfad_reset_offset(struct fa_dev *fa)
 {
@@ -180,8 +212,47 @@ void zfad_reset_offset(struct fa_dev *fa)
 	for (i = 0; i < FA100M14B4C_NCHAN; ++i) {
 		fa->user_offset[i] = 0;
 		fa->zero_offset[i] = 0;
-		zfad_apply_offset(&fa->zdev->cset->chan[i]);
 	}
+	zfad_apply_offsets(fa);
+}
+
+/*
+ * zfad_spi_work
+ * @work: the SPI work of the fmc-adc descriptor
+ *
+ * It runs the SPI transfers requested on the conf_set path, which may be
+ * atomic. The values are taken when the work runs, so many requests for
+ * the same channel become one transfer
+ */
+void zfad_spi_work(struct work_struct *work)
+{
+	struct fa_dev *fa = container_of(work, struct fa_dev, spi.work);
+	struct fa_spi_msg msg[FA100M14B4C_NCHAN];
+	unsigned long pending;
+	int i, n = 0, err;
+
+	pending = xchg(&fa->spi.pending, 0);
+
+	if (pending & BIT(FA_SPI_PEND_PATTERN)) {
+		err = zfad_pattern_data_enable(fa, fa->spi.pattern,
+					       fa_enable_test_data_adc);
+		if (err)
+			dev_warn(fa->msgdev,
+				 "Failed to set the ADC test data. Continue without\n");
+		else
+			dev_info(fa->msgdev,
+				 "the ADC test data (0x%x) is enabled on all channels\n",
+				 fa->spi.pattern);
+	}
+
+	for (i = 0; i < FA100M14B4C_NCHAN; ++i) {
+		if (!(pending & BIT(i)))
+			continue;
+		if (!zfad_offset_msg(&fa->zdev->cset->chan[i], &msg[n]))
+			n++;
+	}
+	if (n && fa_spi_xfer_batch(fa, msg, n))
+		dev_err(fa->msgdev, "Cannot apply the channel offsets\n");
 }
 
 /*
@@ -199,7 +270,7 @@ void zfad_init_saturation(struct fa_dev *fa)
 }
 
 /*
- * zfad_set_range
+ * __zfad_set_range
  * @fa: the fmc-adc descriptor
  * @chan: the channel to calibrate
  * @usr_val: the volt range to set and calibrate
@@ -207,15 +278,17 @@ void zfad_init_saturation(struct fa_dev *fa)
  * When the input range changes, we must write new fixup values.
  * Gain ad offsets must be corrected with offset and gain calibration value.
  * An open input and test data do not need any correction.
+ * The user offset must be applied again, see zfad_set_range()
  */
-int zfad_set_range(struct fa_dev *fa, struct zio_channel *chan,
-			  int range)
+int __zfad_set_range(struct fa_dev *fa, struct zio_channel *chan,
+		     int range)
 {
 	int i, offset, gain;
 
 	/* Actually set the range */
 	i = zfad_get_chx_index(ZFA_CHx_CTL_RANGE, chan);
-	fa_writel(fa, fa->fa_adc_csr_base, &zfad_regs[i], zfad_hw_range[range]);
+	fa_writel(fa, fa->fa_adc_csr_base, &zfad_regs[i],
+		  zfad_hw_range[range]);
 
 	if (range == FA100M14B4C_RANGE_OPEN || fa_enable_test_data_adc)
 		range = FA100M14B4C_RANGE_1V;
@@ -237,21 +310,143 @@ int zfad_set_range(struct fa_dev *fa, struct zio_channel *chan,
 	i = zfad_get_chx_index(ZFA_CHx_GAIN, chan);
 	fa_writel(fa, fa->fa_adc_csr_base, &zfad_regs[i], gain);
 
-	/* recalculate user offset for the new range */
-	zfad_apply_offset(chan);
-
 	return 0;
 }
 
 /*
- * zfad_fsm_command
+ * zfad_set_range
+ * @fa: the fmc-adc descriptor
+ * @chan: the channel to calibrate
+ * @usr_val: the volt range to set and calibrate
+ *
+ * It sets the range and it recalculates the user offset for it
+ */
+int zfad_set_range(struct fa_dev *fa, struct zio_channel *chan,
+		   int range)
+{
+	int err;
+
+	err = __zfad_set_range(fa, chan, range);
+	if (err)
+		return err;
+
+	return zfad_apply_offset(chan);
+}
+
+/*
+ * The acquisition is configured while it is not running: staged writes
+ * are fine. Otherwise the user expects the change to take effect now
+ */
+static bool fa_xact_direct(struct fa_dev *fa)
+{
+	struct zio_ti *ti;
+
+	if (!fa->zdev || !fa->zdev->cset->ti)
+		return true;
+	ti = fa->zdev->cset->ti;
+
+	return fa->stream.running || (ti->flags & ZIO_TI_ARMED);
+}
+
+/*
+ * Only the trigger and acquisition setup is staged: it matters only once
+ * the acquisition starts. The analog front-end (range, termination, gain,
+ * offset, saturation) must follow the user immediately, also on an idle
+ * board
+ */
+static bool fa_xact_stageable(unsigned int slot)
+{
+	switch (slot) {
+	case FA_SHADOW_TRG_SRC:
+	case FA_SHADOW_TRG_POL:
+	case FA_SHADOW_TRG_DLY:
+	case FA_SHADOW_SHOTS_NB:
+	case FA_SHADOW_SR_UNDER:
+	case FA_SHADOW_PRE:
+	case FA_SHADOW_POST:
+	case FA_SHADOW_CH1_THRES:
+	case FA_SHADOW_CH1_DLY:
+	case FA_SHADOW_CH2_THRES:
+	case FA_SHADOW_CH2_DLY:
+	case FA_SHADOW_CH3_THRES:
+	case FA_SHADOW_CH3_DLY:
+	case FA_SHADOW_CH4_THRES:
+	case FA_SHADOW_CH4_DLY:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/**
+ * It stages a register write of the acquisition setup. The value goes to
+ * the register shadow and it reaches the hardware with the next
+ * fa_xact_commit(), in a single burst with the other staged writes; many
+ * writes to the same register (or to fields of the same register) become
+ * a single bus access. Registers outside the trigger and acquisition
+ * setup, strobes and any write while acquiring reach the hardware
+ * immediately
+ *
+ * @param fa the fmc-adc descriptor
+ * @param base_off base address of the core
+ * @param field register field
+ * @param usr_val field value
+ */
+void fa_xact_writel(struct fa_dev *fa, unsigned int base_off,
+		    const struct zfa_field_desc *field, uint32_t usr_val)
+{
+	unsigned int slot = field->shadow;
+
+	if (!fa_xact_stageable(slot) || field->is_strobe ||
+	    fa_xact_direct(fa)) {
+		fa_writel(fa, base_off, field, usr_val);
+		return;
+	}
+
+	fa->shadow[slot] = fa_field_merge(fa, base_off, field, usr_val);
+	fa->shadow_addr[slot] = base_off + field->offset;
+	set_bit(slot, fa->shadow_valid);
+	set_bit(slot, fa->shadow_dirty);
+}
+
+/**
+ * It writes the staged registers to the hardware. The slots follow the
+ * address order, so the burst is ordered as the register map.
+ * On SVEC this is still one single VME cycle per register, not a block
+ * write: the fmc-bus carrier interface has no block access, and the
+ * staged registers are not contiguous, so a block would also rewrite the
+ * registers in between (strobes included)
+ *
+ * @param fa the fmc-adc descriptor
+ *
+ * @return the number of registers written
+ */
+unsigned int fa_xact_commit(struct fa_dev *fa)
+{
+	unsigned int slot, n = 0;
+
+	for (slot = 1; slot < __FA_SHADOW_N; ++slot) {
+		if (!test_and_clear_bit(slot, fa->shadow_dirty))
+			continue;
+		fa_iowrite(fa, fa->shadow[slot], fa->shadow_addr[slot]);
+		n++;
+	}
+	if (n)
+		dev_dbg(fa->msgdev, "%u staged registers written\n", n);
+
+	return n;
+}
+
+/*
+ * zfad_fsm_prepare
  * @fa: the fmc-adc descriptor
  * @command: the command to apply to FSM
  *
  * This function checks if the command can be done and performs some
- * preliminary operation beforehand
+ * preliminary operation beforehand. The command itself is not sent: the
+ * board is ready for the ZFA_CTL_FMS_CMD write
  */
-int zfad_fsm_command(struct fa_dev *fa, uint32_t command)
+int zfad_fsm_prepare(struct fa_dev *fa, uint32_t command)
 {
 	struct zio_cset *cset = fa->zdev->cset;
 	uint32_t val;
@@ -276,6 +471,8 @@ int zfad_fsm_command(struct fa_dev *fa, uint32_t command)
 	 * The case of fmc-adc-trg is optimized because is the most common
 	 * case
 	 */
+	/* The stream first, so its work does not start a DMA after the abort */
+	fa_stream_stop(fa);
 	if (likely(cset->trig == &zfat_type || command == FA100M14B4C_CMD_STOP))
 		zio_trigger_abort_disable(cset, 0);
 
@@ -302,6 +499,9 @@ int zfad_fsm_command(struct fa_dev *fa, uint32_t command)
 			return -EBUSY;
 		}
 
+		/* The configuration must be in place before arming */
+		fa_xact_commit(fa);
+
 		/* Now we can arm the trigger for the incoming acquisition */
 		zio_arm_trigger(cset->ti);
 		/*
@@ -317,6 +517,9 @@ int zfad_fsm_command(struct fa_dev *fa, uint32_t command)
 			return -EIO;
 		}
 
+		if (fa_stream_enabled(fa))
+			fa_stream_start(fa);
+
 		dev_dbg(fa->msgdev, "FSM START Command, Enable interrupts\n");
 		fa_enable_irqs(fa);
 
@@ -328,6 +531,24 @@ int zfad_fsm_command(struct fa_dev *fa, uint32_t command)
 		fa_disable_irqs(fa);
 	}
 
+	return 0;
+}
+
+/*
+ * zfad_fsm_command
+ * @fa: the fmc-adc descriptor
+ * @command: the command to apply to FSM
+ *
+ * It prepares the board (zfad_fsm_prepare()) and it sends the command
+ */
+int zfad_fsm_command(struct fa_dev *fa, uint32_t command)
+{
+	int err;
+
+	err = zfad_fsm_prepare(fa, command);
+	if (err)
+		return err;
+
 	fa_writel(fa, fa->fa_adc_csr_base, &zfad_regs[ZFA_CTL_FMS_CMD],
 		  command);
 	return 0;
@@ -340,6 +561,12 @@ static int __fa_sdb_get_device(struct fa_dev *fa)
 	struct fmc_device *fmc = fa->fmc;
 	int ret;
 
+#ifdef CONFIG_FMC_ADC_SIM
+	/* The simulator has no SDB, its init() sets the base addresses */
+	if (fa->carrier_op == &fa_sim_op)
+		return 0;
+#endif
+
 	ret = fmc_scan_sdb_tree(fmc, 0);
 	if (ret == -EBUSY) {
 		/* Not a problem, it's already there. We assume that
@@ -405,7 +632,8 @@ static int __fa_init(struct fa_dev *fa)
 						&zdev->cset->chan[i]);
 		fa_writel(fa,  fa->fa_adc_csr_base, &zfad_regs[addr],
 			  FA100M14B4C_RANGE_1V);
-		zfad_set_range(fa, &zdev->cset->chan[i], FA100M14B4C_RANGE_1V);
+		__zfad_set_range(fa, &zdev->cset->chan[i],
+				 FA100M14B4C_RANGE_1V);
 	}
 	zfad_reset_offset(fa);
 
@@ -452,7 +680,11 @@ struct fa_modlist {
 static struct fa_modlist mods[] = {
 	{"spi", fa_spi_init, fa_spi_exit},
 	{"onewire", fa_onewire_init, fa_onewire_exit},
+	{"counters", fa_counters_init, fa_counters_exit},
 	{"zio", fa_zio_init, fa_zio_exit},
+	{"ring", fa_ring_init, fa_ring_exit},
+	{"timetag", fa_timetag_init, fa_timetag_exit},
+	{"group", fa_group_init, fa_group_exit},
 	{"debug", fa_debug_init, fa_debug_exit},
 };
 
@@ -487,6 +719,10 @@ int fa_probe(struct fmc_device *fmc)
 	} else if (!strcmp(fmc->carrier_name, "SVEC")) {
 #ifdef CONFIG_FMC_ADC_SVEC
 		fa->carrier_op = &fa_svec_op;
+#endif
+#ifdef CONFIG_FMC_ADC_SIM
+	} else if (!strcmp(fmc->carrier_name, FA_SIM_CARRIER_NAME)) {
+		fa->carrier_op = &fa_sim_op;
 #endif
 	}
 
@@ -529,6 +765,8 @@ int fa_probe(struct fmc_device *fmc)
 	if (err < 0)
 		goto out;
 
+	/* the carrier may have a different memory */
+	fa->ddr_size = FA100M14B4C_MAX_ACQ_BYTE;
 	err = fa->carrier_op->init(fa);
 	if (err < 0)
 		goto out;
@@ -536,6 +774,7 @@ int fa_probe(struct fmc_device *fmc)
 	err = fa->carrier_op->reset_core(fa);
 	if (err < 0)
 		goto out;
+	fa_shadow_invalidate(fa);
 
 	/* init all subsystems */
 	for (i = 0, m = mods; i < ARRAY_SIZE(mods); i++, m++) {
@@ -579,7 +818,6 @@ int fa_remove(struct fmc_device *fmc)
 	int i = ARRAY_SIZE(mods);
 
 	fa_free_irqs(fa);
-	flush_workqueue(fa_workqueue);
 
 	while (--i >= 0) {
 		m = mods + i;
@@ -616,18 +854,11 @@ static int fa_init(void)
 {
 	int ret;
 
-	#if LINUX_VERSION_CODE < KERNEL_VERSION(3,15,0)
-	fa_workqueue = alloc_workqueue(fa_dev_drv.driver.name,
-					WQ_NON_REENTRANT | WQ_UNBOUND |
-					WQ_MEM_RECLAIM, 1);
-	#else
-	fa_workqueue = alloc_workqueue(fa_dev_drv.driver.name,
-				       WQ_UNBOUND | WQ_MEM_RECLAIM, 1);
-	#endif
-	if (fa_workqueue == NULL)
-		return -ENOMEM;
+	/* First buffer, trigger and zio driver */
+	ret = fa_zbuf_init();
+	if (ret)
+		return ret;
 
-	/* First trigger and zio driver */
 	ret = fa_trig_init();
 	if (ret)
 		goto out1;
@@ -641,25 +872,38 @@ static int fa_init(void)
 	if (ret)
 		goto out3;
 
+#ifdef CONFIG_FMC_ADC_SIM
+	/* Simulated devices are probed as soon as they are created */
+	ret = fa_sim_register();
+	if (ret)
+		goto out4;
+#endif
+
 	return ret;
 
+#ifdef CONFIG_FMC_ADC_SIM
+out4:
+	fmc_driver_unregister(&fa_dev_drv);
+#endif
 out3:
 	fa_zio_unregister();
 out2:
 	fa_trig_exit();
 out1:
-	destroy_workqueue(fa_workqueue);
+	fa_zbuf_exit();
 
 	return ret;
 }
 
 static void fa_exit(void)
 {
+#ifdef CONFIG_FMC_ADC_SIM
+	fa_sim_unregister();
+#endif
 	fmc_driver_unregister(&fa_dev_drv);
 	fa_zio_unregister();
 	fa_trig_exit();
-	if (fa_workqueue != NULL)
-		destroy_workqueue(fa_workqueue);
+	fa_zbuf_exit();
 }
 
 module_init(fa_init);
@@ -0,0 +1,66 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright CERN 2019
+ *
+ * Acquisition counters. The hot paths update a copy of the counters
+ * for each CPU, without locks; the "counters" binary attribute adds
+ * them up when read, so a monitoring agent can scrape all of them with
+ * a single read.
+ */
+
+#include <linux/kernel.h>
+#include <linux/percpu.h>
+#include <linux/sysfs.h>
+
+#include "fmc-adc-100m14b4cha.h"
+
+#define FA_COUNTERS_SIZE (__FA100M14B4C_CNT_N * sizeof(uint64_t))
+
+static ssize_t fa_counters_read(struct file *file, struct kobject *kobj,
+				struct bin_attribute *attr,
+				char *buf, loff_t off, size_t count)
+{
+	struct device *dev = container_of(kobj, struct device, kobj);
+	struct fa_dev *fa = get_zfadc(dev);
+	uint64_t sum[__FA100M14B4C_CNT_N] = {0};
+	struct fa_counters *cnt;
+	int cpu, i;
+
+	if (off >= FA_COUNTERS_SIZE)
+		return 0;
+	count = min_t(size_t, count, FA_COUNTERS_SIZE - off);
+
+	/* The sum is not atomic: each counter is consistent on its own */
+	for_each_possible_cpu(cpu) {
+		cnt = per_cpu_ptr(fa->counters, cpu);
+		for (i = 0; i < __FA100M14B4C_CNT_N; ++i)
+			sum[i] += READ_ONCE(cnt->cnt[i]);
+	}
+	memcpy(buf, (void *)sum + off, count);
+
+	return count;
+}
+
+struct bin_attribute dev_attr_counters = {
+	.attr = {
+		.name = "counters",
+		.mode = 0444,
+	},
+	.size = FA_COUNTERS_SIZE,
+	.read = fa_counters_read,
+};
+
+int fa_counters_init(struct fa_dev *fa)
+{
+	fa->counters = alloc_percpu(struct fa_counters);
+	if (!fa->counters)
+		return -ENOMEM;
+
+	return 0;
+}
+
+void fa_counters_exit(struct fa_dev *fa)
+{
+	free_percpu(fa->counters);
+	fa->counters = NULL;
+}
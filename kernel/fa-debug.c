@@ -4,6 +4,9 @@
  * Author: Federico Vaga <federico.vaga@cern.ch>
  */
 
+#include <linux/sort.h>
+#include <linux/vmalloc.h>
+
 #include "fmc-adc-100m14b4cha.h"
 
 
@@ -33,6 +36,13 @@ static int fa_regdump_seq_read(struct seq_file *s, void *data)
 	struct fa_dev *fa = s->private;
 
 	fa_regdump_seq_read_spi(fa, s);
+	seq_printf(s, "Register accesses\n");
+	seq_printf(s, "read %lu, write %lu, shadow hit %lu\n",
+		   fa->n_mmio_read, fa->n_mmio_write, fa->n_shadow_hit);
+	seq_printf(s, "SPI transfers\n");
+	seq_printf(s, "transfers %lu, submissions %lu, total %llu ns, last %u ns, max %u ns\n",
+		   fa->spi.n_xfer, fa->spi.n_batch, fa->spi.total_ns,
+		   fa->spi.last_ns, fa->spi.max_ns);
 
 	return 0;
 }
@@ -53,6 +63,177 @@ static const struct file_operations fa_regdump_ops = {
 };
 
 
+/**
+ * It saves the time stamps of the acquisition just completed.
+ * The acquisition path is serialized (ACQ_END, DMA, DATA_DONE), so there is
+ * a single writer; readers may get a record being overwritten, which is
+ * acceptable for statistics. A reset requested by the user happens here,
+ * for the same reason
+ *
+ * @param fa the fmc-adc descriptor
+ */
+void fa_lat_push(struct fa_dev *fa)
+{
+	struct fa_latency *lat = fa->lat;
+
+	if (!fa_lat_enabled(fa))
+		return;
+
+	if (xchg(&lat->reset, 0))
+		lat->head = 0;
+	memcpy(lat->ring[lat->head % FA_LAT_RING_SIZE], lat->cur,
+	       sizeof(lat->cur));
+	smp_wmb();
+	WRITE_ONCE(lat->head, lat->head + 1);
+	memset(lat->cur, 0, sizeof(lat->cur));
+}
+
+
+static const char *fa_lat_names[] = {
+	"irq-to-work",
+	"work-to-dma-start",
+	"dma",
+	"dma-done-to-data-done",
+	"total",
+};
+
+
+static int fa_lat_cmp(const void *a, const void *b)
+{
+	u64 x = *(const u64 *)a, y = *(const u64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * It prints the statistics of a single interval. The interval 'i' goes
+ * from stage 'i' to stage 'i + 1', the last one from the first to the
+ * last stage
+ */
+static void fa_lat_seq_stats(struct seq_file *s, u64 (*rec)[FA_LAT_N],
+			     unsigned int n, unsigned int i, u64 *tmp)
+{
+	unsigned int start = i, end = i + 1, k, cnt = 0;
+	u64 sum = 0;
+
+	if (end == FA_LAT_N) {
+		start = 0;
+		end = FA_LAT_N - 1;
+	}
+
+	for (k = 0; k < n; ++k) {
+		/* an acquisition may skip stages (e.g. aborted) */
+		if (!rec[k][start] || !rec[k][end] ||
+		    rec[k][end] < rec[k][start])
+			continue;
+		tmp[cnt] = rec[k][end] - rec[k][start];
+		sum += tmp[cnt];
+		cnt++;
+	}
+
+	if (!cnt) {
+		seq_printf(s, "%-22s %8u\n", fa_lat_names[i], 0);
+		return;
+	}
+
+	sort(tmp, cnt, sizeof(*tmp), fa_lat_cmp, NULL);
+	seq_printf(s, "%-22s %8u %10llu %10llu %10llu %10llu\n",
+		   fa_lat_names[i], cnt, tmp[0], div_u64(sum, cnt),
+		   tmp[cnt - 1], tmp[(cnt * 99) / 100]);
+}
+
+static int fa_lat_seq_read(struct seq_file *s, void *data)
+{
+	struct fa_dev *fa = s->private;
+	struct fa_latency *lat = fa->lat;
+	u64 (*rec)[FA_LAT_N];
+	unsigned int head, n, i;
+	u64 *tmp;
+
+	rec = kmalloc(sizeof(lat->ring), GFP_KERNEL);
+	tmp = kmalloc_array(FA_LAT_RING_SIZE, sizeof(*tmp), GFP_KERNEL);
+	if (!rec || !tmp) {
+		kfree(rec);
+		kfree(tmp);
+		return -ENOMEM;
+	}
+
+	/* A reset not consumed yet: nothing to show */
+	head = READ_ONCE(lat->reset) ? 0 : READ_ONCE(lat->head);
+	smp_rmb();
+	memcpy(rec, lat->ring, sizeof(lat->ring));
+	n = min_t(unsigned int, head, FA_LAT_RING_SIZE);
+
+	seq_printf(s, "Acquisition latency (ns), last %u of %u acquisitions\n",
+		   n, head);
+	seq_printf(s, "%-22s %8s %10s %10s %10s %10s\n",
+		   "stage", "count", "min", "avg", "max", "p99");
+	for (i = 0; i < FA_LAT_N; ++i)
+		fa_lat_seq_stats(s, rec, n, i, tmp);
+
+	kfree(tmp);
+	kfree(rec);
+
+	return 0;
+}
+
+
+static int fa_lat_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, fa_lat_seq_read, inode->i_private);
+}
+
+/*
+ * Any write resets the statistics, on the next acquisition
+ */
+static ssize_t fa_lat_write(struct file *file, const char __user *buf,
+			    size_t count, loff_t *ppos)
+{
+	struct seq_file *s = file->private_data;
+	struct fa_dev *fa = s->private;
+
+	WRITE_ONCE(fa->lat->reset, 1);
+
+	return count;
+}
+
+
+static const struct file_operations fa_lat_ops = {
+	.owner = THIS_MODULE,
+	.open = fa_lat_open,
+	.read = seq_read,
+	.write = fa_lat_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+
+static void fa_lat_init(struct fa_dev *fa)
+{
+	char *name;
+
+	name = kasprintf(GFP_KERNEL, "%s-latency",
+			 dev_name(&fa->zdev->head.dev));
+	fa->lat = vzalloc(sizeof(*fa->lat));
+	if (!name || !fa->lat)
+		goto err;
+
+	fa->lat_dump = debugfs_create_file(name, 0644, NULL, fa, &fa_lat_ops);
+	if (IS_ERR_OR_NULL(fa->lat_dump))
+		goto err;
+	kfree(name);
+
+	return;
+
+err:
+	dev_err(fa->msgdev, "Cannot create latency debugfs file\n");
+	vfree(fa->lat);
+	fa->lat = NULL;
+	fa->lat_dump = NULL;
+	kfree(name);
+}
+
+
 int fa_debug_init(struct fa_dev *fa)
 {
 	fa->reg_dump = debugfs_create_file(dev_name(&fa->zdev->head.dev), 0444,
@@ -61,6 +242,7 @@ int fa_debug_init(struct fa_dev *fa)
 		dev_err(fa->msgdev,
 			"Cannot create regdump debugfs file\n");
 	}
+	fa_lat_init(fa);
 
 	return 0;
 }
@@ -68,5 +250,8 @@ int fa_debug_init(struct fa_dev *fa)
 
 void fa_debug_exit(struct fa_dev *fa)
 {
+	debugfs_remove_recursive(fa->lat_dump);
 	debugfs_remove_recursive(fa->reg_dump);
+	vfree(fa->lat);
+	fa->lat = NULL;
 }
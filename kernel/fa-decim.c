@@ -0,0 +1,143 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright CERN 2019
+ *
+ * Host decimation. The ADC samples at 100MS/s and the gateware can only
+ * drop samples (undersample), which aliases. The driver can reduce the
+ * blocks instead: a CIC filter (integrators, decimator, combs) turns
+ * "factor" samples of each channel into one, before the blocks reach the
+ * buffer. The first order filter is a boxcar average.
+ *
+ * The integrators wrap around: the combs cancel the wrap as long as the
+ * output fits in 64 bits, so the gain (factor^order) is limited to 2^48.
+ */
+
+#include <linux/kernel.h>
+#include <linux/math64.h>
+
+#include "fmc-adc-100m14b4cha.h"
+
+#define FA_DECIM_FRAME_BYTES (FA100M14B4C_NCHAN * sizeof(int16_t))
+
+/**
+ * It configures the decimation. While streaming the filter carries its
+ * state from a block to the next one, so it cannot change
+ *
+ * @param fa the fmc-adc descriptor
+ * @param factor samples reduced to one, 1 disables the decimation
+ * @param order number of CIC stages
+ *
+ * @return 0 on success, otherwise a negative error number
+ */
+int fa_decim_set(struct fa_dev *fa, unsigned int factor, unsigned int order)
+{
+	if (!factor || factor > FA_DECIM_FACTOR_MAX) {
+		dev_err(fa->msgdev, "invalid decimation factor (max %u)\n",
+			FA_DECIM_FACTOR_MAX);
+		return -EINVAL;
+	}
+	if (!order || order > FA_DECIM_ORDER_MAX) {
+		dev_err(fa->msgdev, "invalid decimation order (max %u)\n",
+			FA_DECIM_ORDER_MAX);
+		return -EINVAL;
+	}
+	if (fa->stream.running)
+		return -EBUSY;
+
+	fa->decim.factor = factor;
+	fa->decim.order = order;
+	fa_decim_reset(fa);
+
+	return 0;
+}
+
+/**
+ * It clears the filter state
+ *
+ * @param fa the fmc-adc descriptor
+ */
+void fa_decim_reset(struct fa_dev *fa)
+{
+	struct fa_decim *decim = &fa->decim;
+
+	decim->phase = 0;
+	memset(decim->integ, 0, sizeof(decim->integ));
+	memset(decim->comb, 0, sizeof(decim->comb));
+}
+
+/* Normalize a comb output to the sample range */
+static int16_t fa_decim_scale(int64_t y, int64_t gain)
+{
+	y += (y < 0 ? -gain : gain) / 2;
+	y = div64_s64(y, gain);
+
+	return clamp_t(int64_t, y, S16_MIN, S16_MAX);
+}
+
+/**
+ * It decimates the samples of a block, in place. The block shrinks by the
+ * decimation factor: a trailing partial group is carried to the next
+ * block when streaming, otherwise it is dropped
+ *
+ * @param fa the fmc-adc descriptor
+ * @param block block of interleaved samples, without time-tag
+ * @param cont the block continues the previous one (streaming)
+ */
+void fa_decim_block(struct fa_dev *fa, struct zio_block *block, bool cont)
+{
+	struct fa_decim *decim = &fa->decim;
+	struct zio_control *ctrl = zio_get_ctrl(block);
+	unsigned int factor = decim->factor, order = decim->order;
+	const int16_t *in = block->data;
+	int16_t *out = block->data;
+	size_t i, n, n_out = 0;
+	int64_t gain = 1, acc, y, tmp;
+	unsigned int k, ch;
+
+	if (factor <= 1)
+		return;
+
+	/* The filter needs the samples in CPU order */
+	fa_block_cpu_order(block);
+	if (!cont)
+		fa_decim_reset(fa);
+	for (k = 0; k < order; ++k)
+		gain *= factor;
+
+	n = block->datalen / FA_DECIM_FRAME_BYTES;
+	for (i = 0; i < n; ++i, in += FA100M14B4C_NCHAN) {
+		for (ch = 0; ch < FA100M14B4C_NCHAN; ++ch) {
+			acc = in[ch];
+			for (k = 0; k < order; ++k) {
+				decim->integ[k][ch] += acc;
+				acc = decim->integ[k][ch];
+			}
+		}
+		if (++decim->phase < factor)
+			continue;
+		decim->phase = 0;
+
+		/* The output never overtakes the input */
+		for (ch = 0; ch < FA100M14B4C_NCHAN; ++ch) {
+			y = decim->integ[order - 1][ch];
+			for (k = 0; k < order; ++k) {
+				tmp = y;
+				y -= decim->comb[k][ch];
+				decim->comb[k][ch] = tmp;
+			}
+			out[ch] = fa_decim_scale(y, gain);
+		}
+		out += FA100M14B4C_NCHAN;
+		n_out++;
+	}
+
+	block->datalen = n_out * FA_DECIM_FRAME_BYTES;
+	ctrl->nsamples = n_out;
+}
+
+void fa_decim_init(struct fa_dev *fa)
+{
+	fa->decim.factor = 1;
+	fa->decim.order = 1;
+	fa_decim_reset(fa);
+}
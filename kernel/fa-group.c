@@ -0,0 +1,278 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright CERN 2019
+ *
+ * Device groups. Boards in the same group start and get a software
+ * trigger together: the driver prepares all of them first, then it
+ * writes the last register of each board in a tight loop with the
+ * interrupts disabled, so the skew between the boards is the time of a
+ * few bus writes instead of a system call each.
+ */
+
+#include <linux/kernel.h>
+#include <linux/spinlock.h>
+#include <linux/irqflags.h>
+#include <linux/ktime.h>
+
+#include "fmc-adc-100m14b4cha.h"
+
+/*
+ * fa_group: boards acquiring together
+ * @member: boards of the group, in joining order
+ * @n_member: number of boards in @member
+ * @skew_valid: @skew comes from a software trigger
+ * @skew: trigger time spread of the last software trigger (UTC ticks)
+ * @fire_ns: duration of the last loop of writes
+ */
+struct fa_group {
+	struct fa_dev *member[FA100M14B4C_GROUP_MEMBERS];
+	unsigned int n_member;
+	bool skew_valid;
+	uint32_t skew;
+	uint32_t fire_ns;
+};
+
+/* Group 0 is not used: it means "no group" */
+static struct fa_group fa_groups[FA100M14B4C_GROUP_N + 1];
+/*
+ * It protects the groups. Commands run under it, so they do not overlap
+ * and no board leaves the group meanwhile. The attributes that take it
+ * may run in atomic context: it is a spinlock, and the commands do not
+ * sleep (they are the ones of the interrupt handlers)
+ */
+static DEFINE_SPINLOCK(fa_group_lock);
+
+static uint64_t fa_group_trg_ticks(struct fa_dev *fa)
+{
+	uint64_t secs;
+	uint32_t ticks;
+
+	secs = fa_readl(fa, fa->fa_utc_base, &zfad_regs[ZFA_UTC_TRIG_SECONDS]);
+	ticks = fa_readl(fa, fa->fa_utc_base, &zfad_regs[ZFA_UTC_TRIG_COARSE]);
+
+	return secs * FA100M14B4C_UTC_CLOCK_FREQ + ticks;
+}
+
+/*
+ * It writes a register of all the boards, which must be ready for it,
+ * with the interrupts disabled. It records the duration of the loop
+ */
+static void fa_group_fire(struct fa_group *group, unsigned int reg,
+			  uint32_t val)
+{
+	struct fa_dev *fa;
+	unsigned long flags;
+	unsigned int i;
+	u64 t;
+
+	local_irq_save(flags);
+	t = ktime_get_ns();
+	for (i = 0; i < group->n_member; ++i) {
+		fa = group->member[i];
+		fa_writel(fa, fa->fa_adc_csr_base, &zfad_regs[reg], val);
+	}
+	t = ktime_get_ns() - t;
+	local_irq_restore(flags);
+
+	group->fire_ns = min_t(u64, t, U32_MAX);
+}
+
+static int fa_group_start(struct fa_group *group)
+{
+	unsigned int i, k;
+	int err;
+
+	for (i = 0; i < group->n_member; ++i) {
+		err = zfad_fsm_prepare(group->member[i],
+				       FA100M14B4C_CMD_START);
+		if (err)
+			goto err;
+	}
+	fa_group_fire(group, ZFA_CTL_FMS_CMD, FA100M14B4C_CMD_START);
+
+	return 0;
+
+err:
+	dev_err(group->member[i]->msgdev,
+		"Cannot start the group, stopping it\n");
+	for (k = 0; k < i; ++k)
+		zfad_fsm_command(group->member[k], FA100M14B4C_CMD_STOP);
+	return err;
+}
+
+static void fa_group_stop(struct fa_group *group)
+{
+	unsigned int i;
+
+	for (i = 0; i < group->n_member; ++i)
+		zfad_fsm_command(group->member[i], FA100M14B4C_CMD_STOP);
+}
+
+static int fa_group_sw_trigger(struct fa_group *group)
+{
+	uint64_t before[FA100M14B4C_GROUP_MEMBERS], tt;
+	uint64_t min = U64_MAX, max = 0;
+	unsigned int i, n = 0;
+	struct zio_attribute *ext;
+	struct fa_dev *fa;
+
+	for (i = 0; i < group->n_member; ++i) {
+		fa = group->member[i];
+		ext = fa->zdev->cset->ti->zattr_set.ext_zattr;
+		if (!(ext[FA100M14B4C_TATTR_SRC].value &
+		      FA100M14B4C_TRG_SRC_SW)) {
+			dev_info(fa->msgdev, "sw trigger is not enabled\n");
+			return -EPERM;
+		}
+		before[i] = fa_group_trg_ticks(fa);
+	}
+	fa_group_fire(group, ZFAT_SW, 1);
+
+	/* The trigger time stamp changes only on the boards that fired */
+	for (i = 0; i < group->n_member; ++i) {
+		fa = group->member[i];
+		tt = fa_group_trg_ticks(fa);
+		if (tt == before[i]) {
+			dev_warn(fa->msgdev,
+				 "group sw trigger ignored (not waiting for trigger)\n");
+			continue;
+		}
+		min = min(min, tt);
+		max = max(max, tt);
+		n++;
+	}
+	group->skew_valid = n > 0;
+	group->skew = min_t(uint64_t, max - min, U32_MAX);
+
+	return 0;
+}
+
+/* It removes a board from its group. The caller holds the lock */
+static void __fa_group_leave(struct fa_dev *fa)
+{
+	struct fa_group *group = &fa_groups[fa->group];
+	unsigned int i;
+
+	if (!fa->group)
+		return;
+	for (i = 0; i < group->n_member; ++i)
+		if (group->member[i] == fa)
+			break;
+	if (i < group->n_member) {
+		group->n_member--;
+		memmove(&group->member[i], &group->member[i + 1],
+			(group->n_member - i) * sizeof(group->member[0]));
+	}
+	fa->group = 0;
+}
+
+/**
+ * It moves the board to a group
+ *
+ * @param fa the fmc-adc descriptor
+ * @param group the group, 0 to leave any group
+ *
+ * @return 0 on success, otherwise a negative error number
+ */
+int fa_group_join(struct fa_dev *fa, unsigned int group)
+{
+	struct fa_group *new;
+	unsigned long flags;
+	int err = 0;
+
+	if (group > FA100M14B4C_GROUP_N)
+		return -EINVAL;
+	new = &fa_groups[group];
+
+	spin_lock_irqsave(&fa_group_lock, flags);
+	if (group == fa->group)
+		goto out;
+	if (group && new->n_member == FA100M14B4C_GROUP_MEMBERS) {
+		dev_err(fa->msgdev, "group %u is full (%u boards)\n",
+			group, FA100M14B4C_GROUP_MEMBERS);
+		err = -ENOSPC;
+		goto out;
+	}
+	__fa_group_leave(fa);
+	if (group) {
+		new->member[new->n_member++] = fa;
+		fa->group = group;
+	}
+out:
+	spin_unlock_irqrestore(&fa_group_lock, flags);
+
+	return err;
+}
+
+/**
+ * It runs a group command on all the boards of the group of this board
+ *
+ * @param fa the fmc-adc descriptor
+ * @param command enum fa100m14b4c_group_cmd
+ *
+ * @return 0 on success, otherwise a negative error number
+ */
+int fa_group_command(struct fa_dev *fa, uint32_t command)
+{
+	struct fa_group *group;
+	unsigned long flags;
+	int err = 0;
+
+	spin_lock_irqsave(&fa_group_lock, flags);
+	if (!fa->group) {
+		err = -ENOENT;
+		goto out;
+	}
+	group = &fa_groups[fa->group];
+
+	switch (command) {
+	case FA100M14B4C_GROUP_START:
+		err = fa_group_start(group);
+		break;
+	case FA100M14B4C_GROUP_STOP:
+		fa_group_stop(group);
+		break;
+	case FA100M14B4C_GROUP_SW_TRIGGER:
+		err = fa_group_sw_trigger(group);
+		break;
+	default:
+		err = -EINVAL;
+		break;
+	}
+out:
+	spin_unlock_irqrestore(&fa_group_lock, flags);
+
+	return err;
+}
+
+/**
+ * It returns the outcome of the last command of the group of this board
+ *
+ * @param fa the fmc-adc descriptor
+ * @param skew trigger time spread of the last software trigger (UTC
+ *             ticks), U32_MAX when unknown
+ * @param fire_ns duration of the last loop of writes
+ */
+void fa_group_result(struct fa_dev *fa, uint32_t *skew, uint32_t *fire_ns)
+{
+	struct fa_group *group;
+	unsigned long flags;
+
+	spin_lock_irqsave(&fa_group_lock, flags);
+	group = &fa_groups[fa->group];
+	*skew = fa->group && group->skew_valid ? group->skew : U32_MAX;
+	*fire_ns = fa->group ? group->fire_ns : 0;
+	spin_unlock_irqrestore(&fa_group_lock, flags);
+}
+
+int fa_group_init(struct fa_dev *fa)
+{
+	fa->group = 0;
+
+	return 0;
+}
+
+void fa_group_exit(struct fa_dev *fa)
+{
+	fa_group_join(fa, 0);
+}
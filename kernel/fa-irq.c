@@ -11,10 +11,14 @@
 #include <linux/bitops.h>
 #include <linux/spinlock.h>
 #include <linux/io.h>
+#include <linux/cpumask.h>
+#include <linux/version.h>
 
 #include "fmc-adc-100m14b4cha.h"
 #include "fa-spec.h"
 
+static void fa_queue_irq_work(struct fa_dev *fa);
+
 /**
  * It maps the ZIO blocks with an sg table, then it starts the DMA transfer
  * from the ADC to the host memory.
@@ -77,6 +81,7 @@ int zfad_dma_start(struct zio_cset *cset)
 	}
 
 	dev_dbg(fa->msgdev, "Start DMA transfer\n");
+	fa_lat_stamp(fa, FA_LAT_DMA_START);
 	err = fa->carrier_op->dma_start(cset);
 	if (err)
 		return err;
@@ -84,6 +89,144 @@ int zfad_dma_start(struct zio_cset *cset)
 	return 0;
 }
 
+/**
+ * It tells if the next acquisition can start while the DMA drains the
+ * current one. The double buffer works only when:
+ * - the user enabled it together with the automatic start;
+ * - the carrier notifies the end of DMA asynchronously (SPEC interrupt,
+ *   SVEC transfer worker), otherwise the DMA transfer is already over
+ *   when dma_start() returns;
+ * - the acquisition is single-shot: in multi-shot mode the gateware
+ *   stores the shots from the beginning of the DDR, so the next
+ *   acquisition would overwrite the one under DMA.
+ *
+ * @param cset
+ */
+bool zfad_dbuf_usable(struct zio_cset *cset)
+{
+	struct fa_dev *fa = cset->zdev->priv_d;
+
+	return fa->enable_dbuf && fa->enable_auto_start &&
+		(fa->irq_src & FA_IRQ_SRC_DMA) &&
+		cset->trig == &zfat_type && fa->n_shots == 1;
+}
+
+/**
+ * It prepares the blocks for the next acquisition. They are kept aside
+ * until the DMA transfer of the current acquisition is over.
+ *
+ * @param cset
+ */
+static int zfad_dbuf_prepare(struct zio_cset *cset)
+{
+	struct fa_dev *fa = cset->zdev->priv_d;
+	struct zio_ti *ti = cset->ti;
+
+	fa->dbuf_block = zfat_blocks_get(ti, fa->n_shots, zfat_shot_size(ti));
+	if (!fa->dbuf_block)
+		return -ENOMEM;
+	fa->dbuf_n_shots = fa->n_shots;
+
+	return 0;
+}
+
+/*
+ * The DMA drained the previous acquisition, or it never will: fa_irq_work()
+ * goes on if it was waiting for it. The caller holds the cset lock
+ */
+static void zfad_dbuf_resume(struct fa_dev *fa)
+{
+	if (!fa->dbuf_wait)
+		return;
+	fa->dbuf_wait = false;
+	fa->dbuf_resume = true;
+	fa_queue_irq_work(fa);
+}
+
+/**
+ * It starts the next acquisition while the DMA is draining the previous one.
+ * The trigger remains armed: the prepared blocks replace the current ones
+ * on DMA_DONE (zfad_dbuf_swap())
+ *
+ * @param cset
+ */
+static void zfad_dbuf_start(struct zio_cset *cset)
+{
+	struct fa_dev *fa = cset->zdev->priv_d;
+	struct zio_ti *ti = cset->ti;
+
+	dev_dbg(fa->msgdev, "Double buffer start\n");
+	fa_writel(fa, fa->fa_adc_csr_base, &zfad_regs[ZFA_CTL_RST_TRG_STA], 1);
+	fa_writel(fa, fa->fa_adc_csr_base, &zfad_regs[ZFA_CTL_FMS_CMD],
+		  FA100M14B4C_CMD_START);
+	fa_writel(fa, fa->fa_adc_csr_base, &zfad_regs[ZFAT_CFG_SRC],
+		  ti->zattr_set.ext_zattr[FA100M14B4C_TATTR_SRC].value);
+}
+
+/**
+ * It stores the drained blocks and it replaces them with the blocks of
+ * the running acquisition.
+ *
+ * The gateware writes the DDR as a circular buffer, so the running
+ * acquisition may have reached the region under DMA if it was waiting
+ * for a trigger long enough. The sample counter tells us how much
+ * it wrote: when it is beyond its own region the drained blocks are
+ * marked with FA100M14B4C_DALARM_DBUF_OVERRUN
+ *
+ * @param cset
+ */
+static void zfad_dbuf_swap(struct zio_cset *cset)
+{
+	struct fa_dev *fa = cset->zdev->priv_d;
+	struct zio_channel *interleave = cset->interleave;
+	struct zfad_block *zfad_block = interleave->priv_d;
+	unsigned long flags;
+	uint32_t count;
+	int i;
+
+	count = fa_readl(fa, fa->fa_adc_csr_base, &zfad_regs[ZFAT_CNT]);
+	if (count * cset->ssize * FA100M14B4C_NCHAN >
+	    FA100M14B4C_MAX_ACQ_BYTE_DBUF) {
+		dev_warn(fa->msgdev,
+			 "Double buffer overrun, acquisition may be corrupted\n");
+		for (i = 0; i < fa->n_shots; ++i)
+			zio_get_ctrl(zfad_block[i].block)->drv_alarms |=
+				FA100M14B4C_DALARM_DBUF_OVERRUN;
+		fa->n_dbuf_overrun++;
+	}
+
+	zfat_blocks_store(cset, zfad_block, fa->n_shots, fa->n_fires);
+
+	spin_lock_irqsave(&cset->lock, flags);
+	interleave->priv_d = fa->dbuf_block;
+	fa->n_shots = fa->dbuf_n_shots;
+	fa->n_fires = 0;
+	fa->dbuf_block = NULL;
+	zfad_dbuf_resume(fa);
+	spin_unlock_irqrestore(&cset->lock, flags);
+}
+
+/**
+ * It releases the prepared blocks when the double buffer cannot go on
+ *
+ * @param cset
+ */
+static void zfad_dbuf_abort(struct zio_cset *cset)
+{
+	struct fa_dev *fa = cset->zdev->priv_d;
+	struct zfad_block *zfad_block;
+	unsigned long flags;
+
+	spin_lock_irqsave(&cset->lock, flags);
+	zfad_block = fa->dbuf_block;
+	fa->dbuf_block = NULL;
+	zfad_dbuf_resume(fa);
+	spin_unlock_irqrestore(&cset->lock, flags);
+
+	if (zfad_block)
+		zfat_blocks_free(cset, zfad_block, fa->dbuf_n_shots);
+}
+
 /**
  * It completes a DMA transfer.
  * It tells to the ZIO framework that all blocks are done. Then, it re-enable
@@ -101,24 +244,24 @@ void zfad_dma_done(struct zio_cset *cset)
 	struct zio_control *ctrl = NULL;
 	struct zio_ti *ti = cset->ti;
 	struct zio_block *block;
-	struct zio_timestamp ztstamp;
 	int i;
 	uint32_t *trig_timetag;
 
+	fa_lat_stamp(fa, FA_LAT_DMA_DONE);
 	fa->carrier_op->dma_done(cset);
 
+	if (fa->stream.running) {
+		fa_stream_dma_done(cset);
+		return;
+	}
+
 	/* for each shot, set the timetag of each ctrl block by reading the
 	 * trig-timetag appended after the samples. Set also the acquisition
-	 * start timetag on every blocks
+	 * start timetag on every blocks, read by fa_irq_work()
 	 */
-	ztstamp.secs = fa_readl(fa, fa->fa_utc_base,
-				&zfad_regs[ZFA_UTC_ACQ_START_SECONDS]);
-	ztstamp.ticks = fa_readl(fa, fa->fa_utc_base,
-				 &zfad_regs[ZFA_UTC_ACQ_START_COARSE]);
-	ztstamp.bins = fa_readl(fa, fa->fa_utc_base,
-				&zfad_regs[ZFA_UTC_ACQ_START_FINE]);
 	for (i = 0; i < fa->n_shots; ++i) {
 		block = zfad_block[i].block;
+		fa_count_add(fa, FA100M14B4C_CNT_DMA_BYTES, block->datalen);
 		ctrl = zio_get_ctrl(block);
 		trig_timetag = (uint32_t *)(block->data + block->datalen
 					    - FA_TRIG_TIMETAG_BYTES);
@@ -135,17 +278,21 @@ void zfad_dma_done(struct zio_cset *cset)
 
 		/* Acquisition start Timetag */
 		ctrl->attr_channel.ext_val[FA100M14B4C_DATTR_ACQ_START_S] =
-								ztstamp.secs;
+							fa->acq_start.secs;
 		ctrl->attr_channel.ext_val[FA100M14B4C_DATTR_ACQ_START_C] =
-								ztstamp.ticks;
+							fa->acq_start.ticks;
 		ctrl->attr_channel.ext_val[FA100M14B4C_DATTR_ACQ_START_F] =
-								ztstamp.bins;
+							fa->acq_start.bins;
 
 		/* resize the datalen, by removing the trigger tstamp */
 		block->datalen = block->datalen - FA_TRIG_TIMETAG_BYTES;
+		fa_stats_block(fa, block);
+		fa_decim_block(fa, block, false);
+		fa_pack_block(fa, block);
 
 		/* update seq num */
 		ctrl->seq_num = i;
+		fa_timetag_record(fa, ctrl);
 	}
 	/* Sync the channel current control with the last ctrl block*/
 	memcpy(&interleave->current_ctrl->tstamp,
@@ -155,10 +302,17 @@ void zfad_dma_done(struct zio_cset *cset)
 
 	/*
 	 * All DMA transfers done! Inform the trigger about this, so
-	 * it can store blocks into the buffer
+	 * it can store blocks into the buffer. In double buffer mode the
+	 * next acquisition is already running, so we store the blocks
+	 * ourselves and the trigger remains armed
 	 */
 	dev_dbg(fa->msgdev, "%i blocks transfered\n", fa->n_shots);
-	zio_trigger_data_done(cset);
+	if (fa->dbuf_block)
+		zfad_dbuf_swap(cset);
+	else
+		zio_trigger_data_done(cset);
+	fa_lat_stamp(fa, FA_LAT_DATA_DONE);
+	fa_lat_push(fa);
 
 	fa_writel(fa, fa->fa_adc_csr_base, &zfad_regs[ZFAT_CFG_SRC],
 		  ti->zattr_set.ext_zattr[FA100M14B4C_TATTR_SRC].value);
@@ -178,13 +332,74 @@ void zfad_dma_error(struct zio_cset *cset)
 	fa->carrier_op->dma_error(cset);
 
 	zfad_fsm_command(fa, FA100M14B4C_CMD_STOP);
+	zfad_dbuf_abort(cset);
 	fa->n_dma_err++;
+	fa_count_add(fa, FA100M14B4C_CNT_DMA_ERR, 1);
 
 	if (fa->n_fires == 0)
 		dev_err(fa->msgdev,
 			"DMA error occurs but no block was acquired\n");
 }
 
+/**
+ * It completes a DMA transfer in process context, like the DMA_DONE
+ * interrupt does on SPEC: the SVEC transfer worker and
+ * zfad_dma_done_defer() use it. Then, it starts the next acquisition when
+ * fa_irq_work() left it to us (FA_IRQ_SRC_DMA_WORK)
+ *
+ * @param cset
+ * @param err the outcome of the transfer
+ */
+void zfad_dma_complete(struct zio_cset *cset, int err)
+{
+	struct fa_dev *fa = cset->zdev->priv_d;
+	/*
+	 * In double buffer mode the next acquisition is already running.
+	 * Without FA_IRQ_SRC_DMA_WORK, fa_irq_work() already started it
+	 */
+	bool restart = (fa->irq_src & FA_IRQ_SRC_DMA_WORK) &&
+		       fa->enable_auto_start && !fa->dbuf_block &&
+		       !fa->stream.running;
+
+	if (err)
+		zfad_dma_error(cset);
+	else
+		zfad_dma_done(cset);
+
+	spin_lock_irq(&cset->lock);
+	cset->flags &= ~ZIO_CSET_HW_BUSY;
+	spin_unlock_irq(&cset->lock);
+
+	if (!err && restart) {
+		dev_dbg(fa->msgdev, "Automatic start\n");
+		zfad_fsm_command(fa, FA100M14B4C_CMD_START);
+	}
+}
+
+/*
+ * SPEC raises DMA_DONE in interrupt context: when the samples need a
+ * pass of the CPU (fa_dma_done_slow()) the transfer completes here
+ */
+static void zfad_dma_done_work(struct work_struct *work)
+{
+	struct fa_dev *fa = container_of(work, struct fa_dev, dma_done_work);
+
+	zfad_dma_complete(fa->zdev->cset, 0);
+}
+
+/**
+ * It defers the completion of a DMA transfer to process context. The
+ * cset remains busy until then. This uses the high priority system
+ * workqueue, so the completion does not queue behind the acquisition
+ * work
+ *
+ * @param fa the fmc-adc descriptor
+ */
+void zfad_dma_done_defer(struct fa_dev *fa)
+{
+	queue_work(system_highpri_wq, &fa->dma_done_work);
+}
+
 /*
  * zfat_irq_acq_end
  * @fa: fmc-adc descriptor
@@ -219,9 +434,9 @@ void zfat_irq_acq_end(struct zio_cset *cset)
 /*
  * job executed within a work thread
  * Depending of the carrier the job slightly differs:
- * SVEC: dma_start() blocks till the the DMA ends
- *      (fully managed by the vmebus driver)
- * Therefore the DMA outcome can be processed immediately
+ * SVEC: dma_start() queues the transfer on the carrier worker and it
+ *       returns immediately. The worker, once the vmebus driver is
+ *       done, calls zfad_dma_complete()
  * SPEC: dma_start() launch the job an returns immediately.
  * An interrupt DMA_DONE or ERROR is expecting to signal the end
  *       of the DMA transaction
@@ -232,10 +447,62 @@ static void fa_irq_work(struct work_struct *work)
 {
 	struct fa_dev *fa = container_of(work, struct fa_dev, irq_work);
 	struct zio_cset *cset = fa->zdev->cset;
+	bool dbuf = false, resume, busy = false;
 	int res;
 
+	spin_lock_irq(&cset->lock);
+	if (fa->dbuf_block) {
+		/*
+		 * Double buffer: this acquisition ended before the DMA
+		 * drained the previous one. Do not block the worker: the
+		 * drain queues this work again (zfad_dbuf_resume()). The
+		 * IRQ is acknowledged then
+		 */
+		fa->dbuf_wait = true;
+		spin_unlock_irq(&cset->lock);
+		return;
+	}
+	resume = fa->dbuf_resume;
+	fa->dbuf_resume = false;
+	if (resume) {
+		/* DMA_DONE lowers CSET_HW_BUSY so we must raise it again */
+		busy = cset->interleave->priv_d &&
+		       (cset->ti->flags & ZIO_TI_ARMED);
+		if (busy)
+			cset->flags |= ZIO_CSET_HW_BUSY;
+	}
+	spin_unlock_irq(&cset->lock);
+	if (resume) {
+		if (!busy) {
+			fmc_irq_ack(fa->fmc);
+			return;
+		}
+		/* keep the IRQ sequence check consistent: ACQ then DMA */
+		fa->last_irq_core_src = fa->fa_irq_adc_base;
+	}
+
+	if (fa_lat_enabled(fa)) {
+		fa->lat->cur[FA_LAT_ACQ_END] = fa->lat->acq_end;
+		fa_lat_stamp(fa, FA_LAT_WORK);
+	}
+	/*
+	 * The start time of the acquisition that just ended: in double
+	 * buffer mode the next one starts before DMA_DONE
+	 */
+	fa->acq_start.secs = fa_readl(fa, fa->fa_utc_base,
+				      &zfad_regs[ZFA_UTC_ACQ_START_SECONDS]);
+	fa->acq_start.ticks = fa_readl(fa, fa->fa_utc_base,
+				       &zfad_regs[ZFA_UTC_ACQ_START_COARSE]);
+	fa->acq_start.bins = fa_readl(fa, fa->fa_utc_base,
+				      &zfad_regs[ZFA_UTC_ACQ_START_FINE]);
 	zfat_irq_acq_end(cset);
+	if (zfad_dbuf_usable(cset))
+		dbuf = !zfad_dbuf_prepare(cset);
 	res = zfad_dma_start(cset);
+	if (res && dbuf) {
+		zfad_dbuf_abort(cset);
+		dbuf = false;
+	}
 	if (!res) {
 		/*
 		 * No error.
@@ -244,14 +511,19 @@ static void fa_irq_work(struct work_struct *work)
 		 * dma_done will be proceed on DMA_END reception.
 		 * Otherwhise call dma_done in sequence
 		 */
-		if (fa->irq_src & FA_IRQ_SRC_DMA)
+		if (fa->irq_src & FA_IRQ_SRC_DMA) {
 			/*
 			 * waiting for END_OF_DMA IRQ
 			 * with the CSET_BUSY flag Raised
 			 * The flag will be lowered by the irq_handler
 			 * handling END_DMA
+			 * In double buffer mode the next acquisition
+			 * starts now, while the DMA is running
 			 */
+			if (dbuf)
+				zfad_dbuf_start(cset);
 			goto end;
+		}
 
 		zfad_dma_done(cset);
 	}
@@ -266,7 +538,8 @@ end:
 	if (res) {
 		/* Stop acquisition on error */
 		zfad_dma_error(cset);
-	} else if (fa->enable_auto_start) {
+	} else if (fa->enable_auto_start && !dbuf &&
+		   !(fa->irq_src & FA_IRQ_SRC_DMA_WORK)) {
 		/* Automatic start next acquisition */
 		dev_dbg(fa->msgdev, "Automatic start\n");
 		zfad_fsm_command(fa, FA100M14B4C_CMD_START);
@@ -299,6 +572,20 @@ static void fa_get_irq_status(struct fa_dev *fa, int irq_core_base,
 				*irq_status);
 }
 
+/*
+ * It queues the acquisition work on the device worker, on the CPU chosen
+ * by the user when it is online
+ */
+static void fa_queue_irq_work(struct fa_dev *fa)
+{
+	int cpu = READ_ONCE(fa->work_cpu);
+
+	if (cpu >= 0 && cpu < nr_cpu_ids && cpu_online(cpu))
+		queue_work_on(cpu, fa->wq, &fa->irq_work);
+	else
+		queue_work(fa->wq, &fa->irq_work);
+}
+
 /*
  * fa_irq_handler
  * @irq:
@@ -331,6 +618,12 @@ irqreturn_t fa_irq_handler(int irq_core_base, void *dev_id)
 	dev_dbg(fa->msgdev, "Handle ADC interrupts fmc slot: %d\n",
 		fmc->slot_id);
 
+	if (fa->stream.running) {
+		/* The stream work follows the acquisition */
+		fmc_irq_ack(fmc);
+		return IRQ_HANDLED;
+	}
+
 	if (status & FA_IRQ_ADC_ACQ_END) {
 		/*
 		 * Acquiring samples is a critical section
@@ -347,9 +640,11 @@ irqreturn_t fa_irq_handler(int irq_core_base, void *dev_id)
 			cset->flags |= ZIO_CSET_HW_BUSY;
 		spin_unlock_irqrestore(&cset->lock, flags);
 		if (cset->flags & ZIO_CSET_HW_BUSY) {
+			if (fa_lat_enabled(fa))
+				fa->lat->acq_end = ktime_get_ns();
 			/* Job deferred to the workqueue: */
 			/* Start DMA and ack irq on the carrier */
-			queue_work(fa_workqueue, &fa->irq_work);
+			fa_queue_irq_work(fa);
 			/* register the core firing the IRQ in order to */
 			/* check right IRQ seq.: ACQ_END followed by DMA_END */
 			fa->last_irq_core_src = irq_core_base;
@@ -369,8 +664,29 @@ irqreturn_t fa_irq_handler(int irq_core_base, void *dev_id)
 int fa_setup_irqs(struct fa_dev *fa)
 {
 	struct fmc_device *fmc = fa->fmc;
+	unsigned int flags = WQ_MEM_RECLAIM | WQ_HIGHPRI;
 	int err;
 
+	/*
+	 * Each device has its own worker, so a slow DMA setup on a board
+	 * does not delay the others. The workqueue is per-cpu: by default
+	 * the work runs on the CPU that got the interrupt
+	 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,15,0)
+	flags |= WQ_NON_REENTRANT;
+#endif
+	fa->wq = alloc_workqueue("%s", flags, 1, dev_name(fa->msgdev));
+	if (!fa->wq)
+		return -ENOMEM;
+	fa->work_cpu = fa_work_cpu;
+	/* workqueue is required to execute DMA transaction */
+	INIT_WORK(&fa->irq_work, fa_irq_work);
+	INIT_WORK(&fa->dma_done_work, zfad_dma_done_work);
+	fa->dbuf_wait = false;
+	fa->dbuf_resume = false;
+	fa_stream_init(fa);
+	fa_decim_init(fa);
+
 	/* Request IRQ */
 	dev_dbg(fa->msgdev, "%s request irq fmc slot: %d\n",
 		__func__, fa->fmc->slot_id);
@@ -393,17 +709,27 @@ int fa_setup_irqs(struct fa_dev *fa)
 	if (err) {
 		dev_err(fa->msgdev, "can't request irq %i (error %i)\n",
 			fa->fmc->irq, err);
-		return err;
+		goto out_irq;
 	}
-	/* workqueue is required to execute DMA transaction */
-	INIT_WORK(&fa->irq_work, fa_irq_work);
 
 	/* set IRQ sources to listen */
 	fa->irq_src = FA_IRQ_SRC_ACQ;
 
-	if (fa->carrier_op->setup_irqs)
+	if (fa->carrier_op->setup_irqs) {
 		err = fa->carrier_op->setup_irqs(fa);
+		if (err)
+			goto out_carrier;
+	}
+
+	return 0;
 
+out_carrier:
+	fmc->irq = fa->fa_irq_adc_base;
+	fmc_irq_free(fmc);
+	cancel_work_sync(&fa->dma_done_work);
+out_irq:
+	/* It waits for the pending work */
+	destroy_workqueue(fa->wq);
 	return err;
 }
 
@@ -416,6 +742,7 @@ int fa_free_irqs(struct fa_dev *fa)
 	 * rises interrupts. Disable IRQs in order to prevent spurious
 	 * interrupt when the driver is not there to handle them.
 	 */
+	fa_stream_exit(fa);
 	fa_disable_irqs(fa);
 
 	/* Release carrier IRQs (if any) */
@@ -425,6 +752,10 @@ int fa_free_irqs(struct fa_dev *fa)
 	/* Release ADC IRQs */
 	fmc->irq = fa->fa_irq_adc_base;
 	fmc_irq_free(fmc);
+	cancel_work_sync(&fa->dma_done_work);
+
+	/* It waits for the pending work */
+	destroy_workqueue(fa->wq);
 
 	return 0;
 }
@@ -0,0 +1,54 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright CERN 2019
+ *
+ * Packed samples. The ADC resolution is 14 bits but every sample takes
+ * 16 bits in the blocks. When packing is enabled the driver drops the
+ * two least significant bits of each sample and it packs the four
+ * channels of a sampling instant in 7 bytes instead of 8. Blocks carry
+ * FA100M14B4C_DALARM_PACKED; user space unpacks them with fau_unpack().
+ */
+
+#include <linux/kernel.h>
+#include <asm/unaligned.h>
+
+#include "fmc-adc-100m14b4cha.h"
+
+#define FA_PACK_FRAME_BYTES (FA100M14B4C_NCHAN * sizeof(int16_t))
+
+/**
+ * It packs the samples of a block, in place. Each sampling instant
+ * becomes a 56-bit little endian word: channel N in bits 14N..14N+13
+ *
+ * @param fa the fmc-adc descriptor
+ * @param block block of interleaved samples, without time-tag
+ */
+void fa_pack_block(struct fa_dev *fa, struct zio_block *block)
+{
+	struct zio_control *ctrl = zio_get_ctrl(block);
+	const int16_t *in = block->data;
+	uint8_t *out = block->data;
+	size_t i, n;
+	uint64_t w;
+	int k;
+
+	if (!fa->enable_pack)
+		return;
+
+	fa_block_cpu_order(block);
+	n = block->datalen / FA_PACK_FRAME_BYTES;
+	/*
+	 * The output never overtakes the input: the 8-byte store spills
+	 * on the instant already read, and the next one overwrites it
+	 */
+	for (i = 0; i < n; ++i, in += FA100M14B4C_NCHAN,
+	     out += FA100M14B4C_PACK_FRAME_BYTES) {
+		w = 0;
+		for (k = 0; k < FA100M14B4C_NCHAN; ++k)
+			w |= (uint64_t)((uint16_t)in[k] >> 2) << (14 * k);
+		put_unaligned_le64(w, out);
+	}
+
+	block->datalen = n * FA100M14B4C_PACK_FRAME_BYTES;
+	ctrl->drv_alarms |= FA100M14B4C_DALARM_PACKED;
+}
@@ -7,17 +7,20 @@
  */
 #include "fmc-adc-100m14b4cha.h"
 
-/* Definition of the fmc-adc registers fields: offset - mask - isbitfield */
+/*
+ * Definition of the fmc-adc registers fields:
+ * offset - mask - isbitfield - shadow slot - isstrobe
+ */
 const struct zfa_field_desc zfad_regs[] = {
 	/* Control registers */
-	[ZFA_CTL_FMS_CMD] =		{0x00, 0x00000003, 1},
-	[ZFA_CTL_CLK_EN] =		{0x00, 0x00000004, 1},
-	[ZFA_CTL_DAC_CLR_N] =		{0x00, 0x00000008, 1},
-	[ZFA_CTL_BSLIP] =		{0x00, 0x00000010, 1},
-	[ZFA_CTL_TEST_DATA_EN] =	{0x00, 0x00000020, 1},
-	[ZFA_CTL_TRIG_LED] =		{0x00, 0x00000040, 1},
-	[ZFA_CTL_ACQ_LED] =		{0x00, 0x00000080, 1},
-	[ZFA_CTL_RST_TRG_STA] =	{0x00, 0x00000100, 1},
+	[ZFA_CTL_FMS_CMD] =		{0x00, 0x00000003, 1, FA_SHADOW_CTL, 1},
+	[ZFA_CTL_CLK_EN] =		{0x00, 0x00000004, 1, FA_SHADOW_CTL, 0},
+	[ZFA_CTL_DAC_CLR_N] =		{0x00, 0x00000008, 1, FA_SHADOW_CTL, 0},
+	[ZFA_CTL_BSLIP] =		{0x00, 0x00000010, 1, FA_SHADOW_CTL, 1},
+	[ZFA_CTL_TEST_DATA_EN] =	{0x00, 0x00000020, 1, FA_SHADOW_CTL, 0},
+	[ZFA_CTL_TRIG_LED] =		{0x00, 0x00000040, 1, FA_SHADOW_CTL, 0},
+	[ZFA_CTL_ACQ_LED] =		{0x00, 0x00000080, 1, FA_SHADOW_CTL, 0},
+	[ZFA_CTL_RST_TRG_STA] =	{0x00, 0x00000100, 1, FA_SHADOW_CTL, 1},
 	/* Status registers */
 	[ZFA_STA_FSM] =		{0x04, 0x00000007, 1},
 	[ZFA_STA_SERDES_PLL] =		{0x04, 0x00000008, 1},
@@ -25,14 +28,14 @@ const struct zfa_field_desc zfad_regs[] = {
 	/* Trigger */
 		/* Config register */
 	[ZFAT_CFG_STA] =		{0x08, 0xFFFFFFFF, 0},
-	[ZFAT_CFG_SRC] =		{0x0C, 0xFFFFFFFF, 0},
-	[ZFAT_CFG_POL] =		{0x10, 0xFFFFFFFF, 0},
+	[ZFAT_CFG_SRC] =		{0x0C, 0xFFFFFFFF, 0, FA_SHADOW_TRG_SRC, 0},
+	[ZFAT_CFG_POL] =		{0x10, 0xFFFFFFFF, 0, FA_SHADOW_TRG_POL, 0},
 		/* Delay */
-	[ZFAT_EXT_DLY] =		{0x14, 0xFFFFFFFF, 0},
+	[ZFAT_EXT_DLY] =		{0x14, 0xFFFFFFFF, 0, FA_SHADOW_TRG_DLY, 0},
 		/* Software */
 	[ZFAT_SW] =			{0x18, 0xFFFFFFFF, 0},
 		/* Number of shots */
-	[ZFAT_SHOTS_NB] =		{0x1C, 0x0000FFFF, 0},
+	[ZFAT_SHOTS_NB] =		{0x1C, 0x0000FFFF, 0, FA_SHADOW_SHOTS_NB, 0},
 		/* Multishot max samples*/
 	[ZFA_MULT_MAX_SAMP] =		{0x20, 0xFFFFFFFF, 0},
 		/* Remaining shots counter */
@@ -42,57 +45,57 @@ const struct zfa_field_desc zfad_regs[] = {
 		/* Sampling clock frequency */
 	[ZFAT_SAMPLING_HZ] =		{0x2C, 0xFFFFFFFF, 0},
 		/* Sample rate */
-	[ZFAT_SR_UNDER] =		{0x30, 0xFFFFFFFF, 0},
+	[ZFAT_SR_UNDER] =		{0x30, 0xFFFFFFFF, 0, FA_SHADOW_SR_UNDER, 0},
 		/* Pre-sample */
-	[ZFAT_PRE] =			{0x34, 0xFFFFFFFF, 0},
+	[ZFAT_PRE] =			{0x34, 0xFFFFFFFF, 0, FA_SHADOW_PRE, 0},
 		/* Post-sample */
-	[ZFAT_POST] =			{0x38, 0xFFFFFFFF, 0},
+	[ZFAT_POST] =			{0x38, 0xFFFFFFFF, 0, FA_SHADOW_POST, 0},
 		/* Sample counter */
 	[ZFAT_CNT] =			{0x3C, 0xFFFFFFFF, 0},
 
 	/* Channel 1 */
-	[ZFA_CH1_CTL_RANGE] =		{0x80, 0x00000077, 1},
-	[ZFA_CH1_CTL_TERM] =		{0x80, 0x00000008, 1},
+	[ZFA_CH1_CTL_RANGE] =		{0x80, 0x00000077, 1, FA_SHADOW_CH1_CTL, 0},
+	[ZFA_CH1_CTL_TERM] =		{0x80, 0x00000008, 1, FA_SHADOW_CH1_CTL, 0},
 	[ZFA_CH1_STA] =		{0x84, 0x0000FFFF, 0},
-	[ZFA_CH1_GAIN] =		{0x88, 0x0000FFFF, 0},
-	[ZFA_CH1_OFFSET] =		{0x8C, 0x0000FFFF, 0},
-	[ZFA_CH1_SAT] =		{0x90, 0x00007FFF, 0},
-	[ZFA_CH1_HYST] =		{0x94, 0xFFFF0000, 1},
-	[ZFA_CH1_THRES] =		{0x94, 0x0000FFFF, 1},
-	[ZFA_CH1_DLY] =		{0x98, 0xFFFFFFFF, 0},
+	[ZFA_CH1_GAIN] =		{0x88, 0x0000FFFF, 0, FA_SHADOW_CH1_GAIN, 0},
+	[ZFA_CH1_OFFSET] =		{0x8C, 0x0000FFFF, 0, FA_SHADOW_CH1_OFFSET, 0},
+	[ZFA_CH1_SAT] =		{0x90, 0x00007FFF, 0, FA_SHADOW_CH1_SAT, 0},
+	[ZFA_CH1_HYST] =		{0x94, 0xFFFF0000, 1, FA_SHADOW_CH1_THRES, 0},
+	[ZFA_CH1_THRES] =		{0x94, 0x0000FFFF, 1, FA_SHADOW_CH1_THRES, 0},
+	[ZFA_CH1_DLY] =		{0x98, 0xFFFFFFFF, 0, FA_SHADOW_CH1_DLY, 0},
 
 	/* Channel 2 */
-	[ZFA_CH2_CTL_RANGE] =		{0x100, 0x00000077, 1},
-	[ZFA_CH2_CTL_TERM] =		{0x100, 0x00000008, 1},
+	[ZFA_CH2_CTL_RANGE] =		{0x100, 0x00000077, 1, FA_SHADOW_CH2_CTL, 0},
+	[ZFA_CH2_CTL_TERM] =		{0x100, 0x00000008, 1, FA_SHADOW_CH2_CTL, 0},
 	[ZFA_CH2_STA] =		{0x104, 0x0000FFFF, 0},
-	[ZFA_CH2_GAIN] =		{0x108, 0x0000FFFF, 0},
-	[ZFA_CH2_OFFSET] =		{0x10C, 0x0000FFFF, 0},
-	[ZFA_CH2_SAT] =		{0x110, 0x00007FFF, 0},
-	[ZFA_CH2_HYST] =		{0x114, 0xFFFF0000, 1},
-	[ZFA_CH2_THRES] =		{0x114, 0x0000FFFF, 1},
-	[ZFA_CH2_DLY] =		{0x118, 0xFFFFFFFF, 0},
+	[ZFA_CH2_GAIN] =		{0x108, 0x0000FFFF, 0, FA_SHADOW_CH2_GAIN, 0},
+	[ZFA_CH2_OFFSET] =		{0x10C, 0x0000FFFF, 0, FA_SHADOW_CH2_OFFSET, 0},
+	[ZFA_CH2_SAT] =		{0x110, 0x00007FFF, 0, FA_SHADOW_CH2_SAT, 0},
+	[ZFA_CH2_HYST] =		{0x114, 0xFFFF0000, 1, FA_SHADOW_CH2_THRES, 0},
+	[ZFA_CH2_THRES] =		{0x114, 0x0000FFFF, 1, FA_SHADOW_CH2_THRES, 0},
+	[ZFA_CH2_DLY] =		{0x118, 0xFFFFFFFF, 0, FA_SHADOW_CH2_DLY, 0},
 
 	/* Channel 3 */
-	[ZFA_CH3_CTL_RANGE] =		{0x180, 0x00000077, 1},
-	[ZFA_CH3_CTL_TERM] =		{0x180, 0x00000008, 1},
+	[ZFA_CH3_CTL_RANGE] =		{0x180, 0x00000077, 1, FA_SHADOW_CH3_CTL, 0},
+	[ZFA_CH3_CTL_TERM] =		{0x180, 0x00000008, 1, FA_SHADOW_CH3_CTL, 0},
 	[ZFA_CH3_STA] =		{0x184, 0x0000FFFF, 0},
-	[ZFA_CH3_GAIN] =		{0x188, 0x0000FFFF, 0},
-	[ZFA_CH3_OFFSET] =		{0x18C, 0x0000FFFF, 0},
-	[ZFA_CH3_SAT] =		{0x190, 0x00007FFF, 0},
-	[ZFA_CH3_HYST] =		{0x194, 0xFFFF0000, 1},
-	[ZFA_CH3_THRES] =		{0x194, 0x0000FFFF, 1},
-	[ZFA_CH3_DLY] =		{0x198, 0xFFFFFFFF, 0},
+	[ZFA_CH3_GAIN] =		{0x188, 0x0000FFFF, 0, FA_SHADOW_CH3_GAIN, 0},
+	[ZFA_CH3_OFFSET] =		{0x18C, 0x0000FFFF, 0, FA_SHADOW_CH3_OFFSET, 0},
+	[ZFA_CH3_SAT] =		{0x190, 0x00007FFF, 0, FA_SHADOW_CH3_SAT, 0},
+	[ZFA_CH3_HYST] =		{0x194, 0xFFFF0000, 1, FA_SHADOW_CH3_THRES, 0},
+	[ZFA_CH3_THRES] =		{0x194, 0x0000FFFF, 1, FA_SHADOW_CH3_THRES, 0},
+	[ZFA_CH3_DLY] =		{0x198, 0xFFFFFFFF, 0, FA_SHADOW_CH3_DLY, 0},
 
 	/* Channel 4 */
-	[ZFA_CH4_CTL_RANGE] =		{0x200, 0x00000077, 1},
-	[ZFA_CH4_CTL_TERM] =		{0x200, 0x00000008, 1},
+	[ZFA_CH4_CTL_RANGE] =		{0x200, 0x00000077, 1, FA_SHADOW_CH4_CTL, 0},
+	[ZFA_CH4_CTL_TERM] =		{0x200, 0x00000008, 1, FA_SHADOW_CH4_CTL, 0},
 	[ZFA_CH4_STA] =		{0x204, 0x0000FFFF, 0},
-	[ZFA_CH4_GAIN] =		{0x208, 0x0000FFFF, 0},
-	[ZFA_CH4_OFFSET] =		{0x20C, 0x0000FFFF, 0},
-	[ZFA_CH4_SAT] =		{0x210, 0x00007FFF, 0},
-	[ZFA_CH4_HYST] =		{0x214, 0xFFFF0000, 1},
-	[ZFA_CH4_THRES] =		{0x214, 0x0000FFFF, 1},
-	[ZFA_CH4_DLY] =		{0x218, 0xFFFFFFFF, 0},
+	[ZFA_CH4_GAIN] =		{0x208, 0x0000FFFF, 0, FA_SHADOW_CH4_GAIN, 0},
+	[ZFA_CH4_OFFSET] =		{0x20C, 0x0000FFFF, 0, FA_SHADOW_CH4_OFFSET, 0},
+	[ZFA_CH4_SAT] =		{0x210, 0x00007FFF, 0, FA_SHADOW_CH4_SAT, 0},
+	[ZFA_CH4_HYST] =		{0x214, 0xFFFF0000, 1, FA_SHADOW_CH4_THRES, 0},
+	[ZFA_CH4_THRES] =		{0x214, 0x0000FFFF, 1, FA_SHADOW_CH4_THRES, 0},
+	[ZFA_CH4_DLY] =		{0x218, 0xFFFFFFFF, 0, FA_SHADOW_CH4_DLY, 0},
 
 	/* IRQ */
 	[ZFA_IRQ_ADC_DISABLE_MASK] =	{0x00, 0x00000003, 0},
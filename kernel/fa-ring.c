@@ -0,0 +1,455 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright CERN 2019
+ *
+ * Memory mapped ring: the DMA writes the shots directly in memory that
+ * user space maps, and a small header tells which slots are ready.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/log2.h>
+#include <linux/mutex.h>
+#include <linux/fs.h>
+#include <linux/poll.h>
+#include <linux/miscdevice.h>
+#include <linux/workqueue.h>
+
+#include "fmc-adc-100m14b4cha.h"
+
+#define to_fa_ring(_misc) container_of(_misc, struct fa_ring, misc)
+
+/*
+ * The indexes are free running 32-bit values: n_slots is a power of two,
+ * so consecutive indexes stay on consecutive slots when they wrap
+ */
+static inline void *fa_ring_slot(struct fa_ring *ring, uint32_t idx)
+{
+	return ring->vaddr + ring->data_offset +
+		(idx & (ring->n_slots - 1)) * ring->slot_size;
+}
+
+/*
+ * The header is writable by user space: the driver reads only the tail
+ * from it, and it ignores a tail that is not between the slots in use.
+ * The caller holds the lock
+ */
+static uint32_t fa_ring_tail(struct fa_ring *ring)
+{
+	uint32_t tail = READ_ONCE(ring->hdr->tail);
+
+	if ((int32_t)(ring->head - tail) >= 0 &&
+	    ring->next - tail <= ring->n_slots)
+		ring->tail = tail;
+
+	return ring->tail;
+}
+
+/* It copies the geometry and the head to the header, under the lock */
+static void fa_ring_publish(struct fa_ring *ring)
+{
+	struct fa100m14b4c_ring_header *hdr = ring->hdr;
+
+	hdr->magic = FA100M14B4C_RING_MAGIC;
+	hdr->version = FA100M14B4C_RING_VERSION;
+	hdr->n_slots = ring->n_slots;
+	hdr->slot_size = ring->slot_size;
+	hdr->ctrl_size = ring->ctrl_size;
+	hdr->data_offset = ring->data_offset;
+	hdr->n_overrun = ring->n_overrun;
+	/* Slots must be in memory before user space sees them */
+	smp_wmb();
+	WRITE_ONCE(hdr->head, ring->head);
+}
+
+/*
+ * It sets the slot geometry for the given shot size. This is possible
+ * only when the ring is empty
+ */
+static int fa_ring_geometry(struct fa_ring *ring, size_t ctrl_size,
+			    unsigned int size)
+{
+	size_t slot_size = PAGE_ALIGN(ctrl_size + size);
+
+	if (ring->slot_size == slot_size && ring->ctrl_size == ctrl_size)
+		return 0;
+	if (ring->next != fa_ring_tail(ring))
+		return -EBUSY;
+	if (ring->size - ring->data_offset < slot_size)
+		return -ENOMEM;
+
+	ring->ctrl_size = ctrl_size;
+	ring->slot_size = slot_size;
+	ring->n_slots = rounddown_pow_of_two((ring->size - ring->data_offset) /
+					     slot_size);
+	fa_ring_publish(ring);
+
+	return 0;
+}
+
+/*
+ * fa_ring_blocks_get
+ * @cset: channel set
+ * @n_shots: number of shots to acquire
+ * @size: size of a single shot (zfat_shot_size())
+ *
+ * Give to the acquisition n_shots consecutive ring slots. The blocks
+ * point to the slots, so the DMA writes directly into the ring. It
+ * returns NULL when the ring is full: like for a full ZIO buffer, the
+ * acquisition cannot be armed
+ */
+struct zfad_block *fa_ring_blocks_get(struct zio_cset *cset,
+				      unsigned int n_shots,
+				      unsigned int size)
+{
+	struct fa_dev *fa = cset->zdev->priv_d;
+	struct fa_ring *ring = &fa->ring;
+	struct zio_channel *interleave = cset->interleave;
+	size_t ctrl_size = zio_control_size(interleave);
+	struct zfad_block *zfad_block;
+	struct zio_block *block;
+	struct zio_control *ctrl;
+	uint32_t dev_mem_off = 0;
+	unsigned long flags;
+	uint32_t idx;
+	int i, err;
+
+	zfad_block = kmalloc((sizeof(struct zfad_block) +
+			      sizeof(struct zio_block)) * n_shots, GFP_ATOMIC);
+	if (!zfad_block)
+		return NULL;
+	block = (struct zio_block *)(zfad_block + n_shots);
+
+	spin_lock_irqsave(&ring->lock, flags);
+	if (!ring->vaddr) {
+		err = -ENODEV;
+		goto out;
+	}
+	err = fa_ring_geometry(ring, ctrl_size, size);
+	if (err)
+		goto out;
+	if (ring->next + n_shots - fa_ring_tail(ring) > ring->n_slots) {
+		ring->n_overrun++;
+		fa_ring_publish(ring);
+		err = -ENOSPC;
+		goto out;
+	}
+	idx = ring->next;
+	ring->next += n_shots;
+
+	for (i = 0; i < n_shots; ++i, ++idx) {
+		ctrl = fa_ring_slot(ring, idx);
+		memcpy(ctrl, interleave->current_ctrl, ctrl_size);
+		memset(&block[i], 0, sizeof(struct zio_block));
+		zio_set_ctrl(&block[i], ctrl);
+		block[i].data = (void *)ctrl + ctrl_size;
+		block[i].datalen = size;
+
+		zfad_block[i].block = &block[i];
+		zfad_block[i].dev_mem_off = dev_mem_off;
+		zfad_block[i].ring = true;
+		zfad_block[i].ring_idx = idx;
+		dev_mem_off += size;
+	}
+	spin_unlock_irqrestore(&ring->lock, flags);
+
+	return zfad_block;
+
+out:
+	spin_unlock_irqrestore(&ring->lock, flags);
+	dev_err(fa->msgdev, "Cannot get %d ring slots (%d)\n", n_shots, err);
+	kfree(zfad_block);
+	return NULL;
+}
+
+/*
+ * fa_ring_blocks_store
+ * @cset: channel set
+ * @zfad_block: blocks to publish
+ * @n_shots: number of blocks
+ * @n_fires: number of blocks filled by a trigger fire
+ *
+ * Publish the filled slots to user space. Un-filled slots are given back
+ * to the ring, unless another acquisition already took the following
+ * slots: in this case they are published with nsamples set to 0
+ */
+void fa_ring_blocks_store(struct zio_cset *cset,
+			  struct zfad_block *zfad_block,
+			  unsigned int n_shots, unsigned int n_fires)
+{
+	struct fa_dev *fa = cset->zdev->priv_d;
+	struct fa_ring *ring = &fa->ring;
+	uint32_t first = zfad_block[0].ring_idx;
+	unsigned long flags;
+	unsigned int i;
+
+	spin_lock_irqsave(&ring->lock, flags);
+	if (n_fires < n_shots) {
+		if (ring->next == first + n_shots) {
+			ring->next = first + n_fires;
+			n_shots = n_fires;
+		} else {
+			for (i = n_fires; i < n_shots; ++i)
+				zio_get_ctrl(zfad_block[i].block)->nsamples = 0;
+		}
+	}
+	ring->head = first + n_shots;
+	fa_ring_publish(ring);
+	spin_unlock_irqrestore(&ring->lock, flags);
+
+	kfree(zfad_block);
+	wake_up_interruptible(&ring->wq);
+}
+
+/*
+ * fa_ring_blocks_free
+ * @cset: channel set
+ * @zfad_block: blocks to free
+ * @n_shots: number of blocks
+ *
+ * Give back the slots to the ring. Acquisitions are released in order,
+ * so any following slot is given back as well
+ */
+void fa_ring_blocks_free(struct zio_cset *cset,
+			 struct zfad_block *zfad_block,
+			 unsigned int n_shots)
+{
+	struct fa_dev *fa = cset->zdev->priv_d;
+	struct fa_ring *ring = &fa->ring;
+	uint32_t first = zfad_block[0].ring_idx;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ring->lock, flags);
+	if ((int32_t)(ring->next - first) > 0)
+		ring->next = first;
+	spin_unlock_irqrestore(&ring->lock, flags);
+
+	kfree(zfad_block);
+}
+
+/*
+ * fa_ring_resize
+ * @ring: the ring
+ * @size: new size of the ring (bytes, page aligned), 0 to disable it
+ *
+ * The ring can be resized only when nobody maps it: a mapping lives
+ * after close(). It sleeps. Nothing happens when the size does not change
+ */
+static int fa_ring_resize(struct fa_ring *ring, size_t size)
+{
+	void *vaddr = NULL, *old;
+	unsigned long flags;
+
+	mutex_lock(&ring->mmap_lock);
+	if (size == ring->size) {
+		mutex_unlock(&ring->mmap_lock);
+		return 0;
+	}
+	if (size) {
+		vaddr = vmalloc_user(size);
+		if (!vaddr) {
+			mutex_unlock(&ring->mmap_lock);
+			return -ENOMEM;
+		}
+	}
+
+	spin_lock_irqsave(&ring->lock, flags);
+	if (atomic_read(&ring->n_map) ||
+	    (ring->vaddr && ring->next != ring->head)) {
+		spin_unlock_irqrestore(&ring->lock, flags);
+		mutex_unlock(&ring->mmap_lock);
+		vfree(vaddr);
+		return -EBUSY;
+	}
+	old = ring->vaddr;
+	ring->vaddr = vaddr;
+	ring->size = size;
+	ring->hdr = vaddr;
+	ring->next = 0;
+	ring->head = 0;
+	ring->tail = 0;
+	ring->n_slots = 0;
+	ring->slot_size = 0;
+	ring->ctrl_size = 0;
+	ring->data_offset = PAGE_SIZE;
+	ring->n_overrun = 0;
+	if (vaddr)
+		fa_ring_publish(ring);
+	spin_unlock_irqrestore(&ring->lock, flags);
+	mutex_unlock(&ring->mmap_lock);
+
+	vfree(old);
+	return 0;
+}
+
+/* It applies the size requested by the user */
+static int fa_ring_apply(struct fa_ring *ring)
+{
+	return fa_ring_resize(ring, READ_ONCE(ring->size_req));
+}
+
+static void fa_ring_resize_work(struct work_struct *work)
+{
+	struct fa_ring *ring = container_of(work, struct fa_ring, resize_work);
+	struct fa_dev *fa = container_of(ring, struct fa_dev, ring);
+	int err;
+
+	err = fa_ring_apply(ring);
+	if (err)
+		dev_err(fa->msgdev,
+			"Cannot resize the ring to %zu bytes (%d), retrying on the next open\n",
+			READ_ONCE(ring->size_req), err);
+}
+
+/*
+ * fa_ring_request_size
+ * @fa: fmc-adc descriptor
+ * @size: new size of the ring (bytes), 0 to disable it
+ *
+ * It runs on the conf_set path, which may be atomic: it checks the size
+ * and a work applies it. A ring in use is resized on the next open
+ */
+int fa_ring_request_size(struct fa_dev *fa, size_t size)
+{
+	struct fa_ring *ring = &fa->ring;
+
+	size = PAGE_ALIGN(size);
+	if (size && size < 2 * PAGE_SIZE)
+		return -EINVAL;
+
+	WRITE_ONCE(ring->size_req, size);
+	schedule_work(&ring->resize_work);
+
+	return 0;
+}
+
+static int fa_ring_open(struct inode *inode, struct file *file)
+{
+	struct fa_ring *ring = to_fa_ring(file->private_data);
+	unsigned long flags;
+	int err = 0;
+
+	/* A resize refused while the ring was in use, -EBUSY is not fatal */
+	err = fa_ring_apply(ring);
+	if (err && err != -EBUSY)
+		return err;
+	err = 0;
+
+	spin_lock_irqsave(&ring->lock, flags);
+	if (!ring->vaddr)
+		err = -ENODEV;
+	spin_unlock_irqrestore(&ring->lock, flags);
+
+	return err;
+}
+
+/* Each VMA counts, also the ones that fork() and split duplicate */
+static void fa_ring_vm_open(struct vm_area_struct *vma)
+{
+	struct fa_ring *ring = vma->vm_private_data;
+
+	atomic_inc(&ring->n_map);
+}
+
+static void fa_ring_vm_close(struct vm_area_struct *vma)
+{
+	struct fa_ring *ring = vma->vm_private_data;
+
+	atomic_dec(&ring->n_map);
+}
+
+static const struct vm_operations_struct fa_ring_vm_ops = {
+	.open = fa_ring_vm_open,
+	.close = fa_ring_vm_close,
+};
+
+static int fa_ring_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct fa_ring *ring = to_fa_ring(file->private_data);
+	int err;
+
+	mutex_lock(&ring->mmap_lock);
+	if (!ring->vaddr ||
+	    (vma->vm_pgoff << PAGE_SHIFT) + vma->vm_end - vma->vm_start >
+	    ring->size) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	err = remap_vmalloc_range(vma, ring->vaddr, vma->vm_pgoff);
+	if (err)
+		goto out;
+	vma->vm_ops = &fa_ring_vm_ops;
+	vma->vm_private_data = ring;
+	fa_ring_vm_open(vma);
+out:
+	mutex_unlock(&ring->mmap_lock);
+	return err;
+}
+
+static unsigned int fa_ring_poll(struct file *file, poll_table *wait)
+{
+	struct fa_ring *ring = to_fa_ring(file->private_data);
+	unsigned int mask = 0;
+	unsigned long flags;
+
+	poll_wait(file, &ring->wq, wait);
+	spin_lock_irqsave(&ring->lock, flags);
+	if (!ring->vaddr)
+		mask = POLLERR;
+	else if (ring->head != fa_ring_tail(ring))
+		mask = POLLIN | POLLRDNORM;
+	spin_unlock_irqrestore(&ring->lock, flags);
+
+	return mask;
+}
+
+static const struct file_operations fa_ring_fops = {
+	.owner = THIS_MODULE,
+	.open = fa_ring_open,
+	.mmap = fa_ring_mmap,
+	.poll = fa_ring_poll,
+};
+
+int fa_ring_init(struct fa_dev *fa)
+{
+	struct fa_ring *ring = &fa->ring;
+	int err;
+
+	spin_lock_init(&ring->lock);
+	init_waitqueue_head(&ring->wq);
+	mutex_init(&ring->mmap_lock);
+	atomic_set(&ring->n_map, 0);
+	INIT_WORK(&ring->resize_work, fa_ring_resize_work);
+	ring->size_req = 0;
+
+	ring->misc.minor = MISC_DYNAMIC_MINOR;
+	ring->misc.fops = &fa_ring_fops;
+	ring->misc.parent = fa->msgdev;
+	ring->misc.name = kasprintf(GFP_KERNEL, "%s-ring",
+				    dev_name(&fa->zdev->head.dev));
+	if (!ring->misc.name)
+		return -ENOMEM;
+
+	err = misc_register(&ring->misc);
+	if (err) {
+		dev_err(fa->msgdev, "Cannot register the ring device\n");
+		kfree(ring->misc.name);
+	}
+
+	return err;
+}
+
+void fa_ring_exit(struct fa_dev *fa)
+{
+	struct fa_ring *ring = &fa->ring;
+
+	misc_deregister(&ring->misc);
+	kfree(ring->misc.name);
+	cancel_work_sync(&ring->resize_work);
+	vfree(ring->vaddr);
+	ring->vaddr = NULL;
+}
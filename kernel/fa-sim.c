@@ -0,0 +1,1017 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright CERN 2019
+ *
+ * Software carrier: an in-memory model of the ADC gateware (registers,
+ * acquisition state machine, DDR, trigger time-tags, interrupts and DMA).
+ * It runs the whole acquisition path without any hardware.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/list.h>
+#include <linux/log2.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/random.h>
+#include <linux/fixp-arith.h>
+#include <linux/interrupt.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+
+#include "fmc-adc-100m14b4cha.h"
+#include "fa-spec.h"
+
+static int fa_sim_ndev;
+module_param_named(sim_ndev, fa_sim_ndev, int, 0444);
+MODULE_PARM_DESC(sim_ndev, "Number of simulated devices (default 0)");
+
+static char fa_sim_waveform[16] = "sine";
+module_param_string(sim_waveform, fa_sim_waveform, sizeof(fa_sim_waveform),
+		    0644);
+MODULE_PARM_DESC(sim_waveform, "Simulated signal: sine, square, ramp, noise");
+
+static int fa_sim_amplitude = 0x4000;
+module_param_named(sim_amplitude, fa_sim_amplitude, int, 0644);
+MODULE_PARM_DESC(sim_amplitude, "Simulated signal amplitude (ADC counts)");
+
+static int fa_sim_period = 1000;
+module_param_named(sim_period, fa_sim_period, int, 0644);
+MODULE_PARM_DESC(sim_period, "Simulated signal period (samples)");
+
+static int fa_sim_trigger_hz = 1000;
+module_param_named(sim_trigger_hz, fa_sim_trigger_hz, int, 0644);
+MODULE_PARM_DESC(sim_trigger_hz,
+		 "Rate of the simulated trigger, 0 for software triggers only");
+
+static int fa_sim_dma_mbps = 200;
+module_param_named(sim_dma_mbps, fa_sim_dma_mbps, int, 0644);
+MODULE_PARM_DESC(sim_dma_mbps,
+		 "Simulated DMA throughput (MB/s), 0 for immediate completion");
+
+static int fa_sim_ddr_mb = 64;
+module_param_named(sim_ddr_mb, fa_sim_ddr_mb, int, 0444);
+MODULE_PARM_DESC(sim_ddr_mb, "Simulated DDR size (MiB, power of 2)");
+
+/* Address map of the simulated gateware */
+#define FA_SIM_VIC_BASE		0x0000
+#define FA_SIM_IRQ_DMA_BASE	0x0100
+#define FA_SIM_IRQ_ADC_BASE	0x0200
+#define FA_SIM_SPI_BASE		0x0300
+#define FA_SIM_OW_BASE		0x0400
+#define FA_SIM_UTC_BASE		0x0500
+#define FA_SIM_ADC_CSR_BASE	0x1000
+#define FA_SIM_MEM_SIZE		0x1400
+
+/* The ADC and the DMA interrupt controllers have the same layout */
+#define FA_SIM_IRQ_DISABLE	0x00
+#define FA_SIM_IRQ_ENABLE	0x04
+#define FA_SIM_IRQ_MASK		0x08
+#define FA_SIM_IRQ_SRC		0x0C
+
+/* SPI and one-wire masters: transfers complete immediately */
+#define FA_SIM_SPI_CTRL		0x10
+#define FA_SIM_SPI_CTRL_GO	BIT(8)
+#define FA_SIM_OW_CSR		0x00
+#define FA_SIM_OW_CSR_DAT	BIT(0)
+#define FA_SIM_OW_CSR_RST	BIT(1)
+#define FA_SIM_OW_CSR_CYC	BIT(3)
+
+#define FA_SIM_MSHOT_MAX_SAMP	2048
+#define FA_SIM_SAMPLE_NS	10 /* 100MS/s */
+#define FA_SIM_TICK_NS		8 /* 125MHz UTC coarse counter */
+#define FA_SIM_MAX_PERIOD	(1 << 18) /* fixp_sin32_rad() limit */
+#define FA_SIM_EEPROM_SIZE	8192
+#define FA_SIM_DEVICE_ID	0xff00
+
+#define FA_SIM_REG(_sim, _base, _id) \
+	((_sim)->mem[((_base) + zfad_regs[_id].offset) / 4])
+#define FA_SIM_CSR(_sim, _id) FA_SIM_REG(_sim, FA_SIM_ADC_CSR_BASE, _id)
+
+enum fa_sim_wave {
+	FA_SIM_WAVE_SINE = 0,
+	FA_SIM_WAVE_SQUARE,
+	FA_SIM_WAVE_RAMP,
+	FA_SIM_WAVE_NOISE,
+};
+
+static const char *fa_sim_wave_names[] = {
+	[FA_SIM_WAVE_SINE] = "sine",
+	[FA_SIM_WAVE_SQUARE] = "square",
+	[FA_SIM_WAVE_RAMP] = "ramp",
+	[FA_SIM_WAVE_NOISE] = "noise",
+};
+
+/*
+ * fa_sim: a simulated carrier with its mezzanine
+ * @fmc: the FMC device given to fa_probe()
+ * @lock: protects registers and state machine
+ * @mem: register space
+ * @ddr: acquisition memory, its size is a power of 2
+ * @state: acquisition state machine (enum fa100m14b4c_fsm_state)
+ * @sw_trg: the pending trigger is a software one
+ * @trg_ns: time of the last trigger
+ * @trg_timer: state machine timing (pre-samples, trigger, post-samples)
+ * @shot_work: it writes a shot in DDR (the DECR state)
+ * @fill_work: it writes in DDR the samples acquired so far (the POST state)
+ * @fill_lock: serializes the DDR writers
+ * @filled: samples of the running shot already in DDR
+ * @dma_timer: DMA completion
+ * @handler: interrupt handlers of the ADC and of the DMA cores
+ * @utc_ns: time when the driver has set the UTC seconds
+ * @wave: one period of the simulated signal
+ */
+struct fa_sim {
+	struct fmc_device fmc;
+	u64 dma_mask;
+	struct list_head list;
+
+	spinlock_t lock;
+	uint32_t mem[FA_SIM_MEM_SIZE / 4];
+	void *ddr;
+	size_t ddr_size;
+	uint8_t eeprom[FA_SIM_EEPROM_SIZE];
+
+	unsigned int state;
+	bool sw_trg;
+	u64 trg_ns;
+	uint32_t trg_tag[FA_TRIG_TIMETAG_BYTES / 4];
+	struct hrtimer trg_timer;
+	struct work_struct shot_work;
+	struct delayed_work fill_work;
+	struct mutex fill_lock;
+	u64 filled;
+	struct hrtimer dma_timer;
+
+	irq_handler_t handler[2];
+	u64 utc_ns;
+
+	int16_t *wave;
+	unsigned int wave_len;
+	enum fa_sim_wave wave_kind;
+	int wave_amp;
+};
+
+static LIST_HEAD(fa_sim_list);
+
+static inline struct fa_sim *to_fa_sim(struct fmc_device *fmc)
+{
+	return container_of(fmc, struct fa_sim, fmc);
+}
+
+static void fa_sim_utc(struct fa_sim *sim, u64 ns, uint64_t *secs,
+		       uint32_t *ticks)
+{
+	u32 rem;
+
+	*secs = FA_SIM_REG(sim, FA_SIM_UTC_BASE, ZFA_UTC_SECONDS);
+	*secs += div_u64_rem(ns - sim->utc_ns, NSEC_PER_SEC, &rem);
+	*ticks = rem / FA_SIM_TICK_NS;
+}
+
+static void fa_sim_state(struct fa_sim *sim, unsigned int state)
+{
+	uint32_t *sta = &FA_SIM_CSR(sim, ZFA_STA_FSM);
+
+	sim->state = state;
+	*sta &= ~zfad_regs[ZFA_STA_FSM].mask;
+	*sta |= state;
+}
+
+/* Time in the state machine, it depends on the sampling decimation */
+static u64 fa_sim_samples_ns(struct fa_sim *sim, u64 nsamples)
+{
+	uint32_t decimation = max_t(uint32_t, 1,
+				    FA_SIM_CSR(sim, ZFAT_SR_UNDER));
+
+	return nsamples * decimation * FA_SIM_SAMPLE_NS;
+}
+
+/*
+ * Must be called with the lock held. It returns the DDR offset of the
+ * running shot: single shots start at the beginning of the DDR,
+ * multi-shots are consecutive
+ */
+static uint32_t fa_sim_shot_off(struct fa_sim *sim, u64 nsamples)
+{
+	uint32_t shots = max_t(uint32_t, 1, FA_SIM_CSR(sim, ZFAT_SHOTS_NB));
+	uint32_t rem = FA_SIM_CSR(sim, ZFAT_SHOTS_REM);
+
+	return (shots - rem) * (nsamples * FA100M14B4C_NCHAN * sizeof(int16_t) +
+				FA_TRIG_TIMETAG_BYTES);
+}
+
+/*
+ * It returns the time to the next automatic trigger, or -1 when there is
+ * none: no trigger source enabled or software triggers only
+ */
+static s64 fa_sim_trigger_ns(struct fa_sim *sim)
+{
+	int hz = READ_ONCE(fa_sim_trigger_hz);
+	u64 period, since;
+
+	if (hz <= 0 || !FA_SIM_CSR(sim, ZFAT_CFG_SRC))
+		return -1;
+
+	period = div_u64(NSEC_PER_SEC, hz);
+	since = ktime_get_ns() - sim->trg_ns;
+
+	return since >= period ? 0 : period - since;
+}
+
+static enum hrtimer_restart fa_sim_trg_timer(struct hrtimer *timer)
+{
+	struct fa_sim *sim = container_of(timer, struct fa_sim, trg_timer);
+	enum hrtimer_restart ret = HRTIMER_NORESTART;
+	uint32_t src, ticks;
+	unsigned long flags;
+	uint64_t secs;
+	s64 ns = -1;
+
+	spin_lock_irqsave(&sim->lock, flags);
+	switch (sim->state) {
+	case FA100M14B4C_STATE_PRE:
+		fa_sim_state(sim, FA100M14B4C_STATE_WAIT);
+		ns = fa_sim_trigger_ns(sim);
+		break;
+	case FA100M14B4C_STATE_WAIT:
+		src = FA_SIM_CSR(sim, ZFAT_CFG_SRC);
+		if (sim->sw_trg && (src & FA100M14B4C_TRG_SRC_SW)) {
+			src = FA100M14B4C_TRG_SRC_SW;
+		} else {
+			/* not yet, or no automatic trigger */
+			ns = fa_sim_trigger_ns(sim);
+			if (ns)
+				break;
+			if (src & ~FA100M14B4C_TRG_SRC_SW)
+				src &= ~FA100M14B4C_TRG_SRC_SW;
+		}
+		/* Trigger: latch the time-tag the gateware appends */
+		sim->trg_ns = ktime_get_ns();
+		fa_sim_utc(sim, sim->trg_ns, &secs, &ticks);
+		sim->trg_tag[0] = secs & 0xFFFFFFFF;
+		sim->trg_tag[1] = (0xACCE55 << 8) | ((secs >> 32) & 0xFF);
+		sim->trg_tag[2] = ticks;
+		sim->trg_tag[3] = src & -src;
+		FA_SIM_REG(sim, FA_SIM_UTC_BASE, ZFA_UTC_TRIG_SECONDS) = secs;
+		FA_SIM_REG(sim, FA_SIM_UTC_BASE, ZFA_UTC_TRIG_COARSE) = ticks;
+		if (max_t(uint32_t, 1, FA_SIM_CSR(sim, ZFAT_SHOTS_NB)) == 1)
+			FA_SIM_CSR(sim, ZFAT_POS) = FA_SIM_CSR(sim, ZFAT_PRE) *
+				FA100M14B4C_NCHAN * sizeof(int16_t);
+		sim->sw_trg = false;
+		sim->filled = 0;
+		fa_sim_state(sim, FA100M14B4C_STATE_POST);
+		ns = fa_sim_samples_ns(sim, (u64)FA_SIM_CSR(sim, ZFAT_POST) + 1);
+		schedule_delayed_work(&sim->fill_work, 1);
+		break;
+	case FA100M14B4C_STATE_POST:
+		fa_sim_state(sim, FA100M14B4C_STATE_DECR);
+		schedule_work(&sim->shot_work);
+		break;
+	default:
+		break;
+	}
+	if (ns >= 0) {
+		hrtimer_forward_now(timer, ns_to_ktime(ns));
+		ret = HRTIMER_RESTART;
+	}
+	spin_unlock_irqrestore(&sim->lock, flags);
+
+	return ret;
+}
+
+static enum fa_sim_wave fa_sim_wave_kind(void)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(fa_sim_wave_names); ++i)
+		if (sysfs_streq(fa_sim_waveform, fa_sim_wave_names[i]))
+			return i;
+
+	return FA_SIM_WAVE_SINE;
+}
+
+/*
+ * It computes one period of the simulated signal, when the module
+ * parameters change. Samples are 14bit, left aligned
+ */
+static void fa_sim_wave_update(struct fa_sim *sim)
+{
+	enum fa_sim_wave kind = fa_sim_wave_kind();
+	int amp = clamp(READ_ONCE(fa_sim_amplitude), 0, 0x7FFF);
+	unsigned int len = clamp(READ_ONCE(fa_sim_period), 4,
+				 FA_SIM_MAX_PERIOD);
+	int16_t *wave;
+	s32 val = 0;
+	int i;
+
+	if (sim->wave && sim->wave_kind == kind && sim->wave_amp == amp &&
+	    sim->wave_len == len)
+		return;
+
+	wave = kmalloc_array(len, sizeof(*wave), GFP_KERNEL);
+	if (!wave)
+		return; /* keep the previous one */
+
+	for (i = 0; i < len; ++i) {
+		switch (kind) {
+		case FA_SIM_WAVE_SINE:
+			val = ((s64)fixp_sin32_rad(i, len) * amp) >> 31;
+			break;
+		case FA_SIM_WAVE_SQUARE:
+			val = i < len / 2 ? amp : -amp;
+			break;
+		case FA_SIM_WAVE_RAMP:
+			val = -amp + div_s64((s64)2 * amp * i, len);
+			break;
+		case FA_SIM_WAVE_NOISE:
+			val = (s32)(prandom_u32() % (2 * amp + 1)) - amp;
+			break;
+		}
+		wave[i] = val & ~0x3;
+	}
+
+	kfree(sim->wave);
+	sim->wave = wave;
+	sim->wave_len = len;
+	sim->wave_kind = kind;
+	sim->wave_amp = amp;
+}
+
+/*
+ * It writes the samples [from, to) of the shot at @off in DDR, they are
+ * interleaved. When @tag is given, the trigger time-tag follows them.
+ * The DDR keeps only its size worth of samples, older ones are not
+ * written. The phase of the signal follows the trigger time, the
+ * channels are shifted by a quarter of period each other
+ */
+static void fa_sim_shot_write(struct fa_sim *sim, uint32_t off, u64 from,
+			      u64 to, u64 trg_ns, uint32_t *tag)
+{
+	size_t mask = sim->ddr_size / sizeof(int16_t) - 1;
+	u64 max = sim->ddr_size / (FA100M14B4C_NCHAN * sizeof(int16_t));
+	int16_t *ddr = sim->ddr;
+	unsigned int ch, len = sim->wave_len;
+	unsigned int pos[FA100M14B4C_NCHAN];
+	size_t idx;
+	u64 i;
+	u32 phase;
+
+	if (to > from + max)
+		from = to - max;
+	idx = off / sizeof(int16_t) + from * FA100M14B4C_NCHAN;
+	div_u64_rem(div_u64(trg_ns, FA_SIM_SAMPLE_NS) + from, len, &phase);
+	for (ch = 0; ch < FA100M14B4C_NCHAN; ++ch)
+		pos[ch] = (phase + ch * len / 4) % len;
+
+	for (i = from; i < to; ++i) {
+		for (ch = 0; ch < FA100M14B4C_NCHAN; ++ch) {
+			ddr[idx++ & mask] = sim->wave[pos[ch]];
+			if (++pos[ch] == len)
+				pos[ch] = 0;
+		}
+	}
+
+	if (!tag)
+		return;
+	/* the time-tag is 32bit aligned, like the shot */
+	for (ch = 0; ch < FA_TRIG_TIMETAG_BYTES / 4; ++ch, idx += 2)
+		((uint32_t *)sim->ddr)[(idx & mask) / 2] = tag[ch];
+}
+
+/*
+ * It writes in DDR the samples acquired since the trigger, so that the
+ * sample counter and the DDR follow the time like on the hardware
+ */
+static void fa_sim_fill_work(struct work_struct *work)
+{
+	struct fa_sim *sim = container_of(to_delayed_work(work),
+					  struct fa_sim, fill_work);
+	unsigned long flags;
+	u64 pre, post, from, to, trg_ns;
+	uint32_t off;
+
+	mutex_lock(&sim->fill_lock);
+	spin_lock_irqsave(&sim->lock, flags);
+	if (sim->state != FA100M14B4C_STATE_POST) {
+		spin_unlock_irqrestore(&sim->lock, flags);
+		mutex_unlock(&sim->fill_lock);
+		return;
+	}
+	pre = FA_SIM_CSR(sim, ZFAT_PRE);
+	post = (u64)FA_SIM_CSR(sim, ZFAT_POST) + 1;
+	trg_ns = sim->trg_ns;
+	from = sim->filled;
+	to = pre + min(post, div64_u64(ktime_get_ns() - trg_ns,
+				       fa_sim_samples_ns(sim, 1)));
+	off = fa_sim_shot_off(sim, pre + post);
+	spin_unlock_irqrestore(&sim->lock, flags);
+
+	fa_sim_wave_update(sim);
+	if (sim->wave)
+		fa_sim_shot_write(sim, off, from, to, trg_ns, NULL);
+
+	spin_lock_irqsave(&sim->lock, flags);
+	if (sim->trg_ns == trg_ns)
+		sim->filled = to;
+	if (sim->state == FA100M14B4C_STATE_POST)
+		schedule_delayed_work(&sim->fill_work, 1);
+	spin_unlock_irqrestore(&sim->lock, flags);
+	mutex_unlock(&sim->fill_lock);
+}
+
+static void fa_sim_irq_raise(struct fa_sim *sim, unsigned int base,
+			     uint32_t src);
+
+static void fa_sim_shot_work(struct work_struct *work)
+{
+	struct fa_sim *sim = container_of(work, struct fa_sim, shot_work);
+	uint32_t tag[FA_TRIG_TIMETAG_BYTES / 4];
+	uint32_t rem, off;
+	unsigned long flags;
+	bool acq_end = false;
+	u64 nsamples, from, trg_ns;
+	s64 ns;
+
+	mutex_lock(&sim->fill_lock);
+	spin_lock_irqsave(&sim->lock, flags);
+	if (sim->state != FA100M14B4C_STATE_DECR) {
+		spin_unlock_irqrestore(&sim->lock, flags);
+		mutex_unlock(&sim->fill_lock);
+		return;
+	}
+	/* the post-samples register does not count the trigger sample */
+	nsamples = (u64)FA_SIM_CSR(sim, ZFAT_PRE) +
+		FA_SIM_CSR(sim, ZFAT_POST) + 1;
+	rem = FA_SIM_CSR(sim, ZFAT_SHOTS_REM);
+	off = fa_sim_shot_off(sim, nsamples);
+	from = sim->filled;
+	trg_ns = sim->trg_ns;
+	memcpy(tag, sim->trg_tag, sizeof(tag));
+	spin_unlock_irqrestore(&sim->lock, flags);
+
+	/* the fill work wrote the first samples already */
+	fa_sim_wave_update(sim);
+	if (sim->wave)
+		fa_sim_shot_write(sim, off, from, nsamples, trg_ns, tag);
+	mutex_unlock(&sim->fill_lock);
+
+	spin_lock_irqsave(&sim->lock, flags);
+	if (sim->state != FA100M14B4C_STATE_DECR) {
+		/* stopped meanwhile */
+		spin_unlock_irqrestore(&sim->lock, flags);
+		return;
+	}
+	FA_SIM_CSR(sim, ZFAT_CNT) += nsamples;
+	FA_SIM_CSR(sim, ZFAT_SHOTS_REM) = --rem;
+	if (rem) {
+		fa_sim_state(sim, FA100M14B4C_STATE_PRE);
+		ns = fa_sim_samples_ns(sim, FA_SIM_CSR(sim, ZFAT_PRE));
+		hrtimer_start(&sim->trg_timer, ns_to_ktime(ns),
+			      HRTIMER_MODE_REL);
+	} else {
+		fa_sim_state(sim, FA100M14B4C_STATE_IDLE);
+		acq_end = true;
+	}
+	spin_unlock_irqrestore(&sim->lock, flags);
+
+	if (acq_end)
+		fa_sim_irq_raise(sim, FA_SIM_IRQ_ADC_BASE, FA_IRQ_ADC_ACQ_END);
+}
+
+/* Must be called with the lock held */
+static void fa_sim_fsm_command(struct fa_sim *sim, uint32_t cmd)
+{
+	uint32_t ticks;
+	uint64_t secs;
+	u64 now;
+
+	switch (cmd) {
+	case FA100M14B4C_CMD_START:
+		now = ktime_get_ns();
+		fa_sim_utc(sim, now, &secs, &ticks);
+		FA_SIM_REG(sim, FA_SIM_UTC_BASE, ZFA_UTC_ACQ_START_SECONDS) = secs;
+		FA_SIM_REG(sim, FA_SIM_UTC_BASE, ZFA_UTC_ACQ_START_COARSE) = ticks;
+		FA_SIM_REG(sim, FA_SIM_UTC_BASE, ZFA_UTC_ACQ_START_FINE) = 0;
+		FA_SIM_CSR(sim, ZFAT_SHOTS_REM) =
+			max_t(uint32_t, 1, FA_SIM_CSR(sim, ZFAT_SHOTS_NB));
+		FA_SIM_CSR(sim, ZFAT_CNT) = 0;
+		sim->sw_trg = false;
+		fa_sim_state(sim, FA100M14B4C_STATE_PRE);
+		hrtimer_start(&sim->trg_timer,
+			      ns_to_ktime(fa_sim_samples_ns(sim,
+					FA_SIM_CSR(sim, ZFAT_PRE))),
+			      HRTIMER_MODE_REL);
+		break;
+	case FA100M14B4C_CMD_STOP:
+		/* the timer and the work check the state, do not wait them */
+		fa_sim_state(sim, FA100M14B4C_STATE_IDLE);
+		hrtimer_try_to_cancel(&sim->trg_timer);
+		break;
+	}
+}
+
+static void fa_sim_irq_write(struct fa_sim *sim, unsigned int base,
+			     unsigned int reg, uint32_t val)
+{
+	uint32_t *mask = &sim->mem[(base + FA_SIM_IRQ_MASK) / 4];
+	uint32_t *src = &sim->mem[(base + FA_SIM_IRQ_SRC) / 4];
+
+	switch (reg) {
+	case FA_SIM_IRQ_DISABLE:
+		*mask &= ~val;
+		break;
+	case FA_SIM_IRQ_ENABLE:
+		*mask |= val;
+		break;
+	case FA_SIM_IRQ_SRC:
+		*src &= ~val; /* write 1 to clear */
+		break;
+	}
+}
+
+static uint32_t fa_sim_read32(struct fmc_device *fmc, int addr)
+{
+	struct fa_sim *sim = to_fa_sim(fmc);
+	unsigned long flags;
+	uint32_t val, ticks;
+	uint64_t secs;
+
+	if (addr < 0 || addr >= FA_SIM_MEM_SIZE)
+		return ~0;
+
+	spin_lock_irqsave(&sim->lock, flags);
+	switch (addr) {
+	case FA_SIM_UTC_BASE + 0x00: /* ZFA_UTC_SECONDS */
+	case FA_SIM_UTC_BASE + 0x04: /* ZFA_UTC_COARSE */
+		fa_sim_utc(sim, ktime_get_ns(), &secs, &ticks);
+		val = addr == FA_SIM_UTC_BASE ? secs : ticks;
+		break;
+	case FA_SIM_ADC_CSR_BASE + 0x3C: /* ZFAT_CNT */
+		/* live counter: it counts the samples in DDR */
+		val = sim->mem[addr / 4];
+		if (sim->state == FA100M14B4C_STATE_POST)
+			val += sim->filled;
+		break;
+	default:
+		val = sim->mem[addr / 4];
+		break;
+	}
+	spin_unlock_irqrestore(&sim->lock, flags);
+
+	return val;
+}
+
+static void fa_sim_write32(struct fmc_device *fmc, uint32_t val, int addr)
+{
+	struct fa_sim *sim = to_fa_sim(fmc);
+	const struct zfa_field_desc *cmd = &zfad_regs[ZFA_CTL_FMS_CMD];
+	unsigned long flags;
+	s64 ns;
+
+	if (addr < 0 || addr >= FA_SIM_MEM_SIZE)
+		return;
+
+	spin_lock_irqsave(&sim->lock, flags);
+	switch (addr) {
+	case FA_SIM_ADC_CSR_BASE + 0x00: /* ZFA_CTL */
+		fa_sim_fsm_command(sim, val & cmd->mask);
+		/* self clearing bits */
+		val &= ~(cmd->mask | zfad_regs[ZFA_CTL_RST_TRG_STA].mask);
+		break;
+	case FA_SIM_ADC_CSR_BASE + 0x0C: /* ZFAT_CFG_SRC */
+		sim->mem[addr / 4] = val;
+		ns = fa_sim_trigger_ns(sim);
+		if (sim->state == FA100M14B4C_STATE_WAIT && ns >= 0)
+			hrtimer_start(&sim->trg_timer, ns_to_ktime(ns),
+				      HRTIMER_MODE_REL);
+		break;
+	case FA_SIM_ADC_CSR_BASE + 0x18: /* ZFAT_SW */
+		if (sim->state == FA100M14B4C_STATE_WAIT) {
+			sim->sw_trg = true;
+			hrtimer_start(&sim->trg_timer, ns_to_ktime(0),
+				      HRTIMER_MODE_REL);
+		}
+		break;
+	case FA_SIM_UTC_BASE + 0x00: /* ZFA_UTC_SECONDS */
+		sim->utc_ns = ktime_get_ns();
+		break;
+	case FA_SIM_IRQ_ADC_BASE ... FA_SIM_IRQ_ADC_BASE + FA_SIM_IRQ_SRC:
+		fa_sim_irq_write(sim, FA_SIM_IRQ_ADC_BASE,
+				 addr - FA_SIM_IRQ_ADC_BASE, val);
+		goto out;
+	case FA_SIM_IRQ_DMA_BASE ... FA_SIM_IRQ_DMA_BASE + FA_SIM_IRQ_SRC:
+		fa_sim_irq_write(sim, FA_SIM_IRQ_DMA_BASE,
+				 addr - FA_SIM_IRQ_DMA_BASE, val);
+		goto out;
+	case FA_SIM_SPI_BASE + FA_SIM_SPI_CTRL:
+		val &= ~FA_SIM_SPI_CTRL_GO;
+		break;
+	case FA_SIM_OW_BASE + FA_SIM_OW_CSR:
+		/* a reset gets the presence pulse, a slot reads what it writes */
+		if (val & FA_SIM_OW_CSR_RST)
+			val &= ~FA_SIM_OW_CSR_DAT;
+		val &= ~(FA_SIM_OW_CSR_CYC | FA_SIM_OW_CSR_RST);
+		break;
+	}
+	sim->mem[addr / 4] = val;
+out:
+	spin_unlock_irqrestore(&sim->lock, flags);
+}
+
+static int fa_sim_irq_index(int base)
+{
+	switch (base) {
+	case FA_SIM_IRQ_ADC_BASE:
+		return 0;
+	case FA_SIM_IRQ_DMA_BASE:
+		return 1;
+	default:
+		return -EINVAL;
+	}
+}
+
+/*
+ * It raises an interrupt. Handlers expect to run in interrupt context,
+ * so local interrupts are disabled around them
+ */
+static void fa_sim_irq_raise(struct fa_sim *sim, unsigned int base,
+			     uint32_t src)
+{
+	irq_handler_t handler = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&sim->lock, flags);
+	sim->mem[(base + FA_SIM_IRQ_SRC) / 4] |= src;
+	if (sim->mem[(base + FA_SIM_IRQ_MASK) / 4] & src)
+		handler = sim->handler[fa_sim_irq_index(base)];
+	spin_unlock_irqrestore(&sim->lock, flags);
+
+	if (!handler)
+		return;
+	local_irq_save(flags);
+	handler(base, &sim->fmc);
+	local_irq_restore(flags);
+}
+
+static int fa_sim_irq_request(struct fmc_device *fmc, irq_handler_t handler,
+			      char *name, int flags)
+{
+	struct fa_sim *sim = to_fa_sim(fmc);
+	int i = fa_sim_irq_index(fmc->irq);
+
+	if (i < 0)
+		return i;
+	spin_lock_irq(&sim->lock);
+	sim->handler[i] = handler;
+	spin_unlock_irq(&sim->lock);
+
+	return 0;
+}
+
+static int fa_sim_irq_free(struct fmc_device *fmc)
+{
+	struct fa_sim *sim = to_fa_sim(fmc);
+	int i = fa_sim_irq_index(fmc->irq);
+
+	if (i < 0)
+		return i;
+	spin_lock_irq(&sim->lock);
+	sim->handler[i] = NULL;
+	spin_unlock_irq(&sim->lock);
+
+	return 0;
+}
+
+static void fa_sim_irq_ack(struct fmc_device *fmc)
+{
+}
+
+static int fa_sim_validate(struct fmc_device *fmc, struct fmc_driver *drv)
+{
+	return 0; /* everything is valid */
+}
+
+static int fa_sim_gpio_config(struct fmc_device *fmc, struct fmc_gpio *gpio,
+			      int ngpio)
+{
+	return 0;
+}
+
+static const struct fmc_operations fa_sim_fmc_op = {
+	.read32 = fa_sim_read32,
+	.write32 = fa_sim_write32,
+	.validate = fa_sim_validate,
+	.irq_request = fa_sim_irq_request,
+	.irq_ack = fa_sim_irq_ack,
+	.irq_free = fa_sim_irq_free,
+	.gpio_config = fa_sim_gpio_config,
+};
+
+
+/* Carrier operations */
+
+static char *fa_sim_get_gwname(void)
+{
+	return "";
+}
+
+static int fa_sim_init(struct fa_dev *fa)
+{
+	struct fa_sim *sim = to_fa_sim(fa->fmc);
+
+	/* There is no SDB, the address map is fixed */
+	fa->fa_irq_vic_base = FA_SIM_VIC_BASE;
+	fa->fa_adc_csr_base = FA_SIM_ADC_CSR_BASE;
+	fa->fa_irq_adc_base = FA_SIM_IRQ_ADC_BASE;
+	fa->fa_utc_base = FA_SIM_UTC_BASE;
+	fa->fa_spi_base = FA_SIM_SPI_BASE;
+	fa->fa_ow_base = FA_SIM_OW_BASE;
+
+	fa->carrier_data = sim;
+	fa->ddr_size = sim->ddr_size;
+	dev_info(fa->msgdev, "simulated carrier, DDR %zu MiB\n",
+		 sim->ddr_size >> 20);
+
+	return 0;
+}
+
+static int fa_sim_reset(struct fa_dev *fa)
+{
+	return 0;
+}
+
+static void fa_sim_exit(struct fa_dev *fa)
+{
+	struct fa_sim *sim = fa->carrier_data;
+
+	spin_lock_irq(&sim->lock);
+	fa_sim_state(sim, FA100M14B4C_STATE_IDLE);
+	spin_unlock_irq(&sim->lock);
+	hrtimer_cancel(&sim->trg_timer);
+	cancel_work_sync(&sim->shot_work);
+	cancel_delayed_work_sync(&sim->fill_work);
+	hrtimer_cancel(&sim->dma_timer);
+}
+
+static int fa_sim_setup_irqs(struct fa_dev *fa)
+{
+	struct fmc_device *fmc = fa->fmc;
+	int err;
+
+	/* The DMA interrupt controller is the SPEC one */
+	fmc->irq = FA_SIM_IRQ_DMA_BASE;
+	err = fmc_irq_request(fmc, fa_spec_irq_handler, "fmc-adc-100m14b", 0);
+	if (err)
+		return err;
+
+	fa->irq_src |= FA_IRQ_SRC_DMA;
+
+	return 0;
+}
+
+static int fa_sim_free_irqs(struct fa_dev *fa)
+{
+	struct fmc_device *fmc = fa->fmc;
+
+	fmc->irq = FA_SIM_IRQ_DMA_BASE;
+	fmc_irq_free(fmc);
+
+	return 0;
+}
+
+static int fa_sim_enable_irqs(struct fa_dev *fa)
+{
+	fa_writel(fa, FA_SIM_IRQ_DMA_BASE,
+		  &fa_spec_regs[ZFA_IRQ_DMA_ENABLE_MASK], FA_SPEC_IRQ_DMA_ALL);
+
+	return 0;
+}
+
+static int fa_sim_disable_irqs(struct fa_dev *fa)
+{
+	fa_writel(fa, FA_SIM_IRQ_DMA_BASE,
+		  &fa_spec_regs[ZFA_IRQ_DMA_DISABLE_MASK], FA_SPEC_IRQ_DMA_ALL);
+
+	return 0;
+}
+
+static int fa_sim_ack_irq(struct fa_dev *fa, int irq_id)
+{
+	return 0;
+}
+
+static enum hrtimer_restart fa_sim_dma_timer(struct hrtimer *timer)
+{
+	struct fa_sim *sim = container_of(timer, struct fa_sim, dma_timer);
+
+	fa_sim_irq_raise(sim, FA_SIM_IRQ_DMA_BASE, FA_SPEC_IRQ_DMA_DONE);
+
+	return HRTIMER_NORESTART;
+}
+
+static void fa_sim_ddr_read(struct fa_sim *sim, uint32_t off, void *dst,
+			    size_t len)
+{
+	size_t first;
+
+	off &= sim->ddr_size - 1;
+	first = min(len, sim->ddr_size - off);
+	memcpy(dst, sim->ddr + off, first);
+	memcpy(dst + first, sim->ddr, len - first);
+}
+
+/*
+ * The copy happens immediately, the completion interrupt comes after the
+ * time the transfer takes at the simulated throughput
+ */
+static int fa_sim_dma_start(struct zio_cset *cset)
+{
+	struct fa_dev *fa = cset->zdev->priv_d;
+	struct fa_sim *sim = fa->carrier_data;
+	struct zfad_block *zfad_block = cset->interleave->priv_d;
+	struct zio_block *block;
+	int mbps = READ_ONCE(fa_sim_dma_mbps);
+	size_t len = 0;
+	u64 ns = 0;
+	int i;
+
+	for (i = 0; i < fa->n_shots; ++i) {
+		block = zfad_block[i].block;
+		fa_sim_ddr_read(sim, zfad_block[i].dev_mem_off, block->data,
+				block->datalen);
+		len += block->datalen;
+	}
+
+	if (mbps > 0)
+		ns = div_u64((u64)len * NSEC_PER_USEC, mbps);
+	hrtimer_start(&sim->dma_timer, ns_to_ktime(ns), HRTIMER_MODE_REL);
+
+	return 0;
+}
+
+static void fa_sim_dma_done(struct zio_cset *cset)
+{
+}
+
+static void fa_sim_dma_error(struct zio_cset *cset)
+{
+	struct fa_dev *fa = cset->zdev->priv_d;
+
+	dev_err(fa->msgdev, "simulated DMA failed\n");
+}
+
+struct fa_carrier_op fa_sim_op = {
+	.get_gwname = fa_sim_get_gwname,
+	.init = fa_sim_init,
+	.reset_core = fa_sim_reset,
+	.exit = fa_sim_exit,
+	.setup_irqs = fa_sim_setup_irqs,
+	.free_irqs = fa_sim_free_irqs,
+	.enable_irqs = fa_sim_enable_irqs,
+	.disable_irqs = fa_sim_disable_irqs,
+	.ack_irq = fa_sim_ack_irq,
+	.dma_start = fa_sim_dma_start,
+	.dma_done = fa_sim_dma_done,
+	.dma_error = fa_sim_dma_error,
+};
+
+
+/* Simulated devices */
+
+static void fa_sim_release(struct device *dev)
+{
+	struct fa_sim *sim = container_of(dev, struct fa_sim, fmc.dev);
+
+	kfree(sim->wave);
+	vfree(sim->ddr);
+	kfree(sim);
+}
+
+/* The EEPROM contains the identity calibration */
+static void fa_sim_eeprom_init(struct fa_sim *sim)
+{
+	struct fa_calib *calib = (void *)sim->eeprom + FA_CAL_OFFSET;
+	int i, ch;
+
+	for (i = 0; i < ARRAY_SIZE(calib->adc); ++i) {
+		for (ch = 0; ch < FA100M14B4C_NCHAN; ++ch) {
+			calib->adc[i].gain[ch] = cpu_to_le16(FA_CAL_NO_GAIN);
+			calib->dac[i].gain[ch] = cpu_to_le16(FA_CAL_NO_GAIN);
+		}
+		calib->adc[i].temperature = cpu_to_le16(50 * 100);
+		calib->dac[i].temperature = cpu_to_le16(50 * 100);
+	}
+}
+
+static int fa_sim_create(unsigned int n)
+{
+	struct fmc_device *fmc;
+	struct fa_sim *sim;
+	int err;
+
+	sim = kzalloc(sizeof(*sim), GFP_KERNEL);
+	if (!sim)
+		return -ENOMEM;
+	sim->ddr_size = roundup_pow_of_two(max(fa_sim_ddr_mb, 1)) << 20;
+	sim->ddr = vzalloc(sim->ddr_size);
+	if (!sim->ddr) {
+		kfree(sim);
+		return -ENOMEM;
+	}
+
+	spin_lock_init(&sim->lock);
+	hrtimer_init(&sim->trg_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	sim->trg_timer.function = fa_sim_trg_timer;
+	hrtimer_init(&sim->dma_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	sim->dma_timer.function = fa_sim_dma_timer;
+	INIT_WORK(&sim->shot_work, fa_sim_shot_work);
+	INIT_DELAYED_WORK(&sim->fill_work, fa_sim_fill_work);
+	mutex_init(&sim->fill_lock);
+
+	fa_sim_state(sim, FA100M14B4C_STATE_IDLE);
+	FA_SIM_CSR(sim, ZFA_STA_SERDES_PLL) |=
+		zfad_regs[ZFA_STA_SERDES_PLL].mask;
+	FA_SIM_CSR(sim, ZFA_STA_SERDES_SYNCED) |=
+		zfad_regs[ZFA_STA_SERDES_SYNCED].mask;
+	FA_SIM_CSR(sim, ZFA_MULT_MAX_SAMP) = FA_SIM_MSHOT_MAX_SAMP;
+	FA_SIM_CSR(sim, ZFAT_SAMPLING_HZ) = NSEC_PER_SEC / FA_SIM_SAMPLE_NS;
+	sim->utc_ns = ktime_get_ns();
+	fa_sim_eeprom_init(sim);
+
+	fmc = &sim->fmc;
+	fmc->version = FMC_VERSION;
+	fmc->owner = NULL; /* the carrier is this module: do not pin it */
+	fmc->op = &fa_sim_fmc_op;
+	fmc->carrier_name = FA_SIM_CARRIER_NAME;
+	fmc->carrier_data = sim;
+	fmc->eeprom = sim->eeprom;
+	fmc->eeprom_len = sizeof(sim->eeprom);
+	fmc->device_id = FA_SIM_DEVICE_ID + n;
+	fmc->hwdev = &fmc->dev;
+	sim->dma_mask = DMA_BIT_MASK(64);
+	fmc->dev.dma_mask = &sim->dma_mask;
+	fmc->dev.coherent_dma_mask = DMA_BIT_MASK(64);
+	fmc->dev.release = fa_sim_release;
+	device_initialize(&fmc->dev);
+	err = dev_set_name(&fmc->dev, "fmc-adc-sim.%u", n);
+	if (err)
+		goto err_put;
+	err = device_add(&fmc->dev);
+	if (err)
+		goto err_put;
+
+	err = fa_probe(fmc);
+	if (err)
+		goto err_del;
+
+	list_add_tail(&sim->list, &fa_sim_list);
+
+	return 0;
+
+err_del:
+	device_del(&fmc->dev);
+err_put:
+	put_device(&fmc->dev);
+	return err;
+}
+
+static void fa_sim_destroy(struct fa_sim *sim)
+{
+	list_del(&sim->list);
+	fa_remove(&sim->fmc);
+	device_del(&sim->fmc.dev);
+	put_device(&sim->fmc.dev);
+}
+
+/**
+ * It creates the simulated devices requested with the module parameter
+ * sim_ndev. They are probed immediately
+ */
+int fa_sim_register(void)
+{
+	int i, err;
+
+	for (i = 0; i < fa_sim_ndev; ++i) {
+		err = fa_sim_create(i);
+		if (err) {
+			pr_err("%s: cannot create simulated device %d (%d)\n",
+			       KBUILD_MODNAME, i, err);
+			fa_sim_unregister();
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+void fa_sim_unregister(void)
+{
+	struct fa_sim *sim, *tmp;
+
+	list_for_each_entry_safe(sim, tmp, &fa_sim_list, list)
+		fa_sim_destroy(sim);
+}
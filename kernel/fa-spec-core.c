@@ -75,6 +75,7 @@ static int fa_spec_init(struct fa_dev *fa)
 
 	/* register carrier data */
 	fa->carrier_data = cdata;
+	fa_spec_dma_pool_init(fa);
 	dev_info(fa->msgdev, "spec::%s successfully executed\n", __func__);
 	return 0;
 }
@@ -90,6 +91,7 @@ static int fa_spec_reset(struct fa_dev *fa)
 
 static void fa_spec_exit(struct fa_dev *fa)
 {
+	fa_spec_dma_pool_free(fa);
 	kfree(fa->carrier_data);
 }
 
@@ -189,6 +191,7 @@ struct fa_carrier_op fa_spec_op = {
 	.enable_irqs = fa_spec_enable_irqs,
 	.disable_irqs = fa_spec_disable_irqs,
 	.ack_irq = fa_spec_ack_irq,
+	.dma_prepare = fa_spec_dma_prepare,
 	.dma_start = fa_spec_dma_start,
 	.dma_done = fa_spec_dma_done,
 	.dma_error = fa_spec_dma_error,
@@ -10,122 +10,336 @@
 #include <linux/types.h>
 #include <linux/list.h>
 #include <linux/mm.h>
+#include <linux/vmalloc.h>
 
 #include "fmc-adc-100m14b4cha.h"
 #include "fa-spec.h"
 
 
 
-static int gncore_dma_fill(struct zio_dma_sg *zsg)
+/*
+ * Worst case number of scatter list entries for a given geometry: a
+ * vmalloc'ed block can span one more page than its size suggests
+ */
+static unsigned int fa_spec_dma_pool_size(unsigned int n_shots,
+					  size_t shot_size)
+{
+	return n_shots * (DIV_ROUND_UP(shot_size, PAGE_SIZE) + 1);
+}
+
+static void fa_spec_dma_items_free(struct fa_dev *fa,
+				   struct gncore_dma_item *items,
+				   dma_addr_t dma_items, unsigned int n_items)
+{
+	dma_free_coherent(fa->fmc->hwdev,
+			  n_items * sizeof(struct gncore_dma_item),
+			  items, dma_items);
+}
+
+/* It frees the replaced pools, in process context */
+static void fa_spec_dma_pool_work(struct work_struct *work)
+{
+	struct fa_spec_data *spec_data = container_of(work,
+						      struct fa_spec_data,
+						      pool_work);
+	struct fa_spec_dma_old *old, *tmp;
+	struct llist_node *list;
+	struct fa_dev *fa;
+
+	list = llist_del_all(&spec_data->pool_old);
+	llist_for_each_entry_safe(old, tmp, list, node) {
+		fa = old->fa;
+		fa_spec_dma_items_free(fa, old->items, old->dma_items,
+				       old->n_items);
+		sg_free_table(&old->sgt);
+		kfree(old);
+	}
+}
+
+void fa_spec_dma_pool_init(struct fa_dev *fa)
+{
+	struct fa_spec_data *spec_data = fa->carrier_data;
+
+	init_llist_head(&spec_data->pool_old);
+	INIT_WORK(&spec_data->pool_work, fa_spec_dma_pool_work);
+}
+
+void fa_spec_dma_pool_free(struct fa_dev *fa)
 {
-	struct gncore_dma_item *item = (struct gncore_dma_item *)zsg->page_desc;
-	struct scatterlist *sg = zsg->sg;
-	struct zio_channel *chan = zsg->zsgt->chan;
-	struct fa_dev *fa = chan->cset->zdev->priv_d;
 	struct fa_spec_data *spec_data = fa->carrier_data;
-	dma_addr_t tmp;
-
-	/* Prepare DMA item */
-	item->start_addr = zsg->dev_mem_off;
-	item->dma_addr_l = sg_dma_address(sg) & 0xFFFFFFFF;
-	item->dma_addr_h = (uint64_t)sg_dma_address(sg) >> 32;
-	item->dma_len = sg_dma_len(sg);
-
-	if (!sg_is_last(sg)) {/* more transfers */
-		/* uint64_t so it works on 32 and 64 bit */
-		tmp = zsg->zsgt->dma_page_desc_pool;
-		tmp += (zsg->zsgt->page_desc_size * (zsg->page_idx + 1));
-		item->next_addr_l = ((uint64_t)tmp) & 0xFFFFFFFF;
-		item->next_addr_h = ((uint64_t)tmp) >> 32;
-		item->attribute = 0x1;	/* more items */
-	} else {
-		item->attribute = 0x0;	/* last item */
+	struct fa_spec_dma_pool *pool = &spec_data->pool;
+
+	cancel_work_sync(&spec_data->pool_work);
+	fa_spec_dma_pool_work(&spec_data->pool_work);
+
+	if (!pool->n_items)
+		return;
+
+	fa_spec_dma_items_free(fa, pool->items, pool->dma_items,
+			       pool->n_items);
+	sg_free_table(&pool->sgt);
+	memset(pool, 0, sizeof(*pool));
+}
+
+/**
+ * It prepares the DMA descriptor pool for the given acquisition geometry.
+ * The pool is re-used as it is when it has enough entries for the
+ * geometry, otherwise it is rebuilt: it only grows. It runs on arm, which
+ * may be atomic: the old pool is freed later by a work
+ *
+ * @param cset
+ * @param n_shots number of shots to transfer
+ * @param shot_size size in bytes of a single shot
+ */
+int fa_spec_dma_prepare(struct zio_cset *cset, unsigned int n_shots,
+			size_t shot_size)
+{
+	struct fa_dev *fa = cset->zdev->priv_d;
+	struct fa_spec_data *spec_data = fa->carrier_data;
+	struct fa_spec_dma_pool *pool = &spec_data->pool;
+	struct fa_spec_dma_old *old = NULL;
+	struct gncore_dma_item *items;
+	struct sg_table sgt;
+	dma_addr_t dma_items;
+	unsigned int n_items;
+	int err;
+
+	n_items = fa_spec_dma_pool_size(n_shots, shot_size);
+	if (pool->n_items >= n_items) {
+		pool->n_shots = n_shots;
+		pool->shot_size = shot_size;
+		fa->n_dma_pool_hit++;
+		return 0;
 	}
 
-	/* The first item is written on the device */
-	if (zsg->page_idx == 0) {
-		fa_writel(fa, spec_data->fa_dma_base,
-			  &fa_spec_regs[ZFA_DMA_ADDR], item->start_addr);
-		fa_writel(fa, spec_data->fa_dma_base,
-			  &fa_spec_regs[ZFA_DMA_ADDR_L], item->dma_addr_l);
-		fa_writel(fa, spec_data->fa_dma_base,
-			  &fa_spec_regs[ZFA_DMA_ADDR_H], item->dma_addr_h);
-		fa_writel(fa, spec_data->fa_dma_base,
-			  &fa_spec_regs[ZFA_DMA_LEN], item->dma_len);
-		fa_writel(fa, spec_data->fa_dma_base,
-			  &fa_spec_regs[ZFA_DMA_NEXT_L], item->next_addr_l);
-		fa_writel(fa, spec_data->fa_dma_base,
-			  &fa_spec_regs[ZFA_DMA_NEXT_H], item->next_addr_h);
-		/* Set that there is a next item */
-		fa_writel(fa, spec_data->fa_dma_base,
-			  &fa_spec_regs[ZFA_DMA_BR_LAST], item->attribute);
+	if (pool->n_items) {
+		old = kmalloc(sizeof(*old), GFP_ATOMIC);
+		if (!old)
+			return -ENOMEM;
+	}
+	/* The scatter list first: it can be freed also here, on error */
+	err = sg_alloc_table(&sgt, n_items, GFP_ATOMIC);
+	if (err)
+		goto err_sg;
+	items = dma_alloc_coherent(fa->fmc->hwdev,
+				   n_items * sizeof(struct gncore_dma_item),
+				   &dma_items, GFP_ATOMIC);
+	if (!items) {
+		err = -ENOMEM;
+		goto err_items;
 	}
 
-	dev_dbg(fa->msgdev, "DMA item %d (block %d)\n"
-		"    addr   0x%x\n"
-		"    addr_l 0x%x\n"
-		"    addr_h 0x%x\n"
-		"    length %d\n"
-		"    next_l 0x%x\n"
-		"    next_h 0x%x\n"
-		"    last   0x%x\n",
-		zsg->page_idx, zsg->block_idx,
-		item->start_addr, item->dma_addr_l, item->dma_addr_h,
-		item->dma_len, item->next_addr_l, item->next_addr_h,
-		item->attribute);
+	if (old) {
+		old->fa = fa;
+		old->items = pool->items;
+		old->dma_items = pool->dma_items;
+		old->n_items = pool->n_items;
+		old->sgt = pool->sgt;
+		llist_add(&old->node, &spec_data->pool_old);
+		schedule_work(&spec_data->pool_work);
+	}
+	pool->items = items;
+	pool->dma_items = dma_items;
+	pool->sgt = sgt;
+	pool->n_items = n_items;
+	pool->n_shots = n_shots;
+	pool->shot_size = shot_size;
+	fa->n_dma_pool_rebuild++;
+
+	dev_dbg(fa->msgdev, "DMA pool rebuilt: %d shots of %zu bytes, %d items\n",
+		n_shots, shot_size, n_items);
 
 	return 0;
+
+err_items:
+	sg_free_table(&sgt);
+err_sg:
+	kfree(old);
+	return err;
+}
+
+/*
+ * It fills the pool scatter list with the ZIO blocks. A kmalloc or a
+ * fa-contig block is physically contiguous, so one entry is enough; a
+ * vmalloc block needs one entry per page. It returns the number of used
+ * entries.
+ */
+static int fa_spec_dma_fill_sg(struct fa_dev *fa,
+			       struct zfad_block *zfad_block,
+			       unsigned int n_blocks)
+{
+	struct fa_spec_data *spec_data = fa->carrier_data;
+	struct fa_spec_dma_pool *pool = &spec_data->pool;
+	struct scatterlist *sg = pool->sgt.sgl, *last = NULL;
+	unsigned int i, nents = 0;
+	size_t len, chunk;
+	void *data;
+
+	for (i = 0; i < n_blocks; ++i) {
+		data = zfad_block[i].block->data;
+		len = zfad_block[i].block->datalen;
+		zfad_block[i].first_nent = nents;
+		while (len) {
+			if (!sg || nents >= pool->n_items)
+				return -ENOMEM;
+			/* A previous transfer may have ended the list here */
+			sg_unmark_end(sg);
+			if (is_vmalloc_addr(data)) {
+				chunk = min_t(size_t, len,
+					      PAGE_SIZE - offset_in_page(data));
+				sg_set_page(sg, vmalloc_to_page(data), chunk,
+					    offset_in_page(data));
+			} else {
+				chunk = len;
+				sg_set_buf(sg, data, chunk);
+			}
+			data += chunk;
+			len -= chunk;
+			last = sg;
+			sg = sg_next(sg);
+			nents++;
+		}
+	}
+	if (!last)
+		return -EINVAL;
+	sg_mark_end(last);
+
+	return nents;
+}
+
+/*
+ * It builds the gncore descriptor chain from the mapped scatter list.
+ * Shots are stored back-to-back in the ADC memory, so the device offset
+ * of each item follows the previous one, even when the DMA mapping merged
+ * entries across block boundaries. For the same reason, entries which are
+ * contiguous also in host memory are coalesced into a single item: when
+ * the buffer places the blocks back-to-back, all shots go in one item.
+ */
+static void fa_spec_dma_fill_items(struct fa_dev *fa, uint32_t dev_mem_off,
+				   int mapped)
+{
+	struct fa_spec_data *spec_data = fa->carrier_data;
+	struct fa_spec_dma_pool *pool = &spec_data->pool;
+	struct gncore_dma_item *item = NULL;
+	struct scatterlist *sg;
+	dma_addr_t tmp, next = 0;
+	int i, n_items = 0;
+
+	for_each_sg(pool->sgt.sgl, sg, mapped, i) {
+		if (item && sg_dma_address(sg) == next &&
+		    (uint64_t)item->dma_len + sg_dma_len(sg) <= U32_MAX) {
+			item->dma_len += sg_dma_len(sg);
+			next += sg_dma_len(sg);
+			continue;
+		}
+		item = &pool->items[n_items++];
+		item->dma_addr_l = sg_dma_address(sg) & 0xFFFFFFFF;
+		item->dma_addr_h = (uint64_t)sg_dma_address(sg) >> 32;
+		item->dma_len = sg_dma_len(sg);
+		next = sg_dma_address(sg) + sg_dma_len(sg);
+	}
+
+	for (i = 0; i < n_items; ++i) {
+		item = &pool->items[i];
+		item->start_addr = dev_mem_off;
+		dev_mem_off += item->dma_len;
+
+		if (i < n_items - 1) {/* more transfers */
+			/* uint64_t so it works on 32 and 64 bit */
+			tmp = pool->dma_items;
+			tmp += sizeof(struct gncore_dma_item) * (i + 1);
+			item->next_addr_l = ((uint64_t)tmp) & 0xFFFFFFFF;
+			item->next_addr_h = ((uint64_t)tmp) >> 32;
+			item->attribute = 0x1;	/* more items */
+		} else {
+			item->next_addr_l = 0;
+			item->next_addr_h = 0;
+			item->attribute = 0x0;	/* last item */
+		}
+
+		dev_dbg(fa->msgdev, "DMA item %d\n"
+			"    addr   0x%x\n"
+			"    addr_l 0x%x\n"
+			"    addr_h 0x%x\n"
+			"    length %d\n"
+			"    next_l 0x%x\n"
+			"    next_h 0x%x\n"
+			"    last   0x%x\n",
+			i, item->start_addr, item->dma_addr_l,
+			item->dma_addr_h, item->dma_len, item->next_addr_l,
+			item->next_addr_h, item->attribute);
+	}
+
+	/* The first item is written on the device */
+	item = &pool->items[0];
+	fa_writel(fa, spec_data->fa_dma_base,
+		  &fa_spec_regs[ZFA_DMA_ADDR], item->start_addr);
+	fa_writel(fa, spec_data->fa_dma_base,
+		  &fa_spec_regs[ZFA_DMA_ADDR_L], item->dma_addr_l);
+	fa_writel(fa, spec_data->fa_dma_base,
+		  &fa_spec_regs[ZFA_DMA_ADDR_H], item->dma_addr_h);
+	fa_writel(fa, spec_data->fa_dma_base,
+		  &fa_spec_regs[ZFA_DMA_LEN], item->dma_len);
+	fa_writel(fa, spec_data->fa_dma_base,
+		  &fa_spec_regs[ZFA_DMA_NEXT_L], item->next_addr_l);
+	fa_writel(fa, spec_data->fa_dma_base,
+		  &fa_spec_regs[ZFA_DMA_NEXT_H], item->next_addr_h);
+	/* Set that there is a next item */
+	fa_writel(fa, spec_data->fa_dma_base,
+		  &fa_spec_regs[ZFA_DMA_BR_LAST], item->attribute);
 }
 
 int fa_spec_dma_start(struct zio_cset *cset)
 {
 	struct fa_dev *fa = cset->zdev->priv_d;
 	struct fa_spec_data *spec_data = fa->carrier_data;
+	struct fa_spec_dma_pool *pool = &spec_data->pool;
 	struct zio_channel *interleave = cset->interleave;
 	struct zfad_block *zfad_block = interleave->priv_d;
-	struct zio_block *blocks[fa->n_shots];
-	int i, err;
+	size_t shot_size = zfad_block[0].block->datalen;
+	int nents, mapped, err;
 
 	/*
-	 *  FIXME very inefficient because arm trigger already prepare
-	 * something like zio_block_sg. In the future ZIO can alloc more
-	 * than 1 block at time
+	 * The pool is normally prepared when the trigger is armed. Other
+	 * triggers do not arm through us, so make sure it fits here.
 	 */
-	for (i = 0; i < fa->n_shots; ++i)
-		blocks[i] = zfad_block[i].block;
+	if (pool->n_shots != fa->n_shots || pool->shot_size != shot_size) {
+		err = fa_spec_dma_prepare(cset, fa->n_shots, shot_size);
+		if (err)
+			return err;
+	}
 
-	fa->zdma = zio_dma_alloc_sg(interleave, fa->fmc->hwdev, blocks,
-				    fa->n_shots, GFP_ATOMIC);
-	if (IS_ERR(fa->zdma))
-		return PTR_ERR(fa->zdma);
+	nents = fa_spec_dma_fill_sg(fa, zfad_block, fa->n_shots);
+	if (nents < 0)
+		return nents;
 
-	/* Fix block memory offset
-	 * FIXME when official ZIO has multishot and DMA
-	 */
-	for (i = 0; i < fa->zdma->n_blocks; ++i)
-		fa->zdma->sg_blocks[i].dev_mem_off = zfad_block[i].dev_mem_off;
+	mapped = dma_map_sg(fa->fmc->hwdev, pool->sgt.sgl, nents,
+			    DMA_FROM_DEVICE);
+	if (!mapped)
+		return -ENOMEM;
+	pool->nents = nents;
 
-	err = zio_dma_map_sg(fa->zdma, sizeof(struct gncore_dma_item),
-			     gncore_dma_fill);
-	if (err)
-		goto out_map_sg;
+	fa_spec_dma_fill_items(fa, zfad_block[0].dev_mem_off, mapped);
+	/* Descriptors must be in memory before the engine fetches them */
+	wmb();
 
 	/* Start DMA transfer */
 	fa_writel(fa, spec_data->fa_dma_base,
 			&fa_spec_regs[ZFA_DMA_CTL_START], 1);
 	return 0;
-
-out_map_sg:
-	zio_dma_free_sg(fa->zdma);
-	return err;
 }
 
 void fa_spec_dma_done(struct zio_cset *cset)
 {
 	struct fa_dev *fa = cset->zdev->priv_d;
+	struct fa_spec_data *spec_data = fa->carrier_data;
+	struct fa_spec_dma_pool *pool = &spec_data->pool;
 
-	zio_dma_unmap_sg(fa->zdma);
-	zio_dma_free_sg(fa->zdma);
+	if (!pool->nents)
+		return;
+	dma_unmap_sg(fa->fmc->hwdev, pool->sgt.sgl, pool->nents,
+		     DMA_FROM_DEVICE);
+	pool->nents = 0;
 }
 
 void fa_spec_dma_error(struct zio_cset *cset)
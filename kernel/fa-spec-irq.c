@@ -85,6 +85,7 @@ irqreturn_t fa_spec_irq_handler(int irq_core_base, void *ptr)
 		WARN(1, "Cannot handle two consecutives %s interrupt."
 			"The ADC doesn't behave properly\n",
 			(irq_core_base == fa->fa_irq_adc_base) ? "ACQ" : "DMA");
+		fa_count_add(fa, FA100M14B4C_CNT_IRQ_SEQ_ERR, 1);
 		/* Stop Acquisition, ADC it is not working properly */
 		zfad_fsm_command(fa, FA100M14B4C_CMD_STOP);
 		fa->last_irq_core_src = FA_SPEC_IRQ_SRC_NONE;
@@ -93,6 +94,14 @@ irqreturn_t fa_spec_irq_handler(int irq_core_base, void *ptr)
 
 	dev_dbg(fa->msgdev, "Handle ADC interrupts\n");
 
+	if ((status & FA_SPEC_IRQ_DMA_DONE) && fa_dma_done_slow(fa)) {
+		/* The cset remains busy until the samples are processed */
+		fa->last_irq_core_src = irq_core_base;
+		zfad_dma_done_defer(fa);
+		fmc_irq_ack(fa->fmc);
+		return IRQ_HANDLED;
+	}
+
 	if (status & FA_SPEC_IRQ_DMA_DONE)
 		zfad_dma_done(cset);
 	else if (unlikely(status  & FA_SPEC_IRQ_DMA_ERR))
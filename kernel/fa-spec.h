@@ -8,6 +8,8 @@
 
 #include <linux/scatterlist.h>
 #include <linux/irqreturn.h>
+#include <linux/llist.h>
+#include <linux/workqueue.h>
 
 #include "fmc-adc-100m14b4cha.h"
 #include "field-desc.h"
@@ -82,13 +84,52 @@ enum fa_spec_irq {
 	FA_SPEC_IRQ_DMA_ALL =	0x3,
 };
 
+/*
+ * fa_spec_dma_pool: DMA descriptors and scatter list kept across acquisitions
+ * @items: the gncore descriptor chain, in coherent memory
+ * @dma_items: bus address of @items
+ * @n_items: pool capacity (descriptors and scatter list entries)
+ * @sgt: scatter list recycled on every acquisition
+ * @nents: number of @sgt entries mapped for the running transfer
+ * @n_shots: number of shots the pool has been sized for
+ * @shot_size: shot size (bytes) the pool has been sized for
+ *
+ * The pool is rebuilt only when the acquisition geometry needs more
+ * entries than it has, otherwise the same descriptors and scatter list are
+ * re-filled for every transfer
+ */
+struct fa_spec_dma_pool {
+	struct gncore_dma_item	*items;
+	dma_addr_t		dma_items;
+	unsigned int		n_items;
+	struct sg_table		sgt;
+	unsigned int		nents;
+	unsigned int		n_shots;
+	size_t			shot_size;
+};
+
+/*
+ * fa_spec_dma_old: descriptors and scatter list of a pool replaced by a
+ * rebuild. The rebuild runs on arm, which may be atomic, where coherent
+ * memory cannot be freed: a work frees them later
+ */
+struct fa_spec_dma_old {
+	struct llist_node	node;
+	struct fa_dev		*fa;
+	struct gncore_dma_item	*items;
+	dma_addr_t		dma_items;
+	unsigned int		n_items;
+	struct sg_table		sgt;
+};
+
 /* specific carrier data */
 struct fa_spec_data {
 	/* DMA attributes */
 	unsigned int		fa_dma_base;
 	unsigned int		fa_irq_dma_base;
-	struct fa_dma_item	*items;
-	dma_addr_t		dma_list_item;
+	struct fa_spec_dma_pool	pool;
+	struct llist_head	pool_old; /* struct fa_spec_dma_old */
+	struct work_struct	pool_work; /* it frees @pool_old */
 	unsigned int		n_dma_err; /* statistics */
 };
 
@@ -98,6 +139,10 @@ extern const struct zfa_field_desc fa_spec_regs[];
 extern irqreturn_t fa_spec_irq_handler(int irq, void *dev_id);
 
 /* functions exported by fa-dma.c */
+extern int fa_spec_dma_prepare(struct zio_cset *cset, unsigned int n_shots,
+			       size_t shot_size);
+extern void fa_spec_dma_pool_init(struct fa_dev *fa);
+extern void fa_spec_dma_pool_free(struct fa_dev *fa);
 extern int fa_spec_dma_start(struct zio_cset *cset);
 extern void fa_spec_dma_done(struct zio_cset *cset);
 extern void fa_spec_dma_error(struct zio_cset *cset);
@@ -0,0 +1,95 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright CERN 2019
+ *
+ * Shot statistics. When enabled, the driver scans the samples of each
+ * block once, when the DMA transfer is over, and it stores per-channel
+ * minimum, maximum, mean, RMS and saturation count in the block control.
+ * Consumers can then triage the shots without reading the samples.
+ */
+
+#include <linux/kernel.h>
+#include <linux/bitops.h>
+#include <linux/math64.h>
+
+#include "fmc-adc-100m14b4cha.h"
+
+#define FA_STATS_FRAME_BYTES (FA100M14B4C_NCHAN * sizeof(int16_t))
+
+/**
+ * It computes the statistics of a block and it stores them in the
+ * trigger extended values of its control (FA100M14B4C_TSTAT_*). The
+ * samples are scanned once, all channels together; the kernel cannot
+ * use the vector unit without saving the FPU state, so the loop keeps
+ * the accumulators of the four channels in registers instead
+ *
+ * @param fa the fmc-adc descriptor
+ * @param block block of interleaved samples, without time-tag
+ */
+void fa_stats_block(struct fa_dev *fa, struct zio_block *block)
+{
+	struct zio_control *ctrl = zio_get_ctrl(block);
+	uint32_t *ext_val = ctrl->attr_trigger.ext_val;
+	bool swap = ctrl->drv_alarms & FA100M14B4C_DALARM_SWAP;
+	int sat[FA100M14B4C_NCHAN], min[FA100M14B4C_NCHAN];
+	int max[FA100M14B4C_NCHAN];
+	int64_t sum[FA100M14B4C_NCHAN], half;
+	uint64_t sum2[FA100M14B4C_NCHAN];
+	uint32_t n_sat[FA100M14B4C_NCHAN];
+	const uint32_t *word = block->data;
+	uint32_t tmp[2], mask, rms;
+	const int16_t *frame;
+	size_t i, n;
+	int ch, x, mean;
+
+	mask = GENMASK(FA100M14B4C_TSTAT_FIRST + FA100M14B4C_TSTAT_N - 1,
+		       FA100M14B4C_TSTAT_FIRST);
+	ctrl->attr_trigger.ext_mask &= ~mask;
+	n = block->datalen / FA_STATS_FRAME_BYTES;
+	if (!fa->enable_stats || !n)
+		return;
+
+	for (ch = 0; ch < FA100M14B4C_NCHAN; ++ch) {
+		sat[ch] = fa_readl(fa, fa->fa_adc_csr_base,
+				   &zfad_regs[ZFA_CH1_SAT + ch * ZFA_CHx_MULT]);
+		min[ch] = S16_MAX;
+		max[ch] = S16_MIN;
+		sum[ch] = 0;
+		sum2[ch] = 0;
+		n_sat[ch] = 0;
+	}
+
+	for (i = 0; i < n; ++i, word += 2) {
+		if (unlikely(swap)) {
+			/* VME byte order (svec-swap 2) */
+			tmp[0] = be32_to_cpu(word[0]);
+			tmp[1] = be32_to_cpu(word[1]);
+			frame = (const int16_t *)tmp;
+		} else {
+			frame = (const int16_t *)word;
+		}
+		for (ch = 0; ch < FA100M14B4C_NCHAN; ++ch) {
+			x = frame[ch];
+			min[ch] = min(min[ch], x);
+			max[ch] = max(max[ch], x);
+			sum[ch] += x;
+			sum2[ch] += x * x;
+			if (x >= sat[ch] || x <= -sat[ch])
+				n_sat[ch]++;
+		}
+	}
+
+	half = n / 2;
+	for (ch = 0; ch < FA100M14B4C_NCHAN; ++ch) {
+		/* rounded to the closest code */
+		mean = div64_s64(sum[ch] < 0 ? sum[ch] - half : sum[ch] + half,
+				 n);
+		rms = int_sqrt64(div64_u64(sum2[ch] + half, n));
+		ext_val[FA100M14B4C_TSTAT_MINMAX(ch)] = (uint16_t)min[ch] |
+			((uint32_t)(uint16_t)max[ch] << 16);
+		ext_val[FA100M14B4C_TSTAT_MEANRMS(ch)] = (uint16_t)mean |
+			(min_t(uint32_t, rms, U16_MAX) << 16);
+		ext_val[FA100M14B4C_TSTAT_SAT(ch)] = n_sat[ch];
+	}
+	ctrl->attr_trigger.ext_mask |= mask;
+}
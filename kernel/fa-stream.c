@@ -0,0 +1,351 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright CERN 2019
+ *
+ * Continuous acquisition. The ADC runs a single endless shot (no
+ * pre-samples, 2^32 post-samples) and it writes the DDR as a circular
+ * buffer. The gateware does not have a read pointer, so the driver
+ * follows the sample counter and it transfers a block every time a chunk
+ * of samples is available. When the gateware laps the read pointer the
+ * samples are lost: the next block carries an alarm and the overrun is
+ * counted.
+ *
+ * The stream is not gap-less forever: the endless shot ends after 2^32
+ * samples (about 43 seconds without decimation) and the gateware cannot
+ * queue the next shot while one is running. The driver starts a new shot
+ * when the state machine is idle; the samples in between are lost, the
+ * first block of the new shot carries its own alarm and the restart is
+ * counted apart from the overruns.
+ */
+
+#include <linux/kernel.h>
+#include <linux/jiffies.h>
+#include <linux/workqueue.h>
+
+#include "fmc-adc-100m14b4cha.h"
+
+#define FA_STREAM_SAMPLE_NS 10 /* 100MS/s */
+#define FA_STREAM_SAMPLE_BYTES (FA100M14B4C_NCHAN * sizeof(int16_t))
+
+static uint32_t fa_stream_decimation(struct fa_dev *fa)
+{
+	return max_t(uint32_t, 1, fa_readl(fa, fa->fa_adc_csr_base,
+					   &zfad_regs[ZFAT_SR_UNDER]));
+}
+
+/* Samples that fit in DDR without overwriting the ones not transferred */
+static uint32_t fa_stream_ddr_samples(struct fa_dev *fa)
+{
+	return fa->ddr_size / FA_STREAM_SAMPLE_BYTES;
+}
+
+/**
+ * It sets the number of samples of a streaming block, 0 disables the
+ * streaming. The DDR must contain at least 4 blocks, so that the
+ * gateware can write while the driver transfers
+ *
+ * @param fa the fmc-adc descriptor
+ * @param chunk number of samples
+ *
+ * @return 0 on success, otherwise a negative error number
+ */
+int fa_stream_set_chunk(struct fa_dev *fa, unsigned int chunk)
+{
+	unsigned int max = fa_stream_ddr_samples(fa) / 4;
+
+	if (fa->stream.running)
+		return -EBUSY;
+	if (chunk > max) {
+		dev_err(fa->msgdev, "stream chunk too big (max %u samples)\n",
+			max);
+		return -EINVAL;
+	}
+	fa->stream.chunk = chunk;
+
+	return 0;
+}
+
+/*
+ * The stop does not wait for the work (it may run in atomic context), so
+ * the work checks that the stream it follows is still the running one
+ * before touching the hardware. The caller holds the cset lock
+ */
+static bool fa_stream_current(struct fa_dev *fa, unsigned int gen)
+{
+	return fa->stream.running && fa->stream.gen == gen;
+}
+
+/**
+ * It starts the transfer of the next block
+ *
+ * @param fa the fmc-adc descriptor
+ * @param gen stream generation seen by the work
+ *
+ * @return 0 on success, -ECANCELED when the stream has been stopped,
+ *         -EAGAIN when the trigger is not armed, otherwise a negative
+ *         error number (the acquisition is stopped)
+ */
+static int fa_stream_dma_start(struct fa_dev *fa, unsigned int gen)
+{
+	struct fa_stream *stream = &fa->stream;
+	struct zio_cset *cset = fa->zdev->cset;
+	struct zfad_block *zfad_block;
+	int err;
+
+	spin_lock_irq(&cset->lock);
+	if (!fa_stream_current(fa, gen)) {
+		spin_unlock_irq(&cset->lock);
+		return -ECANCELED;
+	}
+	zfad_block = cset->interleave->priv_d;
+	if (!zfad_block || !(cset->ti->flags & ZIO_TI_ARMED)) {
+		spin_unlock_irq(&cset->lock);
+		return -EAGAIN;
+	}
+	cset->flags |= ZIO_CSET_HW_BUSY;
+	spin_unlock_irq(&cset->lock);
+
+	/* A block crossing the end of the DDR wraps, like the gateware does */
+	zfad_block[0].dev_mem_off = (stream->start +
+				     stream->rd * FA_STREAM_SAMPLE_BYTES) &
+				    (fa->ddr_size - 1);
+	fa->n_fires = 1;
+	/* keep the IRQ sequence check consistent: ACQ then DMA */
+	fa->last_irq_core_src = fa->fa_irq_adc_base;
+	err = fa->carrier_op->dma_start(cset);
+	if (!err && (fa->irq_src & FA_IRQ_SRC_DMA))
+		return 0; /* DMA_DONE lowers CSET_HW_BUSY */
+
+	if (!err)
+		zfad_dma_done(cset);
+	spin_lock_irq(&cset->lock);
+	cset->flags &= ~ZIO_CSET_HW_BUSY;
+	spin_unlock_irq(&cset->lock);
+	if (err)
+		zfad_dma_error(cset);
+
+	return err;
+}
+
+/*
+ * It follows the gateware: it transfers the available blocks, it detects
+ * the overruns and it restarts the acquisition when the endless shot is
+ * over
+ */
+static void fa_stream_work(struct work_struct *work)
+{
+	struct fa_stream *stream = container_of(to_delayed_work(work),
+						struct fa_stream, work);
+	struct fa_dev *fa = container_of(stream, struct fa_dev, stream);
+	struct zio_cset *cset = fa->zdev->cset;
+	uint32_t fsm, cnt, max;
+	unsigned int gen;
+	bool busy;
+
+	if (!stream->running)
+		return;
+
+	spin_lock_irq(&cset->lock);
+	gen = stream->gen;
+	busy = cset->flags & ZIO_CSET_HW_BUSY;
+	spin_unlock_irq(&cset->lock);
+	if (busy)
+		goto out; /* DMA_DONE kicks us */
+
+	/* The state first: when it is IDLE the counter is final */
+	fsm = fa_readl(fa, fa->fa_adc_csr_base, &zfad_regs[ZFA_STA_FSM]);
+	if (!stream->triggered) {
+		if (fsm != FA100M14B4C_STATE_POST)
+			goto out;
+		stream->start = fa_readl(fa, fa->fa_adc_csr_base,
+					 &zfad_regs[ZFAT_POS]);
+		stream->trg_secs = fa_readl(fa, fa->fa_utc_base,
+					    &zfad_regs[ZFA_UTC_TRIG_SECONDS]);
+		stream->trg_ticks = fa_readl(fa, fa->fa_utc_base,
+					     &zfad_regs[ZFA_UTC_TRIG_COARSE]);
+		stream->triggered = true;
+	}
+
+	cnt = fa_readl(fa, fa->fa_adc_csr_base, &zfad_regs[ZFAT_CNT]);
+	max = fa_stream_ddr_samples(fa) - stream->chunk;
+	if (cnt - stream->rd > max) {
+		/* Overwritten before the transfer: skip to the newest block */
+		dev_dbg(fa->msgdev, "stream overrun, %u samples lost\n",
+			cnt - stream->chunk - stream->rd);
+		stream->rd = cnt - stream->chunk;
+		stream->gap = true;
+		stream->n_overrun++;
+	}
+
+	if (cnt - stream->rd >= stream->chunk) {
+		/* The previous data_done could not re-arm (buffer full) */
+		bool armed = cset->ti->flags & ZIO_TI_ARMED;
+
+		if (!armed)
+			zio_arm_trigger(cset->ti);
+		/* Stopped meanwhile: do not leave our arm behind */
+		if (fa_stream_dma_start(fa, gen) == -ECANCELED &&
+		    !armed && !stream->running)
+			zio_trigger_abort_disable(cset, 0);
+	} else if (fsm == FA100M14B4C_STATE_IDLE) {
+		/* The endless shot is over: the incomplete block is lost */
+		spin_lock_irq(&cset->lock);
+		if (fa_stream_current(fa, gen)) {
+			dev_dbg(fa->msgdev, "stream restart\n");
+			stream->triggered = false;
+			stream->rd = 0;
+			stream->restart = true;
+			stream->n_restart++;
+			fa_writel(fa, fa->fa_adc_csr_base,
+				  &zfad_regs[ZFA_CTL_RST_TRG_STA], 1);
+			fa_writel(fa, fa->fa_adc_csr_base,
+				  &zfad_regs[ZFA_CTL_FMS_CMD],
+				  FA100M14B4C_CMD_START);
+		}
+		spin_unlock_irq(&cset->lock);
+	}
+
+out:
+	if (stream->running)
+		queue_delayed_work(fa->wq, &stream->work, stream->period);
+}
+
+/**
+ * It completes the transfer of a block: it sets the time-stamp of the
+ * first sample, the sequence number and the alarms, then it stores the
+ * block
+ *
+ * @param cset
+ */
+void fa_stream_dma_done(struct zio_cset *cset)
+{
+	struct fa_dev *fa = cset->zdev->priv_d;
+	struct fa_stream *stream = &fa->stream;
+	struct zio_channel *interleave = cset->interleave;
+	struct zfad_block *zfad_block = interleave->priv_d;
+	struct zio_control *ctrl = zio_get_ctrl(zfad_block[0].block);
+	uint64_t ticks;
+	uint32_t cnt, rem;
+
+	ticks = div_u64((uint64_t)stream->rd * FA_STREAM_SAMPLE_NS *
+			fa_stream_decimation(fa), FA100M14B4C_UTC_CLOCK_NS);
+	ticks += stream->trg_ticks;
+	ctrl->tstamp.secs = stream->trg_secs +
+		div_u64_rem(ticks, FA100M14B4C_UTC_CLOCK_FREQ, &rem);
+	ctrl->tstamp.ticks = rem;
+	ctrl->tstamp.bins = 0;
+	ctrl->seq_num = stream->seq++;
+
+	/* The gateware may have lapped the block during the transfer */
+	cnt = fa_readl(fa, fa->fa_adc_csr_base, &zfad_regs[ZFAT_CNT]);
+	if (cnt - stream->rd > fa_stream_ddr_samples(fa)) {
+		dev_warn(fa->msgdev,
+			 "Stream overrun, block %u may be corrupted\n",
+			 ctrl->seq_num);
+		stream->gap = true;
+		stream->n_overrun++;
+	}
+	if (stream->gap)
+		ctrl->drv_alarms |= FA100M14B4C_DALARM_STREAM_OVERRUN;
+	if (stream->restart)
+		ctrl->drv_alarms |= FA100M14B4C_DALARM_STREAM_RESTART;
+	stream->gap = false;
+	stream->restart = false;
+	stream->rd += stream->chunk;
+
+	/* Sync the channel current control with the block */
+	memcpy(&interleave->current_ctrl->tstamp, &ctrl->tstamp,
+	       sizeof(struct zio_timestamp));
+	interleave->current_ctrl->seq_num = ctrl->seq_num;
+
+	fa_count_add(fa, FA100M14B4C_CNT_DMA_BYTES,
+		     zfad_block[0].block->datalen);
+	fa_stats_block(fa, zfad_block[0].block);
+	fa_decim_block(fa, zfad_block[0].block, true);
+	fa_pack_block(fa, zfad_block[0].block);
+
+	/* Store the block, the trigger arms again for the next one */
+	zio_trigger_data_done(cset);
+
+	if (stream->running)
+		mod_delayed_work(fa->wq, &stream->work, 0);
+}
+
+/**
+ * It configures the endless shot and it starts following the DDR. It must
+ * run after the trigger is armed and before the START command
+ *
+ * @param fa the fmc-adc descriptor
+ */
+void fa_stream_start(struct fa_dev *fa)
+{
+	struct fa_stream *stream = &fa->stream;
+	unsigned long flags;
+	u64 ns;
+
+	fa_writel(fa, fa->fa_adc_csr_base, &zfad_regs[ZFAT_PRE], 0);
+	fa_writel(fa, fa->fa_adc_csr_base, &zfad_regs[ZFAT_POST], ~0);
+	fa_writel(fa, fa->fa_adc_csr_base, &zfad_regs[ZFAT_SHOTS_NB], 1);
+
+	stream->triggered = false;
+	stream->rd = 0;
+	stream->seq = 0;
+	stream->gap = false;
+	stream->restart = false;
+	fa_decim_reset(fa);
+	/* Poll twice per block */
+	ns = (u64)stream->chunk * FA_STREAM_SAMPLE_NS *
+		fa_stream_decimation(fa);
+	stream->period = max_t(unsigned long, 1, nsecs_to_jiffies(ns / 2));
+	spin_lock_irqsave(&fa->zdev->cset->lock, flags);
+	stream->running = true;
+	spin_unlock_irqrestore(&fa->zdev->cset->lock, flags);
+	queue_delayed_work(fa->wq, &stream->work, 0);
+}
+
+/**
+ * It stops following the DDR and it restores the user configuration of
+ * the acquisition. It does not wait for the work: it may be the caller,
+ * or the caller may be atomic. A work already running sees the new
+ * generation and it does not touch the hardware any more
+ *
+ * @param fa the fmc-adc descriptor
+ */
+void fa_stream_stop(struct fa_dev *fa)
+{
+	struct fa_stream *stream = &fa->stream;
+	struct zio_cset *cset = fa->zdev->cset;
+	struct zio_attribute *std;
+	unsigned long flags;
+	bool running;
+	uint32_t post;
+
+	spin_lock_irqsave(&cset->lock, flags);
+	running = stream->running;
+	stream->running = false;
+	stream->gen++;
+	spin_unlock_irqrestore(&cset->lock, flags);
+	if (!running)
+		return;
+	cancel_delayed_work(&stream->work);
+
+	std = cset->ti->zattr_set.std_zattr;
+	post = std[ZIO_ATTR_TRIG_POST_SAMP].value;
+	fa_writel(fa, fa->fa_adc_csr_base, &zfad_regs[ZFAT_PRE],
+		  std[ZIO_ATTR_TRIG_PRE_SAMP].value);
+	fa_writel(fa, fa->fa_adc_csr_base, &zfad_regs[ZFAT_POST],
+		  post ? post - 1 : 0);
+	fa_writel(fa, fa->fa_adc_csr_base, &zfad_regs[ZFAT_SHOTS_NB],
+		  std[ZIO_ATTR_TRIG_N_SHOTS].value);
+}
+
+void fa_stream_init(struct fa_dev *fa)
+{
+	INIT_DELAYED_WORK(&fa->stream.work, fa_stream_work);
+}
+
+void fa_stream_exit(struct fa_dev *fa)
+{
+	fa->stream.running = false;
+	cancel_delayed_work_sync(&fa->stream.work);
+}
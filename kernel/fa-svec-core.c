@@ -23,12 +23,14 @@ static int fa_svec_init(struct fa_dev *fa)
 	struct fmc_device *fmc = fa->fmc;
 	struct fa_svec_data *cdata;
 	struct svec_dev *svec = fmc->carrier_data;
+	int err;
 
 	cdata = kzalloc(sizeof(struct fa_svec_data), GFP_KERNEL);
 	if (!cdata)
 		return -ENOMEM;
 
 	cdata->vme_base = svec->cfg_cur.vme_base;
+	fa_svec_vme_init(&cdata->vme);
 	fa->fa_carrier_csr_base = fmc_find_sdb_device(fmc->sdb, 0xce42,
 						      0x6603, NULL);
 	cdata->fa_dma_ddr_addr = fmc_find_sdb_device_ext(fmc->sdb, 0xce42,
@@ -48,6 +50,14 @@ static int fa_svec_init(struct fa_dev *fa)
 
 	/* register carrier data */
 	fa->carrier_data = cdata;
+
+	err = fa_svec_dma_init(fa);
+	if (err) {
+		fa->carrier_data = NULL;
+		kfree(cdata);
+		return err;
+	}
+
 	return 0;
 }
 
@@ -56,8 +66,32 @@ static int fa_svec_reset(struct fa_dev *fa)
 	return 0;
 }
 
+/* The DMA transfers end on the carrier worker, not with an interrupt */
+static int fa_svec_setup_irqs(struct fa_dev *fa)
+{
+	fa->irq_src |= FA_IRQ_SRC_DMA | FA_IRQ_SRC_DMA_WORK;
+
+	return 0;
+}
+
+static int fa_svec_free_irqs(struct fa_dev *fa)
+{
+	struct fa_svec_data *svec_data = fa->carrier_data;
+
+	/* An acquisition worker may still queue a transfer */
+	flush_workqueue(fa->wq);
+	flush_workqueue(svec_data->dma_wq);
+
+	return 0;
+}
+
 static void fa_svec_exit(struct fa_dev *fa)
 {
+	struct fa_svec_data *svec_data = fa->carrier_data;
+
+	fa_svec_dma_exit(fa);
+
+	kfree(svec_data->bounce);
 	kfree(fa->carrier_data);
 }
 
@@ -66,7 +100,11 @@ struct fa_carrier_op fa_svec_op = {
 	.init = fa_svec_init,
 	.reset_core = fa_svec_reset,
 	.exit = fa_svec_exit,
+	.setup_irqs = fa_svec_setup_irqs,
+	.free_irqs = fa_svec_free_irqs,
 	.dma_start = fa_svec_dma_start,
 	.dma_done = fa_svec_dma_done,
 	.dma_error = fa_svec_dma_error,
+	.conf_set = fa_svec_conf_set,
+	.info_get = fa_svec_info_get,
 };
@@ -6,6 +6,12 @@
 
 #include <linux/module.h>
 #include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/bitops.h>
+#include <linux/log2.h>
+#include <linux/swab.h>
+#include <linux/timekeeping.h>
+#include <linux/workqueue.h>
 #include <asm/byteorder.h>
 #include "fmc-adc-100m14b4cha.h"
 #include "fa-svec.h"
@@ -13,16 +19,90 @@
 
 #define VME_NO_ADDR_INCREMENT 1
 
+/* Largest bounce buffer, larger coalesced transfers are split */
+#define FA_SVEC_BOUNCE_MAX min_t(size_t, 4 * 1024 * 1024, KMALLOC_MAX_SIZE)
+
 /* FIXME: move to include again */
 #ifndef lower_32_bits
 #define lower_32_bits(n) ((u32)(n))
 #endif /* lower_32_bits */
 
-static void build_dma_desc(struct vme_dma *desc, unsigned long vme_addr,
-			void *addr_dest, ssize_t len)
+/*
+ * VME transfer modes, with the data widths they accept and the mode to
+ * fall back to when the bridge or the board refuses them. A mode which
+ * falls back to itself is the last resort of its address space
+ */
+struct fa_svec_vme_mode {
+	unsigned int am;
+	unsigned int dwidth_mask;
+	unsigned int fallback;
+};
+
+#define FA_VME_DW(_w) BIT(ilog2(_w))
+
+static const struct fa_svec_vme_mode fa_svec_vme_modes[] = {
+	{VME_A24_USER_DATA_SCT, FA_VME_DW(16) | FA_VME_DW(32),
+	 VME_A24_USER_DATA_SCT},
+	{VME_A24_USER_BLT, FA_VME_DW(16) | FA_VME_DW(32),
+	 VME_A24_USER_DATA_SCT},
+	{VME_A24_USER_MBLT, FA_VME_DW(64), VME_A24_USER_BLT},
+	{VME_A32_USER_DATA_SCT, FA_VME_DW(16) | FA_VME_DW(32),
+	 VME_A32_USER_DATA_SCT},
+	{VME_A32_USER_BLT, FA_VME_DW(16) | FA_VME_DW(32),
+	 VME_A32_USER_DATA_SCT},
+	{VME_A32_USER_MBLT, FA_VME_DW(64), VME_A32_USER_BLT},
+	{VME_2e6U, FA_VME_DW(64), VME_A32_USER_MBLT},
+};
+
+static const struct fa_svec_vme_mode *fa_svec_vme_mode(unsigned int am)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(fa_svec_vme_modes); ++i)
+		if (fa_svec_vme_modes[i].am == am)
+			return &fa_svec_vme_modes[i];
+	return NULL;
+}
+
+/* The widest data width of the mode that does not exceed the given one */
+static unsigned int fa_svec_vme_dwidth(const struct fa_svec_vme_mode *mode,
+				       unsigned int dwidth)
+{
+	unsigned int mask = mode->dwidth_mask & (FA_VME_DW(dwidth) * 2 - 1);
+
+	return mask ? BIT(__fls(mask)) : BIT(__ffs(mode->dwidth_mask));
+}
+
+void fa_svec_vme_init(struct fa_svec_vme *vme)
+{
+	vme->am = VME_A24_USER_DATA_SCT;
+	vme->am_cur = vme->am;
+	vme->dwidth = 32;
+	vme->dwidth_cur = vme->dwidth;
+	vme->bsize = 4096;
+	vme->backoff = 0;
+}
+
+static enum vme_data_width fa_svec_vme_dw(unsigned int dwidth)
+{
+	switch (dwidth) {
+	case 16:
+		return VME_D16;
+	case 64:
+		return VME_D64;
+	default:
+		return VME_D32;
+	}
+}
+
+static void build_dma_desc(struct vme_dma *desc, struct fa_svec_vme *cfg,
+			   unsigned long vme_addr, void *addr_dest,
+			   ssize_t len)
 {
 	struct vme_dma_attr *vme;
 	struct vme_dma_attr *pci;
+	enum vme_dma_block_size bsize;
+	enum vme_dma_backoff backoff;
 
 	memset(desc, 0, sizeof(struct vme_dma));
 
@@ -33,14 +113,17 @@ static void build_dma_desc(struct vme_dma *desc, unsigned long vme_addr,
 	desc->length    = len;
 	desc->novmeinc  = VME_NO_ADDR_INCREMENT;
 
-	desc->ctrl.pci_block_size   = VME_DMA_BSIZE_4096;
-	desc->ctrl.pci_backoff_time = VME_DMA_BACKOFF_0;
-	desc->ctrl.vme_block_size   = VME_DMA_BSIZE_4096;
-	desc->ctrl.vme_backoff_time = VME_DMA_BACKOFF_0;
+	/* 32 bytes is the smallest block, the backoff doubles from 1us */
+	bsize = VME_DMA_BSIZE_32 + ilog2(cfg->bsize / 32);
+	backoff = cfg->backoff ? VME_DMA_BACKOFF_1 + ilog2(cfg->backoff) :
+		VME_DMA_BACKOFF_0;
+	desc->ctrl.pci_block_size   = bsize;
+	desc->ctrl.pci_backoff_time = backoff;
+	desc->ctrl.vme_block_size   = bsize;
+	desc->ctrl.vme_backoff_time = backoff;
 
-	vme->data_width = VME_D32;
-	vme->am         = VME_A24_USER_DATA_SCT;
-	/*vme->am         = VME_A24_USER_MBLT;*/
+	vme->data_width = fa_svec_vme_dw(cfg->dwidth_cur);
+	vme->am         = cfg->am_cur;
 	vme->addru	= upper_32_bits(vme_addr);
 	vme->addrl	= lower_32_bits(vme_addr);
 
@@ -49,6 +132,129 @@ static void build_dma_desc(struct vme_dma *desc, unsigned long vme_addr,
 
 }
 
+/*
+ * It transfers len bytes from the ADC memory, starting at ddr_off. When
+ * the transfer mode is refused, it falls back to a simpler one and it
+ * tries again; the fallback is kept until the user changes the mode.
+ */
+static int fa_svec_vme_dma(struct fa_dev *fa, uint32_t ddr_off, void *dst,
+			   size_t len)
+{
+	struct fa_svec_data *svec_data = fa->carrier_data;
+	struct fa_svec_vme *cfg = &svec_data->vme;
+	const struct fa_svec_vme_mode *mode;
+	unsigned long vme_addr;
+	struct vme_dma desc;    /* Vme driver DMA structure */
+	int err;
+
+	vme_addr = svec_data->vme_base + svec_data->fa_dma_ddr_data;
+	for (;;) {
+		/*
+		 * Be careful: the SVEC HW version expects an address of
+		 * 32bits word therefore mem-offset in byte is translated
+		 * into 32bit word
+		 */
+		fa_writel(fa, svec_data->fa_dma_ddr_addr,
+			  &fa_svec_regfield[FA_DMA_DDR_ADDR],
+			  (ddr_off & (fa->ddr_size - 1)) / 4);
+		build_dma_desc(&desc, cfg, vme_addr, dst, len);
+		err = vme_do_dma_kernel(&desc);
+		if (!err)
+			return 0;
+
+		mode = fa_svec_vme_mode(cfg->am_cur);
+		if (!mode || mode->fallback == cfg->am_cur)
+			return -EIO;
+		mode = fa_svec_vme_mode(mode->fallback);
+		dev_warn(fa->msgdev,
+			 "VME AM 0x%02x D%u refused (%d), using AM 0x%02x D%u\n",
+			 cfg->am_cur, cfg->dwidth_cur, err, mode->am,
+			 fa_svec_vme_dwidth(mode, cfg->dwidth_cur));
+		cfg->dwidth_cur = fa_svec_vme_dwidth(mode, cfg->dwidth_cur);
+		cfg->am_cur = mode->am;
+		cfg->n_fallback++;
+	}
+}
+
+/**
+ * It sets a VME transfer parameter. Changing the address modifier or
+ * the data width cancels the previous fallbacks
+ * @param fa the fmc-adc descriptor
+ * @param id parameter
+ * @param val value
+ *
+ * @return 0 on success, otherwise a negative error number
+ */
+int fa_svec_conf_set(struct fa_dev *fa, unsigned int id, uint32_t val)
+{
+	struct fa_svec_data *svec_data = fa->carrier_data;
+	struct fa_svec_vme *cfg = &svec_data->vme;
+	const struct fa_svec_vme_mode *mode;
+
+	switch (id) {
+	case ZFA_SW_R_NOADDRES_VME_AM:
+		mode = fa_svec_vme_mode(val);
+		if (!mode)
+			return -EINVAL;
+		cfg->am = val;
+		cfg->dwidth = fa_svec_vme_dwidth(mode, 64);
+		break;
+	case ZFA_SW_R_NOADDRES_VME_DWIDTH:
+		mode = fa_svec_vme_mode(cfg->am);
+		if (!is_power_of_2(val) || val > 64 ||
+		    !(mode->dwidth_mask & FA_VME_DW(val)))
+			return -EINVAL;
+		cfg->dwidth = val;
+		break;
+	case ZFA_SW_R_NOADDRES_VME_BSIZE:
+		if (!is_power_of_2(val) || val < 32 || val > 4096)
+			return -EINVAL;
+		cfg->bsize = val;
+		return 0;
+	case ZFA_SW_R_NOADDRES_VME_BACKOFF:
+		if (val && (!is_power_of_2(val) || val > 64))
+			return -EINVAL;
+		cfg->backoff = val;
+		return 0;
+	default:
+		return -EINVAL;
+	}
+
+	cfg->am_cur = cfg->am;
+	cfg->dwidth_cur = cfg->dwidth;
+
+	return 0;
+}
+
+int fa_svec_info_get(struct fa_dev *fa, unsigned int id, uint32_t *val)
+{
+	struct fa_svec_data *svec_data = fa->carrier_data;
+	struct fa_svec_vme *cfg = &svec_data->vme;
+
+	switch (id) {
+	case ZFA_SW_R_NOADDRES_VME_AM:
+		*val = cfg->am;
+		return 0;
+	case ZFA_SW_VME_AM_CUR:
+		*val = cfg->am_cur;
+		return 0;
+	case ZFA_SW_R_NOADDRES_VME_DWIDTH:
+		*val = cfg->dwidth_cur;
+		return 0;
+	case ZFA_SW_R_NOADDRES_VME_BSIZE:
+		*val = cfg->bsize;
+		return 0;
+	case ZFA_SW_R_NOADDRES_VME_BACKOFF:
+		*val = cfg->backoff;
+		return 0;
+	case ZFA_SW_VME_FALLBACK:
+		*val = cfg->n_fallback;
+		return 0;
+	default:
+		return -EINVAL;
+	}
+}
+
 /* Endianess */
 #ifndef LITTLE_ENDIAN
 #define LITTLE_ENDIAN 0
@@ -69,64 +275,288 @@ static int __get_endian(void)
 		return BIG_ENDIAN;
 }
 
-static void __endianness(unsigned int byte_length, void *buffer)
+/*
+ * It swaps (if necessary) the samples while copying them from the DMA
+ * buffer to the block. The swap touches every word anyway, so the copy
+ * comes for free. The source and the destination can be the same buffer.
+ */
+static void __endianness_copy(unsigned int byte_length, void *dst,
+			      const void *src)
 {
+	const uint32_t *src32 = src;
+	uint32_t *dst32 = dst;
 	int i, size;
-	uint32_t *ptr;
-
-	/* CPU may be little endian, VME is big endian */
-	if (__get_endian() == LITTLE_ENDIAN) {
-		ptr = buffer;
-		/* swap samples and trig timetag all seen as 32bits words */
-		size = byte_length/4;
-		for (i = 0; i < size; ++i, ++ptr)
-			*ptr = __be32_to_cpu(*ptr);
+
+	size = byte_length/4;
+	for (i = 0; i < size; ++i)
+		dst32[i] = __be32_to_cpu(src32[i]);
+}
+
+/*
+ * Like __endianness_copy() but two 32-bit words at a time: the 64-bit
+ * swap reverses the bytes and the order of the words, the rotation puts
+ * the words back in place. The loop is unrolled so that the CPU overlaps
+ * the loads. Using the FPU (kernel_fpu_begin()) would allow a byte
+ * shuffle, but saving the FPU state costs more than what we gain on a
+ * single shot.
+ */
+static void __endianness_copy64(unsigned int byte_length, void *dst,
+				const void *src)
+{
+	const uint64_t *src64 = src;
+	uint64_t *dst64 = dst;
+	unsigned int i, size;
+
+	size = byte_length/8;
+	for (i = 0; i + 4 <= size; i += 4) {
+		dst64[i + 0] = ror64(swab64(src64[i + 0]), 32);
+		dst64[i + 1] = ror64(swab64(src64[i + 1]), 32);
+		dst64[i + 2] = ror64(swab64(src64[i + 2]), 32);
+		dst64[i + 3] = ror64(swab64(src64[i + 3]), 32);
+	}
+	for (; i < size; ++i)
+		dst64[i] = ror64(swab64(src64[i]), 32);
+	if (byte_length & 4)
+		__endianness_copy(4, &dst64[size], &src64[size]);
+}
+
+/*
+ * It copies a block from the DMA buffer (it can be the block itself)
+ * and it puts the samples in the byte order selected by the user. The
+ * trigger time-tag appended to the samples is for the driver, it always
+ * ends up in CPU order. The time spent is accounted to the acquisition.
+ */
+static void fa_svec_swap(struct fa_dev *fa, enum fa100m14b4c_swap mode,
+			 struct zio_block *block, const void *src)
+{
+	unsigned int len = block->datalen;
+	u64 start = ktime_get_ns();
+
+	if (__get_endian() != LITTLE_ENDIAN) {
+		if (block->data != src)
+			memcpy(block->data, src, len);
+		return;
+	}
+
+	switch (mode) {
+	case FA100M14B4C_SWAP_NONE:
+		/* streaming blocks do not carry the time-tag */
+		if (!fa->stream.running)
+			len -= FA_TRIG_TIMETAG_BYTES;
+		if (block->data != src)
+			memcpy(block->data, src, len);
+		__endianness_copy(block->datalen - len, block->data + len,
+				  src + len);
+		zio_get_ctrl(block)->drv_alarms |= FA100M14B4C_DALARM_SWAP;
+		break;
+	case FA100M14B4C_SWAP_WORD64:
+		__endianness_copy64(len, block->data, src);
+		break;
+	default:
+		__endianness_copy(len, block->data, src);
+		break;
 	}
 
+	fa->svec_swap_ns += ktime_get_ns() - start;
+	fa->svec_swap_bytes += block->datalen;
 }
 
-int fa_svec_dma_start(struct zio_cset *cset)
+/*
+ * It returns a buffer of at least @size bytes for the coalesced DMA. The
+ * buffer is kept across acquisitions and it grows when necessary, up to
+ * FA_SVEC_BOUNCE_MAX.
+ */
+static void *fa_svec_dma_bounce(struct fa_svec_data *svec_data, size_t size)
+{
+	if (svec_data->bounce_size >= size)
+		return svec_data->bounce;
+
+	kfree(svec_data->bounce);
+	svec_data->bounce = kmalloc(size, GFP_KERNEL | __GFP_NOWARN);
+	svec_data->bounce_size = svec_data->bounce ? size : 0;
+	return svec_data->bounce;
+}
+
+/*
+ * Shots are stored back-to-back in the ADC memory, so we can get many of
+ * them with a single DMA transfer and then slice the data into blocks.
+ * The bounce buffer is limited, so the shots are transferred in groups
+ * that fit in it; a shot larger than the buffer goes straight into its
+ * block. It returns -ENOMEM, before touching the hardware, when there is
+ * not enough memory for it.
+ */
+static int fa_svec_dma_coalesced(struct fa_dev *fa,
+				 struct zfad_block *fa_dma_block,
+				 enum fa100m14b4c_swap mode)
 {
-	struct fa_dev *fa = cset->zdev->priv_d;
 	struct fa_svec_data *svec_data = fa->carrier_data;
+	struct zio_block *block;
+	size_t size = 0, len;
+	uint32_t ddr_off;
+	void *data;
+	int i, n, k, err;
+
+	for (i = 0; i < fa->n_shots; ++i)
+		size += fa_dma_block[i].block->datalen;
+	data = fa_svec_dma_bounce(svec_data,
+				  min_t(size_t, size, FA_SVEC_BOUNCE_MAX));
+	if (!data)
+		return -ENOMEM;
+
+	ddr_off = fa_dma_block[0].dev_mem_off;
+	for (i = 0; i < fa->n_shots; i += n) {
+		len = fa_dma_block[i].block->datalen;
+		for (n = 1; i + n < fa->n_shots; ++n) {
+			block = fa_dma_block[i + n].block;
+			if (len + block->datalen > svec_data->bounce_size)
+				break;
+			len += block->datalen;
+		}
+
+		if (n == 1) {
+			block = fa_dma_block[i].block;
+			err = fa_svec_vme_dma(fa, ddr_off, block->data, len);
+			if (err)
+				return err;
+			fa_svec_swap(fa, mode, block, block->data);
+			ddr_off += len;
+			continue;
+		}
+
+		dev_dbg(fa->msgdev,
+			"configure DMA descriptor for %d shots "
+			"ddr offset: 0x%x destination address: 0x%p len: %zu\n",
+			n, ddr_off, data, len);
+		err = fa_svec_vme_dma(fa, ddr_off, data, len);
+		if (err)
+			return err;
+		for (k = 0; k < n; ++k) {
+			block = fa_dma_block[i + k].block;
+			fa_svec_swap(fa, mode, block, data);
+			data += block->datalen;
+		}
+		data = svec_data->bounce;
+		ddr_off += len;
+	}
+
+	return 0;
+}
+
+/*
+ * It transfers all the shots. The vmebus driver blocks until the end of
+ * each transfer, so this runs on the carrier worker.
+ */
+static int fa_svec_dma_xfer(struct fa_dev *fa, enum fa100m14b4c_swap mode)
+{
+	struct zio_cset *cset = fa->zdev->cset;
 	struct zio_channel *interleave = cset->interleave;
 	struct zfad_block *fa_dma_block = interleave->priv_d;
-	int i;
-	struct vme_dma desc;    /* Vme driver DMA structure */
-	unsigned long vme_addr;
+	uint32_t ddr_off;
+	int i, err;
 
-	vme_addr = svec_data->vme_base + svec_data->fa_dma_ddr_data;
+	fa->svec_swap_ns = 0;
+	fa->svec_swap_bytes = 0;
+
+	/* Execute a single DMA for all shots, when possible */
+	if (fa->enable_dma_coalesce && fa->n_shots > 1) {
+		err = fa_svec_dma_coalesced(fa, fa_dma_block, mode);
+		if (err != -ENOMEM)
+			return err;
+		dev_dbg(fa->msgdev, "Not enough memory, DMA shot by shot\n");
+	}
 
 	/*
-	 * write the data address in the ddr_addr register: this
-	 * address has been computed after ACQ_END by looking to the
-	 * trigger position see fa-irq.c::irq_acq_end.
-	 * Be careful: the SVEC HW version expects an address of 32bits word
-	 * therefore mem-offset in byte is translated into 32bit word
-	 **/
-	fa_writel(fa, svec_data->fa_dma_ddr_addr,
-			&fa_svec_regfield[FA_DMA_DDR_ADDR],
-			fa_dma_block[0].dev_mem_off/4);
-	/* Execute DMA shot by shot */
+	 * Execute DMA shot by shot. The data address has been computed
+	 * after ACQ_END by looking to the trigger position see
+	 * fa-irq.c::irq_acq_end; the shots follow each other
+	 */
+	ddr_off = fa_dma_block[0].dev_mem_off;
 	for (i = 0; i < fa->n_shots; ++i) {
 		dev_dbg(fa->msgdev,
 			"configure DMA descriptor shot %d "
-			"vme addr: 0x%llx destination address: 0x%p len: %d\n",
-			i, (long long)vme_addr, fa_dma_block[i].block->data,
+			"ddr offset: 0x%x destination address: 0x%p len: %d\n",
+			i, ddr_off, fa_dma_block[i].block->data,
 			(int)fa_dma_block[i].block->datalen);
-		build_dma_desc(&desc, vme_addr,
-				fa_dma_block[i].block->data,
-				fa_dma_block[i].block->datalen);
-
-		if (vme_do_dma_kernel(&desc))
-			return -1;
-		__endianness(fa_dma_block[i].block->datalen,
+		err = fa_svec_vme_dma(fa, ddr_off,
+				      fa_dma_block[i].block->data,
+				      fa_dma_block[i].block->datalen);
+		if (err)
+			return err;
+		fa_svec_swap(fa, mode, fa_dma_block[i].block,
 			     fa_dma_block[i].block->data);
+		ddr_off += fa_dma_block[i].block->datalen;
 	}
 
 	return 0;
 }
 
+static void fa_svec_dma_work(struct work_struct *work)
+{
+	struct fa_svec_data *svec_data = container_of(work,
+						      struct fa_svec_data,
+						      dma_work);
+	struct fa_dev *fa = svec_data->fa;
+
+	zfad_dma_complete(fa->zdev->cset,
+			  fa_svec_dma_xfer(fa, svec_data->dma_swap));
+}
+
+/**
+ * It queues the transfer of the acquisition on the carrier worker, so
+ * that the acquisition worker does not wait for the VME bus. The
+ * worker completes the DMA (zfad_dma_complete())
+ *
+ * @param cset
+ *
+ * @return 0 on success, otherwise a negative error number
+ */
+int fa_svec_dma_start(struct zio_cset *cset)
+{
+	struct fa_dev *fa = cset->zdev->priv_d;
+	struct fa_svec_data *svec_data = fa->carrier_data;
+
+	/* The mode of the whole acquisition, the user may change it */
+	svec_data->dma_swap = READ_ONCE(fa->svec_swap);
+	if (!queue_work(svec_data->dma_wq, &svec_data->dma_work))
+		return -EBUSY;
+
+	return 0;
+}
+
+/**
+ * It creates the worker that runs the VME transfers
+ *
+ * @param fa the fmc-adc descriptor
+ *
+ * @return 0 on success, otherwise a negative error number
+ */
+int fa_svec_dma_init(struct fa_dev *fa)
+{
+	struct fa_svec_data *svec_data = fa->carrier_data;
+
+	svec_data->fa = fa;
+	INIT_WORK(&svec_data->dma_work, fa_svec_dma_work);
+	svec_data->dma_wq = alloc_workqueue("%s-dma",
+					    WQ_UNBOUND | WQ_MEM_RECLAIM, 1,
+					    dev_name(fa->msgdev));
+	if (!svec_data->dma_wq)
+		return -ENOMEM;
+
+	return 0;
+}
+
+/**
+ * It waits for the pending transfer, if any, and it destroys the worker
+ *
+ * @param fa the fmc-adc descriptor
+ */
+void fa_svec_dma_exit(struct fa_dev *fa)
+{
+	struct fa_svec_data *svec_data = fa->carrier_data;
+
+	destroy_workqueue(svec_data->dma_wq);
+}
+
 void fa_svec_dma_done(struct zio_cset *cset)
 {
 	/* nothing special to do */
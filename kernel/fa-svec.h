@@ -7,6 +7,7 @@
 #define __FA_SVEC_CORE_H__
 
 #include <linux/irqreturn.h>
+#include <linux/workqueue.h>
 
 #include "fmc-adc-100m14b4cha.h"
 #include "field-desc.h"
@@ -29,6 +30,26 @@ enum fa_spec_regs_id {
 	FA_CAR_FMC1_RES,
 };
 
+/*
+ * fa_svec_vme: VME block transfer configuration
+ * @am: address modifier chosen by the user
+ * @am_cur: address modifier in use, it differs from @am after a fallback
+ * @dwidth: data width chosen by the user (bits)
+ * @dwidth_cur: data width in use
+ * @bsize: DMA block size (bytes)
+ * @backoff: DMA backoff time between blocks (us)
+ * @n_fallback: number of refused modes (statistics)
+ */
+struct fa_svec_vme {
+	unsigned int	am;
+	unsigned int	am_cur;
+	unsigned int	dwidth;
+	unsigned int	dwidth_cur;
+	unsigned int	bsize;
+	unsigned int	backoff;
+	unsigned int	n_fallback;
+};
+
 /* specific carrier data */
 struct fa_svec_data {
 	/* DMA attributes */
@@ -36,6 +57,15 @@ struct fa_svec_data {
 	unsigned int	fa_dma_ddr_data; /* offset */
 	unsigned int	fa_dma_ddr_addr; /* offset */
 	unsigned int	n_dma_err; /* statistics */
+	/* buffer used to DMA all shots at once (kept across acquisitions) */
+	void		*bounce;
+	size_t		bounce_size;
+	struct fa_svec_vme vme;
+	/* the transfers run on their own worker (asynchronous DMA) */
+	struct fa_dev	*fa;
+	struct workqueue_struct *dma_wq;
+	struct work_struct dma_work;
+	enum fa100m14b4c_swap dma_swap;
 };
 
 /* svec specific hardware registers */
@@ -47,5 +77,11 @@ extern irqreturn_t fa_svec_irq_handler(int irq, void *dev_id);
 extern int fa_svec_dma_start(struct zio_cset *cset);
 extern void fa_svec_dma_done(struct zio_cset *cset);
 extern void fa_svec_dma_error(struct zio_cset *cset);
+extern int fa_svec_dma_init(struct fa_dev *fa);
+extern void fa_svec_dma_exit(struct fa_dev *fa);
+extern void fa_svec_vme_init(struct fa_svec_vme *vme);
+extern int fa_svec_conf_set(struct fa_dev *fa, unsigned int id, uint32_t val);
+extern int fa_svec_info_get(struct fa_dev *fa, unsigned int id,
+			    uint32_t *val);
 
 #endif /* __FA_SVEC_CORE_H__*/
@@ -0,0 +1,101 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright CERN 2019
+ *
+ * Trigger time-tag ring. Every shot leaves its trigger time in a ring
+ * that user space reads in bulk from the "timetags" binary attribute,
+ * without reading the blocks.
+ */
+
+#include <linux/kernel.h>
+#include <linux/vmalloc.h>
+#include <linux/spinlock.h>
+#include <linux/sysfs.h>
+
+#include "fmc-adc-100m14b4cha.h"
+
+#define FA_TIMETAG_SIZE \
+	(FA100M14B4C_TIMETAG_N * sizeof(struct fa100m14b4c_timetag))
+
+/**
+ * It records the trigger time-tag of a shot
+ *
+ * @param fa the fmc-adc descriptor
+ * @param ctrl control of the shot block, with its time stamp
+ */
+void fa_timetag_record(struct fa_dev *fa, struct zio_control *ctrl)
+{
+	struct fa_timetag *timetag = &fa->timetag;
+	struct fa100m14b4c_timetag *tt;
+	unsigned long flags;
+
+	if (!timetag->ring)
+		return;
+
+	spin_lock_irqsave(&timetag->lock, flags);
+	tt = &timetag->ring[timetag->index % FA100M14B4C_TIMETAG_N];
+	tt->index = ++timetag->index;
+	tt->seq_num = ctrl->seq_num;
+	tt->secs = ctrl->tstamp.secs;
+	tt->ticks = ctrl->tstamp.ticks;
+	tt->source = ctrl->attr_trigger.ext_val[FA100M14B4C_TATTR_STA];
+	spin_unlock_irqrestore(&timetag->lock, flags);
+}
+
+static ssize_t fa_timetag_read(struct file *file, struct kobject *kobj,
+			       struct bin_attribute *attr,
+			       char *buf, loff_t off, size_t count)
+{
+	struct device *dev = container_of(kobj, struct device, kobj);
+	struct fa_dev *fa = get_zfadc(dev);
+	struct fa_timetag *timetag = &fa->timetag;
+	unsigned long flags;
+
+	if (off >= FA_TIMETAG_SIZE)
+		return 0;
+	count = min_t(size_t, count, FA_TIMETAG_SIZE - off);
+
+	spin_lock_irqsave(&timetag->lock, flags);
+	memcpy(buf, (void *)timetag->ring + off, count);
+	spin_unlock_irqrestore(&timetag->lock, flags);
+
+	return count;
+}
+
+static struct bin_attribute dev_attr_timetags = {
+	.attr = {
+		.name = "timetags",
+		.mode = 0444,
+	},
+	.size = FA_TIMETAG_SIZE,
+	.read = fa_timetag_read,
+};
+
+int fa_timetag_init(struct fa_dev *fa)
+{
+	struct fa_timetag *timetag = &fa->timetag;
+	int err;
+
+	spin_lock_init(&timetag->lock);
+	timetag->index = 0;
+	timetag->ring = vzalloc(FA_TIMETAG_SIZE);
+	if (!timetag->ring)
+		return -ENOMEM;
+
+	err = device_create_bin_file(&fa->zdev->head.dev, &dev_attr_timetags);
+	if (err) {
+		vfree(timetag->ring);
+		timetag->ring = NULL;
+	}
+
+	return err;
+}
+
+void fa_timetag_exit(struct fa_dev *fa)
+{
+	struct fa_timetag *timetag = &fa->timetag;
+
+	device_remove_bin_file(&fa->zdev->head.dev, &dev_attr_timetags);
+	vfree(timetag->ring);
+	timetag->ring = NULL;
+}
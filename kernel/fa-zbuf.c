@@ -0,0 +1,518 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright CERN 2019
+ *
+ * Contiguous buffer ("fa-contig"). The kmalloc buffer cannot get
+ * multi-megabyte blocks once the memory is fragmented, and the vmalloc
+ * buffer gives the DMA one page at a time. This buffer allocates a pool
+ * of physically contiguous chunks when it is created, in process context,
+ * and then each block takes a whole chunk from a free list: the
+ * allocation is O(1) and it never asks the page allocator, so it works
+ * in the atomic arm path. The chunks are compound pages of the huge page
+ * size by default; user space maps them through the data char device.
+ *
+ * A chunk comes from the page allocator, so it is at most a block of the
+ * largest page order: 4MiB with 4kB pages. A block cannot be larger than
+ * a chunk, so this is also the largest shot the buffer can hold.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/version.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/log2.h>
+#include <linux/spinlock.h>
+
+#include "fmc-adc-100m14b4cha.h"
+
+/* vm_fault_t appeared in 4.17 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,17,0)
+#define vm_fault_t int
+#endif
+
+/*
+ * Largest page order of the page allocator. MAX_ORDER was exclusive until
+ * 6.4, then inclusive; 6.8 renamed it MAX_PAGE_ORDER
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,4,0)
+#define FA_ZBUF_ORDER_MAX (MAX_ORDER - 1)
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(6,8,0)
+#define FA_ZBUF_ORDER_MAX MAX_ORDER
+#else
+#define FA_ZBUF_ORDER_MAX MAX_PAGE_ORDER
+#endif
+
+#define FA_ZBUF_CHUNK_KB_DEFAULT 2048 /* a huge page, on x86-64 */
+#define FA_ZBUF_KB_DEFAULT (8 * FA_ZBUF_CHUNK_KB_DEFAULT)
+/* The block offset for mmap is in the 32-bit mem_offset of the control */
+#define FA_ZBUF_SIZE_MAX (1ULL << 32)
+
+enum fa_zbuf_attr_id {
+	FA_ZBUF_ATTR_CHUNK_KB = 0,
+	FA_ZBUF_ATTR_CHUNK_N,
+	FA_ZBUF_ATTR_CHUNK_FREE,
+	FA_ZBUF_ATTR_KB,
+};
+
+/*
+ * fa_zbuf_chunk: a physically contiguous piece of the pool
+ * @page: first page of the chunk (compound)
+ * @block: the block living in this chunk, when it is in use
+ * @list: item in the free list, or in the list of stored blocks
+ * @offset: position of the chunk in the mapping of the data device
+ */
+struct fa_zbuf_chunk {
+	struct page *page;
+	struct zio_block block;
+	struct list_head list;
+	uint32_t offset;
+};
+
+/*
+ * fa_zbuf_pool: the chunks of a buffer instance
+ * @chunk: array of chunks
+ * @n_chunk: number of chunks in @chunk
+ * @order: page order of a chunk
+ * @free: free chunks, the last freed first (it is still in cache)
+ * @n_free: number of chunks in @free
+ */
+struct fa_zbuf_pool {
+	struct fa_zbuf_chunk *chunk;
+	unsigned int n_chunk;
+	unsigned int order;
+	struct list_head free;
+	unsigned int n_free;
+};
+
+/*
+ * fa_zbuf_instance: the buffer instance
+ * @bi: ZIO buffer instance
+ * @lock: it protects the pool and the stored blocks
+ * @pool: the chunks, it changes only when no block is in use
+ * @stored: blocks ready for user space, the oldest first
+ */
+struct fa_zbuf_instance {
+	struct zio_bi bi;
+	spinlock_t lock;
+	struct fa_zbuf_pool *pool;
+	struct list_head stored;
+};
+
+#define to_fa_zbuf(_bi) container_of(_bi, struct fa_zbuf_instance, bi)
+#define to_fa_zbuf_chunk(_block) container_of(_block, struct fa_zbuf_chunk, \
+					      block)
+
+static inline size_t fa_zbuf_chunk_size(struct fa_zbuf_pool *pool)
+{
+	return PAGE_SIZE << pool->order;
+}
+
+static inline bool fa_zbuf_pool_busy(struct fa_zbuf_pool *pool)
+{
+	return pool->n_free != pool->n_chunk;
+}
+
+static void fa_zbuf_pool_free(struct fa_zbuf_pool *pool)
+{
+	unsigned int i;
+
+	/* The pages mapped by user space go away on munmap() */
+	for (i = 0; i < pool->n_chunk; ++i)
+		__free_pages(pool->chunk[i].page, pool->order);
+	vfree(pool->chunk);
+	kfree(pool);
+}
+
+/*
+ * It allocates the chunks of a pool, in process context. When the memory
+ * is too fragmented the pool is smaller than requested
+ */
+static struct fa_zbuf_pool *fa_zbuf_pool_alloc(uint32_t kb, uint32_t chunk_kb)
+{
+	struct fa_zbuf_pool *pool;
+	struct fa_zbuf_chunk *chunk;
+	unsigned int i, n = DIV_ROUND_UP(kb, chunk_kb);
+	struct page *page;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+	INIT_LIST_HEAD(&pool->free);
+	pool->order = ilog2(chunk_kb) + 10 - PAGE_SHIFT;
+	if (n) {
+		pool->chunk = vzalloc(n * sizeof(*pool->chunk));
+		if (!pool->chunk) {
+			kfree(pool);
+			return NULL;
+		}
+	}
+
+	for (i = 0; i < n; ++i) {
+		/* Zeroed: user space maps it */
+		page = alloc_pages(GFP_KERNEL | __GFP_COMP | __GFP_ZERO |
+				   __GFP_NOWARN, pool->order);
+		if (!page)
+			break;
+		chunk = &pool->chunk[i];
+		chunk->page = page;
+		chunk->offset = i * fa_zbuf_chunk_size(pool);
+		list_add_tail(&chunk->list, &pool->free);
+	}
+	pool->n_chunk = i;
+	pool->n_free = i;
+	if (i < n)
+		pr_warn("%s: fa-contig buffer: only %u chunks of %u kB out of %u\n",
+			KBUILD_MODNAME, i, chunk_kb, n);
+
+	return pool;
+}
+
+/*
+ * It replaces the pool of an instance. This is possible only when no
+ * block is in use
+ */
+static int fa_zbuf_resize(struct fa_zbuf_instance *fzb, uint32_t kb,
+			  uint32_t chunk_kb)
+{
+	struct fa_zbuf_pool *pool;
+	unsigned long flags;
+
+	if (!is_power_of_2(chunk_kb) || chunk_kb < PAGE_SIZE / 1024 ||
+	    ilog2(chunk_kb) + 10 - PAGE_SHIFT > FA_ZBUF_ORDER_MAX)
+		return -EINVAL;
+	if ((uint64_t)DIV_ROUND_UP(kb, chunk_kb) * chunk_kb * 1024 >
+	    FA_ZBUF_SIZE_MAX)
+		return -EINVAL;
+
+	spin_lock_irqsave(&fzb->lock, flags);
+	if (fa_zbuf_pool_busy(fzb->pool)) {
+		spin_unlock_irqrestore(&fzb->lock, flags);
+		return -EBUSY;
+	}
+	spin_unlock_irqrestore(&fzb->lock, flags);
+
+	pool = fa_zbuf_pool_alloc(kb, chunk_kb);
+	if (!pool)
+		return -ENOMEM;
+
+	/* A block may have been allocated meanwhile */
+	spin_lock_irqsave(&fzb->lock, flags);
+	if (fa_zbuf_pool_busy(fzb->pool)) {
+		spin_unlock_irqrestore(&fzb->lock, flags);
+		fa_zbuf_pool_free(pool);
+		return -EBUSY;
+	}
+	swap(fzb->pool, pool);
+	spin_unlock_irqrestore(&fzb->lock, flags);
+	fa_zbuf_pool_free(pool);
+
+	return 0;
+}
+
+/**
+ * It returns how many blocks of a given size the buffer can hold
+ *
+ * @param bi the buffer instance, of type fa-contig
+ * @param size size of a block
+ *
+ * @return the number of blocks, 0 when a chunk is too small for the block
+ */
+unsigned int fa_zbuf_capacity(struct zio_bi *bi, size_t size)
+{
+	struct fa_zbuf_instance *fzb = to_fa_zbuf(bi);
+	unsigned long flags;
+	unsigned int cap;
+
+	spin_lock_irqsave(&fzb->lock, flags);
+	cap = size <= fa_zbuf_chunk_size(fzb->pool) ? fzb->pool->n_chunk : 0;
+	spin_unlock_irqrestore(&fzb->lock, flags);
+
+	return cap;
+}
+
+static int fa_zbuf_conf_set(struct device *dev, struct zio_attribute *zattr,
+			    uint32_t usr_val)
+{
+	struct zio_bi *bi = to_zio_bi(dev);
+	struct zio_attribute *std = bi->zattr_set.std_zattr;
+	struct zio_attribute *ext = bi->zattr_set.ext_zattr;
+
+	switch (zattr->id) {
+	case FA_ZBUF_ATTR_KB:
+		return fa_zbuf_resize(to_fa_zbuf(bi), usr_val,
+				      ext[FA_ZBUF_ATTR_CHUNK_KB].value);
+	case FA_ZBUF_ATTR_CHUNK_KB:
+		return fa_zbuf_resize(to_fa_zbuf(bi),
+				      std[ZIO_ATTR_ZBUF_MAXKB].value, usr_val);
+	default:
+		return -EINVAL;
+	}
+}
+
+static int fa_zbuf_info_get(struct device *dev, struct zio_attribute *zattr,
+			    uint32_t *usr_val)
+{
+	struct fa_zbuf_instance *fzb = to_fa_zbuf(to_zio_bi(dev));
+	unsigned long flags;
+
+	switch (zattr->id) {
+	case FA_ZBUF_ATTR_CHUNK_N:
+		spin_lock_irqsave(&fzb->lock, flags);
+		*usr_val = fzb->pool->n_chunk;
+		spin_unlock_irqrestore(&fzb->lock, flags);
+		break;
+	case FA_ZBUF_ATTR_CHUNK_FREE:
+		spin_lock_irqsave(&fzb->lock, flags);
+		*usr_val = fzb->pool->n_free;
+		spin_unlock_irqrestore(&fzb->lock, flags);
+		break;
+	default:
+		/* ZIO automatically return the attribute value */
+		break;
+	}
+
+	return 0;
+}
+
+static const struct zio_sysfs_operations fa_zbuf_s_op = {
+	.conf_set = fa_zbuf_conf_set,
+	.info_get = fa_zbuf_info_get,
+};
+
+/*
+ * It takes a free chunk. The control comes from the ZIO cache: neither
+ * allocation sleeps with an atomic gfp
+ */
+static struct zio_block *fa_zbuf_alloc_block(struct zio_bi *bi,
+					     size_t datalen, gfp_t gfp)
+{
+	struct fa_zbuf_instance *fzb = to_fa_zbuf(bi);
+	struct fa_zbuf_pool *pool;
+	struct fa_zbuf_chunk *chunk = NULL;
+	struct zio_control *ctrl;
+	unsigned long flags;
+
+	ctrl = zio_alloc_control(gfp);
+	if (!ctrl)
+		return NULL;
+
+	spin_lock_irqsave(&fzb->lock, flags);
+	pool = fzb->pool;
+	if (datalen <= fa_zbuf_chunk_size(pool) && !list_empty(&pool->free)) {
+		chunk = list_first_entry(&pool->free, struct fa_zbuf_chunk,
+					 list);
+		list_del(&chunk->list);
+		pool->n_free--;
+	}
+	spin_unlock_irqrestore(&fzb->lock, flags);
+	if (!chunk) {
+		zio_free_control(ctrl);
+		return NULL;
+	}
+
+	chunk->block.data = page_address(chunk->page);
+	chunk->block.datalen = datalen;
+	chunk->block.uoff = chunk->offset;
+	chunk->block.ctrl_flags = 0;
+	ctrl->mem_offset = chunk->offset;
+	zio_set_ctrl(&chunk->block, ctrl);
+
+	return &chunk->block;
+}
+
+static void fa_zbuf_free_block(struct zio_bi *bi, struct zio_block *block)
+{
+	struct fa_zbuf_instance *fzb = to_fa_zbuf(bi);
+	struct fa_zbuf_chunk *chunk = to_fa_zbuf_chunk(block);
+	unsigned long flags;
+
+	zio_free_control(zio_get_ctrl(block));
+
+	spin_lock_irqsave(&fzb->lock, flags);
+	list_add(&chunk->list, &fzb->pool->free);
+	fzb->pool->n_free++;
+	spin_unlock_irqrestore(&fzb->lock, flags);
+}
+
+static int fa_zbuf_store_block(struct zio_bi *bi, struct zio_block *block)
+{
+	struct fa_zbuf_instance *fzb = to_fa_zbuf(bi);
+	struct fa_zbuf_chunk *chunk = to_fa_zbuf_chunk(block);
+	unsigned long flags;
+	bool awake;
+
+	/* There is no limit: the pool is the limit */
+	spin_lock_irqsave(&fzb->lock, flags);
+	awake = list_empty(&fzb->stored);
+	list_add_tail(&chunk->list, &fzb->stored);
+	spin_unlock_irqrestore(&fzb->lock, flags);
+
+	if (awake)
+		wake_up_interruptible(&bi->q);
+
+	return 0;
+}
+
+static struct zio_block *fa_zbuf_retr_block(struct zio_bi *bi)
+{
+	struct fa_zbuf_instance *fzb = to_fa_zbuf(bi);
+	struct fa_zbuf_chunk *chunk = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&fzb->lock, flags);
+	if (!list_empty(&fzb->stored)) {
+		chunk = list_first_entry(&fzb->stored, struct fa_zbuf_chunk,
+					 list);
+		list_del(&chunk->list);
+	}
+	spin_unlock_irqrestore(&fzb->lock, flags);
+
+	return chunk ? &chunk->block : NULL;
+}
+
+static struct zio_bi *fa_zbuf_create(struct zio_buffer_type *zbuf,
+				     struct zio_channel *chan)
+{
+	struct fa_zbuf_instance *fzb;
+
+	/* The ADC has only input channels */
+	if ((chan->cset->flags & ZIO_DIR) == ZIO_DIR_OUTPUT)
+		return ERR_PTR(-EINVAL);
+
+	fzb = kzalloc(sizeof(*fzb), GFP_KERNEL);
+	if (!fzb)
+		return ERR_PTR(-ENOMEM);
+	spin_lock_init(&fzb->lock);
+	INIT_LIST_HEAD(&fzb->stored);
+	/* The instance attributes do not exist yet: use the defaults */
+	fzb->pool = fa_zbuf_pool_alloc(
+		zbuf->zattr_set.std_zattr[ZIO_ATTR_ZBUF_MAXKB].value,
+		zbuf->zattr_set.ext_zattr[FA_ZBUF_ATTR_CHUNK_KB].value);
+	if (!fzb->pool) {
+		kfree(fzb);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	return &fzb->bi;
+}
+
+/* ZIO does not use the instance any more */
+static void fa_zbuf_destroy(struct zio_bi *bi)
+{
+	struct fa_zbuf_instance *fzb = to_fa_zbuf(bi);
+	struct fa_zbuf_chunk *chunk, *tmp;
+
+	list_for_each_entry_safe(chunk, tmp, &fzb->stored, list) {
+		list_del(&chunk->list);
+		zio_free_control(zio_get_ctrl(&chunk->block));
+	}
+	fa_zbuf_pool_free(fzb->pool);
+	kfree(fzb);
+}
+
+static const struct zio_buffer_operations fa_zbuf_b_op = {
+	.alloc_block = fa_zbuf_alloc_block,
+	.free_block = fa_zbuf_free_block,
+	.store_block = fa_zbuf_store_block,
+	.retr_block = fa_zbuf_retr_block,
+	.create = fa_zbuf_create,
+	.destroy = fa_zbuf_destroy,
+};
+
+/*
+ * The data device maps the chunks one after the other, at the offset in
+ * the control of each block (mem_offset). A chunk is a compound page: the
+ * reference taken here keeps it alive until munmap(), even when the pool
+ * changes
+ */
+static vm_fault_t __fa_zbuf_fault(struct vm_area_struct *vma,
+				  struct vm_fault *vmf)
+{
+	struct zio_f_priv *priv = vma->vm_file->private_data;
+	struct fa_zbuf_instance *fzb = to_fa_zbuf(priv->chan->bi);
+	unsigned long off = vmf->pgoff << PAGE_SHIFT;
+	struct fa_zbuf_pool *pool;
+	struct page *page = NULL;
+	unsigned long flags;
+	unsigned int i;
+
+	if (priv->type == ZIO_CDEV_CTRL)
+		return VM_FAULT_SIGBUS;
+
+	spin_lock_irqsave(&fzb->lock, flags);
+	pool = fzb->pool;
+	i = off >> (PAGE_SHIFT + pool->order);
+	if (i < pool->n_chunk) {
+		page = pool->chunk[i].page +
+			((off & (fa_zbuf_chunk_size(pool) - 1)) >> PAGE_SHIFT);
+		get_page(page);
+	}
+	spin_unlock_irqrestore(&fzb->lock, flags);
+	if (!page)
+		return VM_FAULT_SIGBUS;
+
+	vmf->page = page;
+
+	return 0;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,11,0)
+static int fa_zbuf_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+	return __fa_zbuf_fault(vma, vmf);
+}
+#else
+static vm_fault_t fa_zbuf_fault(struct vm_fault *vmf)
+{
+	return __fa_zbuf_fault(vmf->vma, vmf);
+}
+#endif
+
+static const struct vm_operations_struct fa_zbuf_v_op = {
+	.fault = fa_zbuf_fault,
+};
+
+static ZIO_ATTR_DEFINE_STD(ZIO_BUF, fa_zbuf_std_zattr) = {
+	ZIO_ATTR(zbuf, ZIO_ATTR_ZBUF_MAXKB, ZIO_RW_PERM, FA_ZBUF_ATTR_KB,
+		 FA_ZBUF_KB_DEFAULT),
+};
+static struct zio_attribute fa_zbuf_ext_zattr[] = {
+	[FA_ZBUF_ATTR_CHUNK_KB] = ZIO_ATTR_EXT("chunk-kb", ZIO_RW_PERM,
+					       FA_ZBUF_ATTR_CHUNK_KB,
+					       FA_ZBUF_CHUNK_KB_DEFAULT),
+	[FA_ZBUF_ATTR_CHUNK_N] = ZIO_ATTR_EXT("chunk-n", ZIO_RO_PERM,
+					      FA_ZBUF_ATTR_CHUNK_N, 0),
+	[FA_ZBUF_ATTR_CHUNK_FREE] = ZIO_ATTR_EXT("chunk-free", ZIO_RO_PERM,
+						 FA_ZBUF_ATTR_CHUNK_FREE, 0),
+};
+
+struct zio_buffer_type fa_zbuf_type = {
+	.owner = THIS_MODULE,
+	.zattr_set = {
+		.std_zattr = fa_zbuf_std_zattr,
+		.ext_zattr = fa_zbuf_ext_zattr,
+		.n_ext_attr = ARRAY_SIZE(fa_zbuf_ext_zattr),
+	},
+	.s_op = &fa_zbuf_s_op,
+	.b_op = &fa_zbuf_b_op,
+	.f_op = &zio_generic_file_operations,
+	.v_op = &fa_zbuf_v_op,
+};
+
+int fa_zbuf_init(void)
+{
+	int err;
+
+	err = zio_register_buf(&fa_zbuf_type, "fa-contig");
+	if (err)
+		pr_err("%s: Cannot register ZIO buffer type \"fa-contig\" (error %i)\n",
+		       KBUILD_MODNAME, err);
+	return err;
+}
+
+void fa_zbuf_exit(void)
+{
+	zio_unregister_buf(&fa_zbuf_type);
+}
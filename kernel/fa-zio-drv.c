@@ -79,6 +79,12 @@ static struct zio_attribute zfad_cset_ext_zattr[] = {
 
 	ZIO_ATTR_EXT("tstamp-base-t", ZIO_RW_PERM, ZFA_UTC_COARSE, 0),
 
+	/*
+	 * Host decimation: samples reduced to one by the driver (1 no
+	 * decimation). It is an attribute, so every block records it
+	 */
+	ZIO_ATTR_EXT("decimation", ZIO_RW_PERM, ZFA_SW_R_NOADDRES_DECIM, 1),
+
 	/* Parameters (not attributes) follow */
 
 	/*
@@ -93,6 +99,13 @@ static struct zio_attribute zfad_cset_ext_zattr[] = {
 	 * 0: disabled
 	 */
 	ZIO_PARAM_EXT("fsm-auto-start", ZIO_RW_PERM, ZFA_SW_R_NOADDERS_AUTO, 0),
+	/*
+	 * Double buffer acquisition (with automatic start only)
+	 * 1: enabled
+	 * 0: disabled
+	 */
+	ZIO_PARAM_EXT("fsm-double-buffer", ZIO_RW_PERM,
+		      ZFA_SW_R_NOADDRES_DBUF, 0),
 	/*
 	 * fsm - status of the state machine:
 	 * 1: IDLE
@@ -124,6 +137,94 @@ static struct zio_attribute zfad_cset_ext_zattr[] = {
 	ZIO_PARAM_EXT("max-sample-mshot", ZIO_RO_PERM, ZFA_MULT_MAX_SAMP, 0),
 	ZIO_PARAM_EXT("sample-counter", ZIO_RO_PERM, ZFAT_CNT, 0),
 	ZIO_PARAM_EXT("test-data-pattern", ZIO_RW_PERM, ZFAT_ADC_TST_PATTERN, 0),
+	/* DMA descriptor pool statistics */
+	ZIO_PARAM_EXT("dma-pool-hit", ZIO_RO_PERM, ZFA_SW_DMA_POOL_HIT, 0),
+	ZIO_PARAM_EXT("dma-pool-rebuild", ZIO_RO_PERM,
+		      ZFA_SW_DMA_POOL_REBUILD, 0),
+	/*
+	 * Transfer all the shots of a multi-shot acquisition with a
+	 * single DMA
+	 * 1: enabled
+	 * 0: disabled
+	 */
+	ZIO_PARAM_EXT("dma-coalesce", ZIO_RW_PERM,
+		      ZFA_SW_R_NOADDRES_DMA_COALESCE, 0),
+	/*
+	 * Size (KiB) of the memory mapped ring, 0 to use the ZIO buffer.
+	 * It cannot change while the ring is in use
+	 */
+	ZIO_PARAM_EXT("ring-size-kb", ZIO_RW_PERM,
+		      ZFA_SW_R_NOADDRES_RING_SIZE, 0),
+	/* Double buffer acquisitions overwritten during the DMA */
+	ZIO_PARAM_EXT("double-buffer-overrun", ZIO_RO_PERM,
+		      ZFA_SW_DBUF_OVERRUN, 0),
+	/* CPU running the acquisition worker, -1 for the IRQ one */
+	ZIO_PARAM_EXT("work-cpu", ZIO_RW_PERM, ZFA_SW_WORK_CPU, 0),
+	/*
+	 * Continuous acquisition: samples per block, 0 to disable.
+	 * It cannot change while streaming
+	 */
+	ZIO_PARAM_EXT("stream-chunk-samples", ZIO_RW_PERM,
+		      ZFA_SW_R_NOADDRES_STREAM_CHUNK, 0),
+	/* Streaming overruns: samples overwritten before the transfer */
+	ZIO_PARAM_EXT("stream-overruns", ZIO_RO_PERM,
+		      ZFA_SW_STREAM_OVERRUN, 0),
+	/* Streaming restarts: endless shots over, samples lost meanwhile */
+	ZIO_PARAM_EXT("stream-restarts", ZIO_RO_PERM,
+		      ZFA_SW_STREAM_RESTART, 0),
+	/*
+	 * SVEC sample byte order (no effect on SPEC)
+	 * 0: the driver swaps a 32-bit word at a time
+	 * 1: the driver swaps two 32-bit words at a time
+	 * 2: VME byte order, the blocks are flagged
+	 */
+	ZIO_PARAM_EXT("svec-swap", ZIO_RW_PERM, ZFA_SW_R_NOADDRES_SVEC_SWAP, 0),
+	/* Time spent swapping the samples of the last acquisition */
+	ZIO_PARAM_EXT("svec-swap-ns", ZIO_RO_PERM, ZFA_SW_SVEC_SWAP_NS, 0),
+	ZIO_PARAM_EXT("svec-swap-bytes", ZIO_RO_PERM,
+		      ZFA_SW_SVEC_SWAP_BYTES, 0),
+	/*
+	 * SVEC VME block transfers: address modifier, data width (bits),
+	 * block size (bytes) and backoff between blocks (us). Refused
+	 * modes fall back to simpler ones
+	 */
+	ZIO_PARAM_EXT("svec-vme-am", ZIO_RW_PERM, ZFA_SW_R_NOADDRES_VME_AM, 0),
+	ZIO_PARAM_EXT("svec-vme-am-cur", ZIO_RO_PERM, ZFA_SW_VME_AM_CUR, 0),
+	ZIO_PARAM_EXT("svec-vme-dwidth", ZIO_RW_PERM,
+		      ZFA_SW_R_NOADDRES_VME_DWIDTH, 0),
+	ZIO_PARAM_EXT("svec-vme-block-size", ZIO_RW_PERM,
+		      ZFA_SW_R_NOADDRES_VME_BSIZE, 0),
+	ZIO_PARAM_EXT("svec-vme-backoff", ZIO_RW_PERM,
+		      ZFA_SW_R_NOADDRES_VME_BACKOFF, 0),
+	ZIO_PARAM_EXT("svec-vme-fallbacks", ZIO_RO_PERM,
+		      ZFA_SW_VME_FALLBACK, 0),
+	/* Host decimation filter stages: 1 boxcar average, up to 4 CIC */
+	ZIO_PARAM_EXT("decimation-order", ZIO_RW_PERM,
+		      ZFA_SW_R_NOADDRES_DECIM_ORDER, 1),
+	/*
+	 * Shot statistics in the block control
+	 * 1: enabled
+	 * 0: disabled
+	 */
+	ZIO_PARAM_EXT("shot-stats", ZIO_RW_PERM, ZFA_SW_R_NOADDRES_STATS, 0),
+	/*
+	 * Device group: boards of the same group (1..8, 0 none) start and
+	 * get a software trigger together with group-command
+	 * 1: start
+	 * 2: stop
+	 * 3: software trigger
+	 */
+	ZIO_PARAM_EXT("group", ZIO_RW_PERM, ZFA_SW_R_NOADDRES_GROUP, 0),
+	ZIO_PARAM_EXT("group-command", ZIO_WO_PERM, ZFA_SW_GROUP_CMD, 0),
+	/* trigger time spread (UTC ticks) and write loop duration (ns) */
+	ZIO_PARAM_EXT("group-skew", ZIO_RO_PERM, ZFA_SW_GROUP_SKEW, 0),
+	ZIO_PARAM_EXT("group-fire-ns", ZIO_RO_PERM, ZFA_SW_GROUP_FIRE_NS, 0),
+	/*
+	 * 14-bit packed samples (FA100M14B4C_DALARM_PACKED)
+	 * 1: enabled
+	 * 0: disabled
+	 */
+	ZIO_PARAM_EXT("sample-pack", ZIO_RW_PERM, ZFA_SW_R_NOADDRES_PACK, 0),
 };
 
 #if 0 /* FIXME Unused until TLV control will be available */
@@ -190,6 +291,48 @@ static int zfad_conf_set(struct device *dev, struct zio_attribute *zattr,
 	case ZFA_SW_R_NOADDERS_AUTO:
 		fa->enable_auto_start = usr_val;
 		return 0;
+	case ZFA_SW_R_NOADDRES_DBUF:
+		fa->enable_dbuf = !!usr_val;
+		return 0;
+	case ZFA_SW_R_NOADDRES_DMA_COALESCE:
+		fa->enable_dma_coalesce = !!usr_val;
+		return 0;
+	case ZFA_SW_R_NOADDRES_RING_SIZE:
+		return fa_ring_request_size(fa, (size_t)usr_val * 1024);
+	case ZFA_SW_WORK_CPU:
+		if ((int)usr_val != -1 &&
+		    (usr_val >= nr_cpu_ids || !cpu_online(usr_val)))
+			return -EINVAL;
+		WRITE_ONCE(fa->work_cpu, usr_val);
+		return 0;
+	case ZFA_SW_R_NOADDRES_STREAM_CHUNK:
+		return fa_stream_set_chunk(fa, usr_val);
+	case ZFA_SW_R_NOADDRES_SVEC_SWAP:
+		if (usr_val >= __FA100M14B4C_SWAP_N)
+			return -EINVAL;
+		WRITE_ONCE(fa->svec_swap, usr_val);
+		return 0;
+	case ZFA_SW_R_NOADDRES_STATS:
+		fa->enable_stats = !!usr_val;
+		return 0;
+	case ZFA_SW_R_NOADDRES_GROUP:
+		return fa_group_join(fa, usr_val);
+	case ZFA_SW_GROUP_CMD:
+		return fa_group_command(fa, usr_val);
+	case ZFA_SW_R_NOADDRES_PACK:
+		fa->enable_pack = !!usr_val;
+		return 0;
+	case ZFA_SW_R_NOADDRES_DECIM:
+		return fa_decim_set(fa, usr_val, fa->decim.order);
+	case ZFA_SW_R_NOADDRES_DECIM_ORDER:
+		return fa_decim_set(fa, fa->decim.factor, usr_val);
+	case ZFA_SW_R_NOADDRES_VME_AM:
+	case ZFA_SW_R_NOADDRES_VME_DWIDTH:
+	case ZFA_SW_R_NOADDRES_VME_BSIZE:
+	case ZFA_SW_R_NOADDRES_VME_BACKOFF:
+		if (!fa->carrier_op->conf_set)
+			return -EOPNOTSUPP;
+		return fa->carrier_op->conf_set(fa, zattr->id, usr_val);
 	case ZFA_SW_CH1_OFFSET_ZERO:
 		i--;
 	case ZFA_SW_CH2_OFFSET_ZERO:
@@ -202,7 +345,7 @@ static int zfad_conf_set(struct device *dev, struct zio_attribute *zattr,
 		chan = to_zio_cset(dev)->chan + i;
 		fa->zero_offset[i] = usr_val;
 		err = zfad_apply_offset(chan);
-		if (err == -EIO)
+		if (err)
 			fa->zero_offset[chan->index] = 0;
 		return err;
 	case ZFA_CHx_SAT:
@@ -232,18 +375,22 @@ static int zfad_conf_set(struct device *dev, struct zio_attribute *zattr,
 		chan = to_zio_cset(dev)->chan + i;
 		fa->user_offset[chan->index] = usr_val;
 		err = zfad_apply_offset(chan);
-		if (err == -EIO)
+		if (err)
 			fa->user_offset[chan->index] = 0;
 		return err;
 	case ZFA_CHx_OFFSET:
 		chan = to_zio_chan(dev),
 		fa->user_offset[chan->index] = usr_val;
 		err = zfad_apply_offset(chan);
-		if (err == -EIO)
+		if (err)
 			fa->user_offset[chan->index] = 0;
 		return err;
 	case ZFA_CTL_DAC_CLR_N:
-		zfad_reset_offset(fa);
+		for (i = 0; i < FA100M14B4C_NCHAN; ++i) {
+			fa->user_offset[i] = 0;
+			fa->zero_offset[i] = 0;
+			zfad_apply_offset(&fa->zdev->cset->chan[i]);
+		}
 		return 0;
 	case ZFAT_SR_UNDER:
 		if (usr_val == 0)
@@ -291,17 +438,11 @@ static int zfad_conf_set(struct device *dev, struct zio_attribute *zattr,
 		return zfad_fsm_command(fa, usr_val);
 	case ZFAT_ADC_TST_PATTERN:
 		if (unlikely(fa_enable_test_data_adc)) {
-			usr_val &= 0xFFF;
-			err = zfad_pattern_data_enable(fa, usr_val,
-						       fa_enable_test_data_adc);
-			if (err)
-				dev_warn(fa->msgdev,
-					 "Failed to set the ADC test data. Continue without\n");
-			else if (fa_enable_test_data_adc)
-				dev_info(fa->msgdev,
-					 "the ADC test data (0x%x) is enabled on all channels\n",
-					 usr_val);
-			return err;
+			/* The SPI transfers sleep, zfad_spi_work() runs them */
+			fa->spi.pattern = usr_val & 0xFFF;
+			set_bit(FA_SPI_PEND_PATTERN, &fa->spi.pending);
+			schedule_work(&fa->spi.work);
+			return 0;
 		} else {
 			dev_err(fa->msgdev,
 				"Cannot set the ADC test data. The driver is not in test mode\n");
@@ -309,7 +450,7 @@ static int zfad_conf_set(struct device *dev, struct zio_attribute *zattr,
 		}
 	}
 
-	fa_writel(fa, baseoff, &zfad_regs[reg_index], usr_val);
+	fa_xact_writel(fa, baseoff, &zfad_regs[reg_index], usr_val);
 	return 0;
 }
 
@@ -324,6 +465,7 @@ static int zfad_info_get(struct device *dev, struct zio_attribute *zattr,
 	struct fa_dev *fa = get_zfadc(dev);
 	unsigned int baseoff = fa->fa_adc_csr_base;
 	int i, reg_index;
+	uint32_t tmp;
 
 	i = FA100M14B4C_NCHAN;
 
@@ -349,6 +491,16 @@ static int zfad_info_get(struct device *dev, struct zio_attribute *zattr,
 	case ZFAT_ADC_TST_PATTERN:
 	case ZFA_SW_R_NOADDRES_NBIT:
 	case ZFA_SW_R_NOADDERS_AUTO:
+	case ZFA_SW_R_NOADDRES_DBUF:
+	case ZFA_SW_R_NOADDRES_DMA_COALESCE:
+	case ZFA_SW_R_NOADDRES_RING_SIZE:
+	case ZFA_SW_R_NOADDRES_STREAM_CHUNK:
+	case ZFA_SW_R_NOADDRES_SVEC_SWAP:
+	case ZFA_SW_R_NOADDRES_DECIM:
+	case ZFA_SW_R_NOADDRES_DECIM_ORDER:
+	case ZFA_SW_R_NOADDRES_STATS:
+	case ZFA_SW_R_NOADDRES_GROUP:
+	case ZFA_SW_R_NOADDRES_PACK:
 		/* ZIO automatically return the attribute value */
 		return 0;
 	case ZFA_SW_R_NOADDRES_TEMP:
@@ -369,6 +521,45 @@ static int zfad_info_get(struct device *dev, struct zio_attribute *zattr,
 		i--;
 		*usr_val = fa->zero_offset[i];
 		return 0;
+	case ZFA_SW_DMA_POOL_HIT:
+		*usr_val = fa->n_dma_pool_hit;
+		return 0;
+	case ZFA_SW_DMA_POOL_REBUILD:
+		*usr_val = fa->n_dma_pool_rebuild;
+		return 0;
+	case ZFA_SW_DBUF_OVERRUN:
+		*usr_val = fa->n_dbuf_overrun;
+		return 0;
+	case ZFA_SW_WORK_CPU:
+		*usr_val = fa->work_cpu;
+		return 0;
+	case ZFA_SW_GROUP_SKEW:
+		fa_group_result(fa, usr_val, &tmp);
+		return 0;
+	case ZFA_SW_GROUP_FIRE_NS:
+		fa_group_result(fa, &tmp, usr_val);
+		return 0;
+	case ZFA_SW_STREAM_OVERRUN:
+		*usr_val = fa->stream.n_overrun;
+		return 0;
+	case ZFA_SW_STREAM_RESTART:
+		*usr_val = fa->stream.n_restart;
+		return 0;
+	case ZFA_SW_SVEC_SWAP_NS:
+		*usr_val = min_t(u64, fa->svec_swap_ns, U32_MAX);
+		return 0;
+	case ZFA_SW_SVEC_SWAP_BYTES:
+		*usr_val = fa->svec_swap_bytes;
+		return 0;
+	case ZFA_SW_R_NOADDRES_VME_AM:
+	case ZFA_SW_VME_AM_CUR:
+	case ZFA_SW_R_NOADDRES_VME_DWIDTH:
+	case ZFA_SW_R_NOADDRES_VME_BSIZE:
+	case ZFA_SW_R_NOADDRES_VME_BACKOFF:
+	case ZFA_SW_VME_FALLBACK:
+		if (!fa->carrier_op->info_get)
+			return 0;
+		return fa->carrier_op->info_get(fa, zattr->id, usr_val);
 	case ZFA_CHx_SAT:
 	case ZFA_CHx_CTL_TERM:
 	case ZFA_CHx_CTL_RANGE:
@@ -399,7 +590,11 @@ static inline int zfat_overflow_detection(struct zio_ti *ti)
 	struct fa_dev *fa = ti->cset->zdev->priv_d;
 	struct zio_attribute *ti_zattr = ti->zattr_set.std_zattr;
 	uint32_t nshot_t, nsamples;
-	size_t shot_size;
+	size_t shot_size, max_acq_byte;
+
+	/* Streaming uses the DDR as a circular buffer, a chunk always fits */
+	if (fa_stream_enabled(fa))
+		return 0;
 
 	if (ti->cset->trig != &zfat_type)
 		nshot_t = 1; /* with any other trigger work in one-shot mode */
@@ -412,7 +607,15 @@ static inline int zfat_overflow_detection(struct zio_ti *ti)
 	nsamples = ti_zattr[ZIO_ATTR_TRIG_PRE_SAMP].value +
 		   ti_zattr[ZIO_ATTR_TRIG_POST_SAMP].value;
 	shot_size = ((nsamples + 2) * ti->cset->ssize) * FA100M14B4C_NCHAN;
-	if ( (shot_size * nshot_t) > FA100M14B4C_MAX_ACQ_BYTE ) {
+	/*
+	 * in double buffer mode an acquisition can use only half memory,
+	 * but only when the double buffer actually runs
+	 */
+	if (zfad_dbuf_usable(ti->cset))
+		max_acq_byte = FA100M14B4C_MAX_ACQ_BYTE_DBUF;
+	else
+		max_acq_byte = FA100M14B4C_MAX_ACQ_BYTE;
+	if ( (shot_size * nshot_t) > max_acq_byte ) {
 		dev_err(fa->msgdev, "Cannot acquire, dev memory overflow\n");
 		return -ENOMEM;
 	}
@@ -546,6 +749,11 @@ static int zfad_zio_probe(struct zio_device *zdev)
 	err = device_create_bin_file(&zdev->head.dev, &dev_attr_calibration);
 	if (err)
 		return err;
+	err = device_create_bin_file(&zdev->head.dev, &dev_attr_counters);
+	if (err) {
+		device_remove_bin_file(&zdev->head.dev, &dev_attr_calibration);
+		return err;
+	}
 
 	/* We don't have csets at this point, so don't do anything more */
 	return 0;
@@ -559,6 +767,11 @@ static int zfad_zio_probe(struct zio_device *zdev)
  */
 static int zfad_zio_remove(struct zio_device *zdev)
 {
+	struct fa_dev *fa = zdev->priv_d;
+
+	/* The SPI work uses the channels */
+	cancel_work_sync(&fa->spi.work);
+	device_remove_bin_file(&zdev->head.dev, &dev_attr_counters);
 	device_remove_bin_file(&zdev->head.dev, &dev_attr_calibration);
 
 	return 0;
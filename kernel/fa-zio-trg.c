@@ -10,14 +10,37 @@
 #include <linux/slab.h>
 #include <linux/irq.h>
 #include <linux/interrupt.h>
+#include <linux/ktime.h>
+#include <linux/workqueue.h>
 
 #include "fmc-adc-100m14b4cha.h"
 
+/*
+ * zfat_instance
+ * @reserve: blocks allocated in advance for the next arm
+ * @reserve_n_shots: number of blocks in @reserve
+ * @reserve_size: size of each block in @reserve
+ * @reserve_bi: buffer instance owning the blocks in @reserve
+ * @reserve_lock: it protects the reserve
+ * @reserve_work: it refills the reserve in process context
+ * @arm_latency: time spent in the last arm (ns)
+ * @buf_headroom: shots the buffer holds beyond buffer-acq acquisitions,
+ *                at the last arm (U32_MAX when not checked)
+ */
 struct zfat_instance {
 	struct zio_ti ti;
 	struct fa_dev *fa;
-	unsigned int n_acq_dev;	/* number of acquisitions on device memory */
-	unsigned int n_err;	/* number of errors */
+	/* Block reserve */
+	int enable_reserve;
+	struct zfad_block *reserve;
+	unsigned int reserve_n_shots;
+	unsigned int reserve_size;
+	struct zio_bi *reserve_bi;
+	spinlock_t reserve_lock;
+	struct work_struct reserve_work;
+
+	uint32_t arm_latency;
+	uint32_t buf_headroom;
 };
 
 #define to_zfat_instance(_ti) container_of(_ti, struct zfat_instance, ti)
@@ -96,8 +119,30 @@ static struct zio_attribute zfat_ext_zattr[] = {
 					ZIO_RO_PERM, ZFA_UTC_TRIG_COARSE, 0),
 	[FA100M14B4C_TATTR_TRG_F] = ZIO_PARAM_EXT("tstamp-trg-lst-b",
 					ZIO_RO_PERM, ZFA_UTC_TRIG_FINE, 0),
+
+	/*
+	 * Allocate in advance the blocks for the next arm
+	 * 1: enabled
+	 * 0: disabled
+	 */
+	[FA100M14B4C_TATTR_ARM_RESERVE] = ZIO_PARAM_EXT("arm-reserve",
+					ZIO_RW_PERM, ZFA_SW_ARM_RESERVE, 0),
+	/* time spent to arm the trigger (ns) */
+	[FA100M14B4C_TATTR_ARM_LAT] = ZIO_PARAM_EXT("arm-latency",
+					ZIO_RO_PERM, ZFA_SW_ARM_LATENCY, 0),
+	/*
+	 * Acquisitions the buffer must hold when arming, 0 no check. When
+	 * it is too small the arm fails
+	 */
+	[FA100M14B4C_TATTR_BUF_ACQ] = ZIO_PARAM_EXT("buffer-acq",
+					ZIO_RW_PERM, ZFA_SW_BUF_ACQ, 0),
+	/* shots left in the buffer beyond buffer-acq acquisitions */
+	[FA100M14B4C_TATTR_BUF_HEADROOM] = ZIO_PARAM_EXT("buffer-headroom",
+					ZIO_RO_PERM, ZFA_SW_BUF_HEADROOM, 0),
 };
 
+static void zfat_reserve_drop(struct zfat_instance *zfat);
+
 
 /*
  * zfat_conf_set
@@ -109,7 +154,9 @@ static int zfat_conf_set(struct device *dev, struct zio_attribute *zattr,
 {
 	struct fa_dev *fa = get_zfadc(dev);
 	struct zio_ti *ti = to_zio_ti(dev);
+	struct zfat_instance *zfat = to_zfat_instance(ti);
 	uint32_t tmp_val = usr_val;
+	unsigned long flags;
 
 	switch (zattr->id) {
 	case ZFAT_SHOTS_NB:
@@ -143,6 +190,17 @@ static int zfat_conf_set(struct device *dev, struct zio_attribute *zattr,
 		 * acquisition or other problems:
 		 */
 		break;
+	case ZFA_SW_ARM_RESERVE:
+		spin_lock_irqsave(&zfat->reserve_lock, flags);
+		zfat->enable_reserve = !!usr_val;
+		spin_unlock_irqrestore(&zfat->reserve_lock, flags);
+		if (usr_val)
+			schedule_work(&zfat->reserve_work);
+		else
+			zfat_reserve_drop(zfat);
+		return 0;
+	case ZFA_SW_BUF_ACQ:
+		return 0;
 	case ZFAT_CFG_SRC:
 		/*
 		 * Do not copy to hardware when globally disabled
@@ -155,7 +213,8 @@ static int zfat_conf_set(struct device *dev, struct zio_attribute *zattr,
 		return 0;
 	}
 
-	fa_writel(fa, fa->fa_adc_csr_base, &zfad_regs[zattr->id], tmp_val);
+	fa_xact_writel(fa, fa->fa_adc_csr_base, &zfad_regs[zattr->id],
+		       tmp_val);
 	return 0;
 }
 
@@ -171,11 +230,19 @@ static int zfat_info_get(struct device *dev, struct zio_attribute *zattr,
 
 	switch (zattr->id) {
 	case ZFAT_CFG_SRC:
+	case ZFA_SW_ARM_RESERVE:
+	case ZFA_SW_BUF_ACQ:
 		/*
 		 * The good value for the trigger source is always in
 		 * the ZIO cache.
 		 */
 		return 0;
+	case ZFA_SW_ARM_LATENCY:
+		*usr_val = to_zfat_instance(to_zio_ti(dev))->arm_latency;
+		return 0;
+	case ZFA_SW_BUF_HEADROOM:
+		*usr_val = to_zfat_instance(to_zio_ti(dev))->buf_headroom;
+		return 0;
 	}
 
 	*usr_val = fa_readl(fa, fa->fa_adc_csr_base, &zfad_regs[zattr->id]);
@@ -193,6 +260,73 @@ static const struct zio_sysfs_operations zfat_s_op = {
 };
 
 
+/*
+ * zfat_reserve_drop
+ * @zfat: trigger instance
+ *
+ * Give back to the buffer the reserved blocks
+ */
+static void zfat_reserve_drop(struct zfat_instance *zfat)
+{
+	struct zfad_block *zfad_block;
+	unsigned int n_shots;
+	unsigned long flags;
+
+	spin_lock_irqsave(&zfat->reserve_lock, flags);
+	zfad_block = zfat->reserve;
+	n_shots = zfat->reserve_n_shots;
+	zfat->reserve = NULL;
+	spin_unlock_irqrestore(&zfat->reserve_lock, flags);
+
+	if (zfad_block)
+		zfat_blocks_free(zfat->ti.cset, zfad_block, n_shots);
+}
+
+/*
+ * zfat_reserve_work
+ *
+ * Allocate the blocks for the next arm. We are in process context, so
+ * we can sleep and let the kernel find the memory
+ */
+static void zfat_reserve_work(struct work_struct *work)
+{
+	struct zfat_instance *zfat = container_of(work, struct zfat_instance,
+						  reserve_work);
+	struct zio_ti *ti = &zfat->ti;
+	struct zfad_block *zfad_block;
+	unsigned int n_shots, size;
+	unsigned long flags;
+	bool needed;
+
+	spin_lock_irqsave(&zfat->reserve_lock, flags);
+	needed = zfat->enable_reserve && !zfat->reserve;
+	spin_unlock_irqrestore(&zfat->reserve_lock, flags);
+	if (!needed || zfat->fa->ring.vaddr)
+		return;
+
+	n_shots = zfat->fa->stream.chunk ? 1 :
+		ti->zattr_set.std_zattr[ZIO_ATTR_TRIG_N_SHOTS].value;
+	size = zfat_shot_size(ti);
+	if (!n_shots)
+		return;
+	zfad_block = zfat_blocks_alloc(ti, n_shots, size, GFP_KERNEL);
+	if (!zfad_block)
+		return;
+
+	spin_lock_irqsave(&zfat->reserve_lock, flags);
+	if (zfat->enable_reserve && !zfat->reserve) {
+		zfat->reserve = zfad_block;
+		zfat->reserve_n_shots = n_shots;
+		zfat->reserve_size = size;
+		zfat->reserve_bi = ti->cset->interleave->bi;
+		zfad_block = NULL;
+	}
+	spin_unlock_irqrestore(&zfat->reserve_lock, flags);
+
+	if (zfad_block) /* not needed anymore */
+		zfat_blocks_free(ti->cset, zfad_block, n_shots);
+}
+
 /* create an instance of the FMC-ADC trigger */
 static struct zio_ti *zfat_create(struct zio_trigger_type *trig,
 				 struct zio_cset *cset,
@@ -213,6 +347,8 @@ static struct zio_ti *zfat_create(struct zio_trigger_type *trig,
 
 	zfat->fa = fa;
 	zfat->ti.cset = cset;
+	spin_lock_init(&zfat->reserve_lock);
+	INIT_WORK(&zfat->reserve_work, zfat_reserve_work);
 
 	return &zfat->ti;
 }
@@ -232,6 +368,10 @@ static void zfat_destroy(struct zio_ti *ti)
 	/* Other triggers can handle only 1 shot */
 	fa_writel(fa, fa->fa_adc_csr_base, &zfad_regs[ZFAT_SHOTS_NB], 1);
 
+	zfat->enable_reserve = 0;
+	cancel_work_sync(&zfat->reserve_work);
+	zfat_reserve_drop(zfat);
+
 	kfree(zfat);
 }
 
@@ -247,14 +387,237 @@ static void zfat_change_status(struct zio_ti *ti, unsigned int status)
 	struct fa_dev *fa = ti->cset->zdev->priv_d;
 	uint32_t src = ti->zattr_set.ext_zattr[FA100M14B4C_TATTR_SRC].value;
 
-	if (status)
+	if (status) {
 		fa_writel(fa, fa->fa_adc_csr_base,
 			  &zfad_regs[ZFAT_CFG_SRC], 0);
-	else
+		/* The buffer may change while disabled, release its blocks */
+		zfat_reserve_drop(to_zfat_instance(ti));
+	} else
 		fa_writel(fa, fa->fa_adc_csr_base,
 			  &zfad_regs[ZFAT_CFG_SRC], src);
 }
 
+/*
+ * zfat_blocks_store
+ * @cset: channels set
+ * @zfad_block: vector of blocks to store
+ * @n_shots: number of blocks in the vector
+ * @n_fires: number of blocks filled by a trigger fire
+ *
+ * Store all filled blocks into the buffer and free the un-filled ones.
+ * The zfad_block vector itself is released.
+ */
+void zfat_blocks_store(struct zio_cset *cset, struct zfad_block *zfad_block,
+		       unsigned int n_shots, unsigned int n_fires)
+{
+	struct zio_bi *bi = cset->interleave->bi;
+	struct fa_dev *fa = cset->zdev->priv_d;
+	unsigned int i, n_filled = min(n_fires, n_shots), n_lost = 0;
+
+	if (n_fires < n_shots)
+		fa_count_add(fa, FA100M14B4C_CNT_SHOT_UNFILLED,
+			     n_shots - n_fires);
+	if (zfad_block[0].ring) {
+		fa_count_add(fa, FA100M14B4C_CNT_SHOT_STORED, n_filled);
+		fa_ring_blocks_store(cset, zfad_block, n_shots, n_fires);
+		return;
+	}
+
+	for (i = 0; i < n_shots; ++i)
+		if (likely(i < n_fires)) {/* Store filled blocks */
+			dev_dbg(fa->msgdev, "Store Block %i/%i\n",
+				i + 1, n_shots);
+			if (likely(!zio_buffer_store_block(bi,
+							   zfad_block[i].block)))
+				continue;
+			/* The buffer is full: the block is lost */
+			zio_buffer_free_block(bi, zfad_block[i].block);
+			n_lost++;
+		} else {	/* Free un-filled blocks */
+			dev_dbg(fa->msgdev, "Free un-acquired block %d/%d "
+					"(received %d shots)\n",
+					i + 1, n_shots, n_fires);
+			zio_buffer_free_block(bi, zfad_block[i].block);
+		}
+	kfree(zfad_block);
+
+	fa_count_add(fa, FA100M14B4C_CNT_SHOT_STORED, n_filled - n_lost);
+	if (unlikely(n_lost)) {
+		fa_count_add(fa, FA100M14B4C_CNT_SHOT_LOST, n_lost);
+		cset->interleave->current_ctrl->zio_alarms |=
+			ZIO_ALARM_LOST_BLOCK;
+		dev_warn_ratelimited(fa->msgdev,
+				     "buffer full, %u/%u blocks lost\n",
+				     n_lost, n_filled);
+	}
+}
+
+/*
+ * zfat_blocks_free
+ * @cset: channels set
+ * @zfad_block: vector of blocks to free
+ * @n_shots: number of blocks in the vector
+ *
+ * Give back to the buffer all the blocks and release the zfad_block vector
+ */
+void zfat_blocks_free(struct zio_cset *cset, struct zfad_block *zfad_block,
+		      unsigned int n_shots)
+{
+	struct zio_bi *bi = cset->interleave->bi;
+	unsigned int i;
+
+	if (zfad_block[0].ring) {
+		fa_ring_blocks_free(cset, zfad_block, n_shots);
+		return;
+	}
+
+	for (i = 0; i < n_shots; ++i)
+		zio_buffer_free_block(bi, zfad_block[i].block);
+	kfree(zfad_block);
+}
+
+/*
+ * zfat_shot_size
+ * @ti: trigger instance
+ *
+ * Calculate the required size to store all channels.  This is
+ * an interleaved acquisition, so nsamples represents the
+ * number of sample on all channels (n_chan * chan_samples)
+ * Trig time stamp are appended after the post samples
+ * (4*32bits word) size should be 32bits word aligned
+ * ti->nsamples is the sum of (pre-samp+ post-samp)*4chan
+ * because it's the interleave channel.
+ */
+unsigned int zfat_shot_size(struct zio_ti *ti)
+{
+	struct zio_channel *interleave = ti->cset->interleave;
+	struct fa_dev *fa = ti->cset->zdev->priv_d;
+	unsigned int size;
+
+	/* Streaming blocks are a chunk of samples, without time-tag */
+	if (fa->stream.chunk)
+		return interleave->current_ctrl->ssize * fa->stream.chunk;
+
+	size = (interleave->current_ctrl->ssize * ti->nsamples)
+		+ FA_TRIG_TIMETAG_BYTES;
+	/* check if size is 32 bits word aligned: should be always the case */
+	if (size % 4) {
+		/* should never happen: increase the size accordling */
+		dev_warn(fa->msgdev,
+			"\nzio data block size should 32bit word aligned."
+			"original size:%d was increased by %d bytes\n",
+			size, size%4);
+		size += size % 4;
+	}
+	return size;
+}
+
+/*
+ * zfat_blocks_alloc
+ * @ti: trigger instance
+ * @n_shots: number of shots to acquire
+ * @size: size of a single shot (zfat_shot_size())
+ * @gfp: allocation flags
+ *
+ * Allocate a zfad_block vector and a ZIO block for each shot. The control
+ * of each block is set on arm (zfat_blocks_get())
+ */
+struct zfad_block *zfat_blocks_alloc(struct zio_ti *ti, unsigned int n_shots,
+				     unsigned int size, gfp_t gfp)
+{
+	struct zio_channel *interleave = ti->cset->interleave;
+	struct fa_dev *fa = ti->cset->zdev->priv_d;
+	struct zfad_block *zfad_block;
+	struct zio_block *block;
+	uint32_t dev_mem_off = 0;
+	int i;
+
+	zfad_block = kmalloc(sizeof(struct zfad_block) * n_shots, gfp);
+	if (!zfad_block)
+		return NULL;
+
+	for (i = 0; i < n_shots; ++i) {
+		dev_dbg(fa->msgdev, "Allocating block %d ...\n", i);
+		block = zio_buffer_alloc_block(interleave->bi, size, gfp);
+		if (!block) {
+			dev_err(fa->msgdev,
+				"\narm trigger fail, cannot allocate block\n");
+			goto out_allocate;
+		}
+		/* Add to the vector of prepared blocks */
+		zfad_block[i].block = block;
+		zfad_block[i].ring = false;
+		zfad_block[i].dev_mem_off = dev_mem_off;
+		dev_mem_off += size;
+		dev_dbg(fa->msgdev, "next dev_mem_off 0x%x (+%d)\n",
+			dev_mem_off, size);
+	}
+
+	return zfad_block;
+
+out_allocate:
+	while ((--i) >= 0)
+		zio_buffer_free_block(interleave->bi, zfad_block[i].block);
+	kfree(zfad_block);
+	return NULL;
+}
+
+/*
+ * zfat_blocks_get
+ * @ti: trigger instance
+ * @n_shots: number of shots to acquire
+ * @size: size of a single shot (zfat_shot_size())
+ *
+ * Get the blocks for an acquisition: from the reserve when it matches the
+ * acquisition geometry, otherwise allocate them. Sometimes we are in an
+ * atomic context and we cannot use in_atomic(), so allocations are atomic.
+ *
+ * Every block gets a full copy of the current control, also when it comes
+ * from the reserve: the attributes may change between the reservation and
+ * the arm, so a control copied in advance could be stale. The time-stamp
+ * and the sequence number are then set on DMA_DONE
+ */
+struct zfad_block *zfat_blocks_get(struct zio_ti *ti, unsigned int n_shots,
+				   unsigned int size)
+{
+	struct zfat_instance *zfat = to_zfat_instance(ti);
+	struct zio_channel *interleave = ti->cset->interleave;
+	struct zfad_block *zfad_block = NULL;
+	size_t ctrl_size = zio_control_size(interleave);
+	unsigned long flags;
+	int i;
+
+	/* The memory mapped ring replaces the ZIO buffer */
+	if (zfat->fa->ring.vaddr)
+		return fa_ring_blocks_get(ti->cset, n_shots, size);
+
+	spin_lock_irqsave(&zfat->reserve_lock, flags);
+	if (zfat->reserve && zfat->reserve_n_shots == n_shots &&
+	    zfat->reserve_size == size && zfat->reserve_bi == interleave->bi) {
+		zfad_block = zfat->reserve;
+		zfat->reserve = NULL;
+	}
+	spin_unlock_irqrestore(&zfat->reserve_lock, flags);
+
+	if (!zfad_block) {
+		/* The acquisition geometry changed, the reserve is useless */
+		zfat_reserve_drop(zfat);
+		zfad_block = zfat_blocks_alloc(ti, n_shots, size, GFP_ATOMIC);
+		if (!zfad_block)
+			return NULL;
+	}
+
+	for (i = 0; i < n_shots; ++i)
+		memcpy(zio_get_ctrl(zfad_block[i].block),
+		       interleave->current_ctrl, ctrl_size);
+
+	/* Prepare the blocks for the next arm */
+	if (zfat->enable_reserve)
+		schedule_work(&zfat->reserve_work);
+
+	return zfad_block;
+}
+
 /*
  * zfat_data_done
  * @cset: channels set
@@ -268,9 +631,7 @@ static void zfat_change_status(struct zio_ti *ti, unsigned int status)
 static int zfat_data_done(struct zio_cset *cset)
 {
 	struct zfad_block *zfad_block = cset->interleave->priv_d;
-	struct zio_bi *bi = cset->interleave->bi;
 	struct fa_dev *fa = cset->zdev->priv_d;
-	unsigned int i;
 
 	dev_dbg(fa->msgdev, "Data done\n");
 
@@ -279,26 +640,86 @@ static int zfat_data_done(struct zio_cset *cset)
 		return 0;
 
 	/* Store blocks */
-	for (i = 0; i < fa->n_shots; ++i)
-		if (likely(i < fa->n_fires)) {/* Store filled blocks */
-			dev_dbg(fa->msgdev, "Store Block %i/%i\n",
-				i + 1, fa->n_shots);
-			zio_buffer_store_block(bi, zfad_block[i].block);
-		} else {	/* Free un-filled blocks */
-			dev_dbg(fa->msgdev, "Free un-acquired block %d/%d "
-					"(received %d shots)\n",
-					i + 1, fa->n_shots, fa->n_fires);
-			zio_buffer_free_block(bi, zfad_block[i].block);
-		}
+	zfat_blocks_store(cset, zfad_block, fa->n_shots, fa->n_fires);
 	/* Clear active block */
 	fa->n_shots = 0;
 	fa->n_fires = 0;
-	kfree(zfad_block);
 	cset->interleave->priv_d = NULL;
 
 	return 0;
 }
 
+/*
+ * zfat_buffer_check
+ * @ti: trigger instance
+ * @n_shots: number of blocks of an acquisition
+ * @size: size of a block
+ *
+ * The buffer must hold buffer-acq acquisitions, otherwise the blocks that
+ * do not fit are lost when the DMA is over. The buffer cannot be resized
+ * here, we may be in an atomic context: the arm fails and it tells the
+ * size needed. It records the headroom
+ */
+static int zfat_buffer_check(struct zio_ti *ti, unsigned int n_shots,
+			     unsigned int size)
+{
+	struct zfat_instance *zfat = to_zfat_instance(ti);
+	struct zio_attribute *ext = ti->zattr_set.ext_zattr;
+	struct zio_bi *bi = ti->cset->interleave->bi;
+	struct zio_attribute *std = bi->zattr_set.std_zattr;
+	struct fa_dev *fa = zfat->fa;
+	uint32_t n_acq = ext[FA100M14B4C_TATTR_BUF_ACQ].value;
+	const char *name = bi->b->head.name;
+	uint64_t need, cap;
+
+	zfat->buf_headroom = U32_MAX;
+	/* The memory mapped ring has its own flow control */
+	if (!n_acq || fa->ring.vaddr || !std)
+		return 0;
+
+	need = (uint64_t)n_acq * n_shots;
+	if (bi->b == &fa_zbuf_type) {
+		/* A block takes a chunk of the pool, reserved blocks too */
+		if (zfat->enable_reserve)
+			need += n_shots;
+		cap = fa_zbuf_capacity(bi, size);
+		if (cap < need) {
+			dev_err(fa->msgdev,
+				"Cannot arm: the %s buffer needs %llu chunks of at least %u bytes (chunk-kb, max-buffer-kb), it has %llu\n",
+				name, need, size, cap);
+			return -ENOSPC;
+		}
+	} else if (!strcmp(name, "kmalloc")) {
+		/* max-buffer-len counts blocks */
+		cap = std[ZIO_ATTR_ZBUF_MAXLEN].value;
+		if (cap < need) {
+			dev_err(fa->msgdev,
+				"Cannot arm: the %s buffer needs max-buffer-len %llu, it is %llu\n",
+				name, need, cap);
+			return -ENOSPC;
+		}
+	} else if (!strcmp(name, "vmalloc")) {
+		/* The reserved blocks are in the buffer memory too */
+		if (zfat->enable_reserve)
+			need += n_shots;
+		cap = div_u64((uint64_t)std[ZIO_ATTR_ZBUF_MAXKB].value * 1024,
+			      size);
+		if (cap < need) {
+			dev_err(fa->msgdev,
+				"Cannot arm: the %s buffer needs max-buffer-kb %llu, it is %u\n",
+				name, div_u64(need * size + 1023, 1024),
+				std[ZIO_ATTR_ZBUF_MAXKB].value);
+			return -ENOSPC;
+		}
+	} else {
+		return 0; /* unknown buffer type */
+	}
+
+	zfat->buf_headroom = min_t(uint64_t, cap - need, U32_MAX);
+
+	return 0;
+}
+
 /*
  * zfat_arm_trigger
  * @ti: trigger instance
@@ -310,95 +731,77 @@ static int zfat_arm_trigger(struct zio_ti *ti)
 {
 	struct zio_channel *interleave = ti->cset->interleave;
 	struct fa_dev *fa = ti->cset->zdev->priv_d;
-	struct zio_block *block;
+	struct zfat_instance *zfat = to_zfat_instance(ti);
 	struct zfad_block *zfad_block;
 	unsigned int size;
-	uint32_t dev_mem_off, trg_src;
-	int i, err = 0;
+	uint32_t trg_src;
+	ktime_t start;
+	int err = 0;
 
 	dev_dbg(fa->msgdev, "Arming trigger\n");
+	start = ktime_get();
 
 	/* Update the current control: sequence, nsamples and tstamp */
 	interleave->current_ctrl->nsamples = ti->nsamples;
 
 	/* Allocate the necessary blocks for multi-shot acquisition */
 	fa->n_shots = ti->zattr_set.std_zattr[ZIO_ATTR_TRIG_N_SHOTS].value;
+	if (fa->stream.chunk) {
+		/* Streaming: one block per chunk */
+		interleave->current_ctrl->nsamples = fa->stream.chunk;
+		fa->n_shots = 1;
+	}
 	dev_dbg(fa->msgdev, "programmed shot %i\n", fa->n_shots);
 
 	if (!fa->n_shots) {
 		dev_info(fa->msgdev, "Cannot arm. No programmed shots\n");
-		return -EINVAL;
+		err = -EINVAL;
+		goto out_fail;
 	}
 
-	/*
-	 * Allocate a new block for DMA transfer. Sometimes we are in an
-	 * atomic context and we cannot use in_atomic()
-	 */
-	zfad_block = kmalloc(sizeof(struct zfad_block) * fa->n_shots,
-			     GFP_ATOMIC);
-	if (!zfad_block)
-		return -ENOMEM;
-
+	size = zfat_shot_size(ti);
+	err = zfat_buffer_check(ti, fa->n_shots, size);
+	if (err)
+		goto out_fail;
+	zfad_block = zfat_blocks_get(ti, fa->n_shots, size);
+	if (!zfad_block) {
+		err = -ENOMEM;
+		goto out_fail;
+	}
 	interleave->priv_d = zfad_block;
 
-	/*
-	 * Calculate the required size to store all channels.  This is
-	 * an interleaved acquisition, so nsamples represents the
-	 * number of sample on all channels (n_chan * chan_samples)
-	 * Trig time stamp are appended after the post samples
-	 * (4*32bits word) size should be 32bits word aligned
-	 * ti->nsamples is the sum of (pre-samp+ post-samp)*4chan
-	 * because it's the interleave channel.
-	 */
-	size = (interleave->current_ctrl->ssize * ti->nsamples)
-		+ FA_TRIG_TIMETAG_BYTES;
-	/* check if size is 32 bits word aligned: should be always the case */
-	if (size % 4) {
-		/* should never happen: increase the size accordling */
-		dev_warn(fa->msgdev,
-			"\nzio data block size should 32bit word aligned."
-			"original size:%d was increased by %d bytes\n",
-			size, size%4);
-		size += size % 4;
-	}
-	dev_mem_off = 0;
-	/* Allocate ZIO blocks */
-	for (i = 0; i < fa->n_shots; ++i) {
-		dev_dbg(fa->msgdev, "Allocating block %d ...\n", i);
-		block = zio_buffer_alloc_block(interleave->bi, size,
-					       GFP_ATOMIC);
-		if (!block) {
+	/* Let the carrier prepare the DMA for this acquisition geometry */
+	if (fa->carrier_op->dma_prepare) {
+		err = fa->carrier_op->dma_prepare(ti->cset, fa->n_shots, size);
+		if (err) {
 			dev_err(fa->msgdev,
-				"\narm trigger fail, cannot allocate block\n");
-			err = -ENOMEM;
-			goto out_allocate;
+				"arm trigger fail, cannot prepare DMA\n");
+			goto out_prepare;
 		}
-		/* Copy the updated control into the block */
-		memcpy(zio_get_ctrl(block), interleave->current_ctrl,
-		       zio_control_size(interleave));
-		/* Add to the vector of prepared blocks */
-		zfad_block[i].block = block;
-		zfad_block[i].dev_mem_off = dev_mem_off;
-		dev_mem_off += size;
-		dev_dbg(fa->msgdev, "next dev_mem_off 0x%x (+%d)\n",
-			dev_mem_off, size);
 	}
 
 	err = ti->cset->raw_io(ti->cset);
 	if (err != -EAGAIN && err != 0)
-		goto out_allocate;
+		goto out_prepare;
 
 	/* Everything looks fine for the time being, enable the trigger sources */
 	trg_src = ti->zattr_set.ext_zattr[FA100M14B4C_TATTR_SRC].value;
 	fa_writel(fa, fa->fa_adc_csr_base, &zfad_regs[ZFAT_CFG_SRC], trg_src);
 
+	zfat->arm_latency = min_t(s64, ktime_to_ns(ktime_sub(ktime_get(), start)),
+				  U32_MAX);
+	fa_count_add(fa, FA100M14B4C_CNT_ACQ_START, 1);
+
 	return err;
 
-out_allocate:
-	while ((--i) >= 0)
-		zio_buffer_free_block(interleave->bi, zfad_block[i].block);
-	kfree(zfad_block);
+out_prepare:
+	zfat_blocks_free(ti->cset, zfad_block, fa->n_shots);
 	interleave->priv_d = NULL;
+out_fail:
+	/* A failed arm takes time too, in particular a failed allocation */
+	zfat->arm_latency = min_t(s64, ktime_to_ns(ktime_sub(ktime_get(), start)),
+				  U32_MAX);
+	fa_count_add(fa, FA100M14B4C_CNT_ARM_FAIL, 1);
 	return err;
 }
 
@@ -413,9 +816,7 @@ static void zfat_abort(struct zio_ti *ti)
 {
 	struct zio_cset *cset = ti->cset;
 	struct fa_dev *fa = cset->zdev->priv_d;
-	struct zio_bi *bi = cset->interleave->bi;
 	struct zfad_block *zfad_block = cset->interleave->priv_d;
-	unsigned int i;
 
 	dev_dbg(fa->msgdev, "Aborting trigger\n");
 
@@ -424,9 +825,7 @@ static void zfat_abort(struct zio_ti *ti)
 		return;
 
 	/* Free all blocks */
-	for (i = 0; i < fa->n_shots; ++i)
-		zio_buffer_free_block(bi, zfad_block[i].block);
-	kfree(zfad_block);
+	zfat_blocks_free(cset, zfad_block, fa->n_shots);
 	cset->interleave->priv_d = NULL;
 }
 
@@ -17,6 +17,8 @@ struct zfa_field_desc {
 	unsigned long offset; /* related to its component base */
 	uint32_t mask; /* bit mask a register field */
 	int is_bitfield; /* whether it maps  full register or a field */
+	unsigned int shadow; /* register shadow slot, 0 when volatile */
+	int is_strobe; /* self-clearing field, never kept in the shadow */
 };
 
 #endif /* _FIELD_DESC_H_ */
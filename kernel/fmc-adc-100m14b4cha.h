@@ -71,6 +71,10 @@ enum fa100m14b4c_trg_ext_attr {
 	FA100M14B4C_TATTR_TRG_S,
 	FA100M14B4C_TATTR_TRG_C,
 	FA100M14B4C_TATTR_TRG_F,
+	FA100M14B4C_TATTR_ARM_RESERVE,
+	FA100M14B4C_TATTR_ARM_LAT,
+	FA100M14B4C_TATTR_BUF_ACQ,
+	FA100M14B4C_TATTR_BUF_HEADROOM,
 #endif
 };
 
@@ -88,10 +92,18 @@ enum fa100m14b4c_dev_ext_attr {
 	FA100M14B4C_DATTR_CH1_OFFSET,
 	FA100M14B4C_DATTR_CH2_OFFSET,
 	FA100M14B4C_DATTR_CH3_OFFSET,
+	FA100M14B4C_DATTR_CH0_OFFSET_ZERO,
+	FA100M14B4C_DATTR_CH1_OFFSET_ZERO,
+	FA100M14B4C_DATTR_CH2_OFFSET_ZERO,
+	FA100M14B4C_DATTR_CH3_OFFSET_ZERO,
 	FA100M14B4C_DATTR_CH0_VREF,
 	FA100M14B4C_DATTR_CH1_VREF,
 	FA100M14B4C_DATTR_CH2_VREF,
 	FA100M14B4C_DATTR_CH3_VREF,
+	FA100M14B4C_DATTR_CH0_SAT,
+	FA100M14B4C_DATTR_CH1_SAT,
+	FA100M14B4C_DATTR_CH2_SAT,
+	FA100M14B4C_DATTR_CH3_SAT,
 	FA100M14B4C_DATTR_CH0_50TERM,
 	FA100M14B4C_DATTR_CH1_50TERM,
 	FA100M14B4C_DATTR_CH2_50TERM,
@@ -99,6 +111,9 @@ enum fa100m14b4c_dev_ext_attr {
 	FA100M14B4C_DATTR_ACQ_START_S,
 	FA100M14B4C_DATTR_ACQ_START_C,
 	FA100M14B4C_DATTR_ACQ_START_F,
+	FA100M14B4C_DATTR_BASE_S,
+	FA100M14B4C_DATTR_BASE_C,
+	FA100M14B4C_DATTR_DECIMATION,
 };
 
 #define FA100M14B4C_UTC_CLOCK_FREQ 125000000
@@ -108,6 +123,155 @@ enum fa100m14b4c_dev_ext_attr {
 
 /* ADC DDR memory */
 #define FA100M14B4C_MAX_ACQ_BYTE 0x10000000 /* 256MB */
+/* In double buffer mode the DDR is split in two regions */
+#define FA100M14B4C_MAX_ACQ_BYTE_DBUF (FA100M14B4C_MAX_ACQ_BYTE / 2)
+
+/*
+ * Driver alarms (zio_control drv_alarms)
+ * @FA100M14B4C_DALARM_DBUF_OVERRUN: in double buffer mode the following
+ *                                   acquisition wrote over the region of
+ *                                   this block before its DMA transfer
+ *                                   was over. Data may be corrupted.
+ */
+#define FA100M14B4C_DALARM_DBUF_OVERRUN BIT(0)
+/*
+ * @FA100M14B4C_DALARM_STREAM_OVERRUN: in streaming mode the samples
+ *                                     between the previous block and
+ *                                     this one were lost, overwritten
+ *                                     in DDR before the transfer
+ */
+#define FA100M14B4C_DALARM_STREAM_OVERRUN BIT(1)
+/*
+ * @FA100M14B4C_DALARM_SWAP: not an error. The samples are in VME byte
+ *                           order (SVEC, svec-swap set to
+ *                           FA100M14B4C_SWAP_NONE): every 32-bit word
+ *                           of the block must be byte swapped
+ */
+#define FA100M14B4C_DALARM_SWAP BIT(2)
+/*
+ * @FA100M14B4C_DALARM_PACKED: not an error. The samples are packed
+ *                             (sample-pack): each sampling instant takes
+ *                             FA100M14B4C_PACK_FRAME_BYTES, a little
+ *                             endian word with channel N in bits
+ *                             14N..14N+13. The block is
+ *                             nsamples * FA100M14B4C_PACK_FRAME_BYTES long
+ */
+#define FA100M14B4C_DALARM_PACKED BIT(3)
+#define FA100M14B4C_PACK_FRAME_BYTES 7
+/*
+ * @FA100M14B4C_DALARM_STREAM_RESTART: in streaming mode this block is the
+ *                                     first of a new endless shot: the
+ *                                     samples during the restart and the
+ *                                     incomplete last block of the
+ *                                     previous shot were lost
+ */
+#define FA100M14B4C_DALARM_STREAM_RESTART BIT(4)
+
+/*
+ * Shot statistics (shot-stats enabled). They are in the trigger extended
+ * values of the block control (attr_trigger.ext_val), after the trigger
+ * attributes. Their bits in attr_trigger.ext_mask are set only when the
+ * block carries them. For each channel (0..3):
+ * @FA100M14B4C_TSTAT_MINMAX: minimum (bits 0..15) and maximum (bits
+ *                            16..31), signed ADC codes
+ * @FA100M14B4C_TSTAT_MEANRMS: mean (bits 0..15, signed) and RMS (bits
+ *                             16..31, unsigned), ADC codes
+ * @FA100M14B4C_TSTAT_SAT: number of samples at the saturation value
+ */
+#define FA100M14B4C_TSTAT_FIRST (FA100M14B4C_TATTR_CH4_DLY + 1)
+#define FA100M14B4C_TSTAT_MINMAX(ch) (FA100M14B4C_TSTAT_FIRST + (ch) * 3)
+#define FA100M14B4C_TSTAT_MEANRMS(ch) (FA100M14B4C_TSTAT_MINMAX(ch) + 1)
+#define FA100M14B4C_TSTAT_SAT(ch) (FA100M14B4C_TSTAT_MINMAX(ch) + 2)
+#define FA100M14B4C_TSTAT_N (3 * FA100M14B4C_NCHAN)
+
+/*
+ * SVEC sample byte order (svec-swap). VME is big endian, the samples
+ * must be swapped on little endian hosts
+ * @FA100M14B4C_SWAP_SCALAR: the driver swaps a 32-bit word at a time
+ * @FA100M14B4C_SWAP_WORD64: the driver swaps two 32-bit words at a time
+ * @FA100M14B4C_SWAP_NONE: the driver leaves the samples in VME byte
+ *                         order and it flags the block; user space swaps
+ *                         them, if it needs to
+ */
+enum fa100m14b4c_swap {
+	FA100M14B4C_SWAP_SCALAR = 0,
+	FA100M14B4C_SWAP_WORD64,
+	FA100M14B4C_SWAP_NONE,
+	__FA100M14B4C_SWAP_N,
+};
+
+/*
+ * Memory mapped ring
+ * The ring char device maps a header page followed by n_slots slots. Each
+ * slot contains the zio_control of a shot (ctrl_size bytes) followed by
+ * its interleaved samples. The driver writes a slot and then it moves
+ * head forward; the application consumes slots and moves tail forward.
+ * Both indexes are free running 32-bit values and n_slots is a power of
+ * two: the slot of index i is at data_offset + (i % n_slots) * slot_size,
+ * also when the indexes wrap. A slot is complete when its
+ * control nsamples is not 0. The driver keeps its own copy of all
+ * the fields: it only reads tail, and it ignores a tail that is not
+ * between head - n_slots and head.
+ *
+ * @magic: FA100M14B4C_RING_MAGIC
+ * @version: FA100M14B4C_RING_VERSION
+ * @n_slots: number of slots (a power of two), it changes with the
+ *           acquisition geometry
+ * @slot_size: size of a slot (bytes)
+ * @ctrl_size: offset of the samples within a slot (bytes)
+ * @data_offset: offset of the first slot from the header (bytes)
+ * @head: producer index (written by the driver)
+ * @tail: consumer index (written by the application)
+ * @n_overrun: number of acquisitions refused because the ring was full
+ */
+#define FA100M14B4C_RING_MAGIC 0xADC0F1F0
+#define FA100M14B4C_RING_VERSION 1
+struct fa100m14b4c_ring_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t n_slots;
+	uint32_t slot_size;
+	uint32_t ctrl_size;
+	uint32_t data_offset;
+	uint32_t head;
+	uint32_t tail;
+	uint32_t n_overrun;
+};
+
+/*
+ * Trigger time-tag of a shot. The "timetags" binary attribute is a ring
+ * of FA100M14B4C_TIMETAG_N of them, overwritten in order
+ * @index: running number of the recorded shots, from 1 (0: empty entry)
+ * @seq_num: sequence number of the shot block
+ * @secs: trigger time (seconds)
+ * @ticks: trigger time (ticks of FA100M14B4C_UTC_CLOCK_NS)
+ * @source: trigger sources that fired (FA100M14B4C_TATTR_STA)
+ */
+#define FA100M14B4C_TIMETAG_N 4096
+struct fa100m14b4c_timetag {
+	uint32_t index;
+	uint32_t seq_num;
+	uint64_t secs;
+	uint32_t ticks;
+	uint32_t source;
+};
+
+/*
+ * Acquisition counters, since the driver was loaded. The "counters"
+ * binary attribute is an array of __FA100M14B4C_CNT_N uint64_t, in this
+ * order
+ */
+enum fa100m14b4c_counter {
+	FA100M14B4C_CNT_ACQ_START = 0,	/* acquisitions started (armed) */
+	FA100M14B4C_CNT_SHOT_STORED,	/* shots stored in the buffer */
+	FA100M14B4C_CNT_SHOT_UNFILLED,	/* shots freed without a trigger */
+	FA100M14B4C_CNT_DMA_BYTES,	/* bytes transferred by the DMA */
+	FA100M14B4C_CNT_DMA_ERR,	/* DMA errors */
+	FA100M14B4C_CNT_ARM_FAIL,	/* trigger arm failures */
+	FA100M14B4C_CNT_IRQ_SEQ_ERR,	/* interrupts out of sequence */
+	FA100M14B4C_CNT_SHOT_LOST,	/* shots lost, buffer full */
+	__FA100M14B4C_CNT_N,
+};
 
 enum fa100m14b4c_input_range {
 	FA100M14B4C_RANGE_10V = 0x0,
@@ -124,6 +288,18 @@ enum fa100m14b4c_fsm_cmd {
 	FA100M14B4C_CMD_START =	0x1,
 	FA100M14B4C_CMD_STOP =	0x2,
 };
+
+/*
+ * Device group commands (group-command). START and STOP act like the
+ * state machine commands, on all the boards of the group
+ */
+#define FA100M14B4C_GROUP_N 8 /* groups 1..N, 0 is no group */
+#define FA100M14B4C_GROUP_MEMBERS 16
+enum fa100m14b4c_group_cmd {
+	FA100M14B4C_GROUP_START = FA100M14B4C_CMD_START,
+	FA100M14B4C_GROUP_STOP = FA100M14B4C_CMD_STOP,
+	FA100M14B4C_GROUP_SW_TRIGGER,
+};
 /* All possible state of the state machine, other values are invalid*/
 enum fa100m14b4c_fsm_state {
 	FA100M14B4C_STATE_IDLE = 0x1,
@@ -148,8 +324,15 @@ struct fa_calib {
 #ifdef __KERNEL__ /* All the rest is only of kernel users */
 #include <linux/dma-mapping.h>
 #include <linux/scatterlist.h>
+#include <linux/bitmap.h>
 #include <linux/workqueue.h>
 #include <linux/debugfs.h>
+#include <linux/completion.h>
+#include <linux/miscdevice.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/version.h>
 
 #include <linux/fmc.h>
 #include <linux/fmc-sdb.h>
@@ -161,6 +344,14 @@ struct fa_calib {
 
 #include "field-desc.h"
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,17,0)
+/* Monotonic time in nano-seconds, added in 3.17 */
+static inline u64 ktime_get_ns(void)
+{
+	return ktime_to_ns(ktime_get());
+}
+#endif
+
 extern int fa_enable_test_data_adc;
 
 /*
@@ -327,18 +518,104 @@ enum fa_sw_param_id {
 	ZFA_SW_CH2_OFFSET_ZERO,
 	ZFA_SW_CH3_OFFSET_ZERO,
 	ZFA_SW_CH4_OFFSET_ZERO,
+	ZFA_SW_DMA_POOL_HIT,
+	ZFA_SW_DMA_POOL_REBUILD,
+	ZFA_SW_R_NOADDRES_DBUF,
+	ZFA_SW_DBUF_OVERRUN,
+	ZFA_SW_ARM_RESERVE,
+	ZFA_SW_ARM_LATENCY,
+	ZFA_SW_BUF_ACQ,
+	ZFA_SW_BUF_HEADROOM,
+	ZFA_SW_R_NOADDRES_DMA_COALESCE,
+	ZFA_SW_R_NOADDRES_RING_SIZE,
+	ZFA_SW_WORK_CPU,
+	ZFA_SW_R_NOADDRES_STREAM_CHUNK,
+	ZFA_SW_STREAM_OVERRUN,
+	ZFA_SW_STREAM_RESTART,
+	ZFA_SW_R_NOADDRES_SVEC_SWAP,
+	ZFA_SW_SVEC_SWAP_NS,
+	ZFA_SW_SVEC_SWAP_BYTES,
+	ZFA_SW_R_NOADDRES_VME_AM,
+	ZFA_SW_VME_AM_CUR,
+	ZFA_SW_R_NOADDRES_VME_DWIDTH,
+	ZFA_SW_R_NOADDRES_VME_BSIZE,
+	ZFA_SW_R_NOADDRES_VME_BACKOFF,
+	ZFA_SW_VME_FALLBACK,
+	ZFA_SW_R_NOADDRES_DECIM,
+	ZFA_SW_R_NOADDRES_DECIM_ORDER,
+	ZFA_SW_R_NOADDRES_STATS,
+	ZFA_SW_R_NOADDRES_GROUP,
+	ZFA_SW_GROUP_CMD,
+	ZFA_SW_GROUP_SKEW,
+	ZFA_SW_GROUP_FIRE_NS,
+	ZFA_SW_R_NOADDRES_PACK,
 	ZFA_SW_PARAM_COMMON_LAST,
 };
 
+/*
+ * Register shadow slots (zfa_field_desc shadow). The driver keeps a copy
+ * of the registers that only it changes, so reading them or writing one
+ * of their fields does not need a bus access. Slot 0 is for volatile
+ * registers (status, counters, time stamps): they are always accessed
+ */
+enum fa_shadow_slot {
+	FA_SHADOW_NONE = 0,
+	FA_SHADOW_CTL,
+	FA_SHADOW_TRG_SRC,
+	FA_SHADOW_TRG_POL,
+	FA_SHADOW_TRG_DLY,
+	FA_SHADOW_SHOTS_NB,
+	FA_SHADOW_SR_UNDER,
+	FA_SHADOW_PRE,
+	FA_SHADOW_POST,
+	FA_SHADOW_CH1_CTL,
+	FA_SHADOW_CH1_GAIN,
+	FA_SHADOW_CH1_OFFSET,
+	FA_SHADOW_CH1_SAT,
+	FA_SHADOW_CH1_THRES, /* and hysteresis */
+	FA_SHADOW_CH1_DLY,
+	FA_SHADOW_CH2_CTL,
+	FA_SHADOW_CH2_GAIN,
+	FA_SHADOW_CH2_OFFSET,
+	FA_SHADOW_CH2_SAT,
+	FA_SHADOW_CH2_THRES, /* and hysteresis */
+	FA_SHADOW_CH2_DLY,
+	FA_SHADOW_CH3_CTL,
+	FA_SHADOW_CH3_GAIN,
+	FA_SHADOW_CH3_OFFSET,
+	FA_SHADOW_CH3_SAT,
+	FA_SHADOW_CH3_THRES, /* and hysteresis */
+	FA_SHADOW_CH3_DLY,
+	FA_SHADOW_CH4_CTL,
+	FA_SHADOW_CH4_GAIN,
+	FA_SHADOW_CH4_OFFSET,
+	FA_SHADOW_CH4_SAT,
+	FA_SHADOW_CH4_THRES, /* and hysteresis */
+	FA_SHADOW_CH4_DLY,
+	/* SPEC carrier */
+	FA_SHADOW_CAR_RST,
+	FA_SHADOW_DMA_CTL,
+	FA_SHADOW_DMA_ADDR,
+	FA_SHADOW_DMA_ADDR_L,
+	FA_SHADOW_DMA_ADDR_H,
+	FA_SHADOW_DMA_LEN,
+	FA_SHADOW_DMA_NEXT_L,
+	FA_SHADOW_DMA_NEXT_H,
+	FA_SHADOW_DMA_BR,
+	__FA_SHADOW_N,
+};
+
 /*
  * Bit pattern used in order to factorize code  between SVEC and SPEC
  * Depending of the carrier, ADC may have to listen vaious IRQ sources
- * SVEC: only ACQ irq source (end DMA irq is manged by vmebus driver)
+ * SVEC: ACQ irq source, the DMA ends in the carrier transfer worker
+ *       (FA_IRQ_SRC_DMA_WORK, see zfad_dma_complete())
  * SPEC: ACQ and DMA irq source
  */
 enum fa_irq_src {
 	FA_IRQ_SRC_ACQ = 0x1,
 	FA_IRQ_SRC_DMA = 0x2,
+	FA_IRQ_SRC_DMA_WORK = 0x4,
 };
 
 /* adc IRQ values */
@@ -361,9 +638,220 @@ struct fa_carrier_op {
 	int (*enable_irqs) (struct fa_dev *);
 	int (*disable_irqs) (struct fa_dev *);
 	int (*ack_irq) (struct fa_dev *, int irq_id);
+	int (*dma_prepare)(struct zio_cset *cset, unsigned int n_shots,
+			   size_t shot_size);
 	int (*dma_start)(struct zio_cset *cset);
 	void (*dma_done)(struct zio_cset *cset);
 	void (*dma_error)(struct zio_cset *cset);
+	/* carrier specific parameters (optional) */
+	int (*conf_set)(struct fa_dev *fa, unsigned int id, uint32_t val);
+	int (*info_get)(struct fa_dev *fa, unsigned int id, uint32_t *val);
+};
+
+/*
+ * fa_ring: memory mapped ring
+ * @misc: char device to map the ring
+ * @lock: it protects the indexes and the ring memory
+ * @mmap_lock: it serializes mmap() and resize
+ * @vaddr: ring memory (header page + slots)
+ * @size: size of the ring memory
+ * @size_req: size requested by the user, applied by @resize_work or on open
+ * @resize_work: it resizes the ring in process context
+ * @hdr: header shared with user space (first page of @vaddr). The driver
+ *       writes there a copy of the fields below and it reads only the tail
+ * @n_slots: number of slots, a power of two
+ * @slot_size: size of a slot (bytes)
+ * @ctrl_size: offset of the samples within a slot (bytes)
+ * @data_offset: offset of the first slot from the header (bytes)
+ * @next: index of the next slot to give to an acquisition
+ * @head: index of the next slot to publish
+ * @tail: last valid tail read from @hdr
+ * @n_overrun: number of acquisitions refused because the ring was full
+ * @n_map: number of VMAs mapping the ring, it cannot be resized while mapped
+ * @wq: wait queue to wake up applications on new slots
+ */
+struct fa_ring {
+	struct miscdevice misc;
+	spinlock_t lock;
+	struct mutex mmap_lock;
+	void *vaddr;
+	size_t size;
+	size_t size_req;
+	struct work_struct resize_work;
+	struct fa100m14b4c_ring_header *hdr;
+	uint32_t n_slots;
+	uint32_t slot_size;
+	uint32_t ctrl_size;
+	uint32_t data_offset;
+	uint32_t next;
+	uint32_t head;
+	uint32_t tail;
+	uint32_t n_overrun;
+	atomic_t n_map;
+	wait_queue_head_t wq;
+};
+
+/*
+ * fa_timetag: trigger time-tag ring
+ * @lock: it protects the ring
+ * @ring: FA100M14B4C_TIMETAG_N time-tags
+ * @index: index of the last recorded time-tag
+ */
+struct fa_timetag {
+	spinlock_t lock;
+	struct fa100m14b4c_timetag *ring;
+	uint32_t index;
+};
+
+/*
+ * fa_counters: acquisition counters of a CPU
+ * @cnt: counters, indexed by enum fa100m14b4c_counter
+ */
+struct fa_counters {
+	uint64_t cnt[__FA100M14B4C_CNT_N];
+};
+
+/*
+ * fa_spi_msg: a SPI transfer
+ * @cs: chip select (FA_SPI_SS_*)
+ * @num_bits: number of bits to transfer
+ * @tx: value to transmit (LSB-aligned)
+ * @rx: received value
+ * @ns: duration of the transfer
+ */
+struct fa_spi_msg {
+	int cs;
+	int num_bits;
+	uint32_t tx;
+	uint32_t rx;
+	uint32_t ns;
+};
+
+/*
+ * Transfers requested to zfad_spi_work() (bits of fa_spi pending): the
+ * offset of a channel (bit number is the channel index), the ADC test
+ * pattern
+ */
+#define FA_SPI_PEND_PATTERN FA100M14B4C_NCHAN
+
+/*
+ * fa_spi: SPI controller
+ * @lock: one submission at a time
+ * @work: it runs the transfers requested from atomic context
+ * @pending: transfers requested to @work
+ * @pattern: ADC test pattern requested to @work
+ * @n_xfer: number of transfers (statistics)
+ * @n_batch: number of submissions (statistics)
+ * @total_ns: time spent in transfers (statistics)
+ * @last_ns: duration of the last transfer
+ * @max_ns: duration of the longest transfer
+ */
+struct fa_spi {
+	struct mutex lock;
+	struct work_struct work;
+	unsigned long pending;
+	uint16_t pattern;
+	unsigned long n_xfer;
+	unsigned long n_batch;
+	u64 total_ns;
+	uint32_t last_ns;
+	uint32_t max_ns;
+};
+
+/*
+ * Acquisition stages measured by the latency instrumentation
+ */
+enum fa_lat_stage {
+	FA_LAT_ACQ_END = 0,	/* ACQ_END interrupt */
+	FA_LAT_WORK,		/* deferred work running */
+	FA_LAT_DMA_START,	/* DMA started */
+	FA_LAT_DMA_DONE,	/* DMA over */
+	FA_LAT_DATA_DONE,	/* blocks stored */
+	FA_LAT_N,
+};
+
+#define FA_LAT_RING_SIZE 1024
+
+/*
+ * fa_latency: time stamps (ns) of the acquisition stages
+ * @acq_end: ACQ_END time stamp waiting for the deferred work
+ * @cur: stages of the acquisition in progress
+ * @ring: stages of the last FA_LAT_RING_SIZE acquisitions
+ * @head: number of acquisitions pushed in @ring. Only the acquisition path
+ *        writes it; readers take a snapshot without locking
+ * @reset: the user asked to reset the statistics. The acquisition path
+ *         consumes it, so it remains the only writer of @head
+ */
+struct fa_latency {
+	u64 acq_end;
+	u64 cur[FA_LAT_N];
+	u64 ring[FA_LAT_RING_SIZE][FA_LAT_N];
+	unsigned int head;
+	int reset;
+};
+
+/*
+ * Continuous acquisition
+ * The ADC runs a single endless shot and the DDR is a circular buffer:
+ * the gateware writes it, the driver follows with DMA transfers of
+ * @chunk samples.
+ * @chunk: samples per block, 0 when streaming is disabled
+ * @running: the stream is active
+ * @gen: stream generation, incremented at each stop. Both change under
+ *       the cset lock
+ * @triggered: the endless shot got its trigger, @start and the trigger
+ *             time are valid
+ * @start: DDR offset (bytes) of the first sample of the shot
+ * @rd: samples of the shot already transferred (read pointer)
+ * @seq: sequence number of the next block
+ * @gap: samples were lost before the next block
+ * @restart: the next block is the first of a new endless shot
+ * @trg_secs: trigger time (seconds)
+ * @trg_ticks: trigger time (ticks)
+ * @period: polling period (jiffies)
+ * @n_overrun: number of times the gateware overwrote samples not yet
+ *             transferred
+ * @n_restart: number of times the endless shot ended and the driver
+ *             started a new one
+ * @work: DDR polling
+ */
+struct fa_stream {
+	unsigned int chunk;
+	bool running;
+	unsigned int gen;
+	bool triggered;
+	uint32_t start;
+	uint32_t rd;
+	uint32_t seq;
+	bool gap;
+	bool restart;
+	uint64_t trg_secs;
+	uint32_t trg_ticks;
+	unsigned long period;
+	unsigned int n_overrun;
+	unsigned int n_restart;
+	struct delayed_work work;
+};
+
+/* Host decimation limits: the CIC gain (factor^order) fits in 48 bits */
+#define FA_DECIM_FACTOR_MAX 4096
+#define FA_DECIM_ORDER_MAX 4
+
+/*
+ * Host decimation: a CIC filter that reduces @factor samples to one. The
+ * first order filter is a boxcar average
+ * @factor: samples reduced to one, 1 when the decimation is disabled
+ * @order: number of integrator and comb stages
+ * @phase: samples integrated since the last output
+ * @integ: integrators, one set per channel
+ * @comb: comb delay lines, one set per channel
+ */
+struct fa_decim {
+	unsigned int factor;
+	unsigned int order;
+	unsigned int phase;
+	int64_t integ[FA_DECIM_ORDER_MAX][FA100M14B4C_NCHAN];
+	int64_t comb[FA_DECIM_ORDER_MAX][FA100M14B4C_NCHAN];
 };
 
 /*
@@ -378,6 +866,38 @@ struct fa_carrier_op {
  * @n_fires: number of trigger fire occurred within an acquisition
  *
  * @n_dma_err: number of errors
+ * @n_dma_pool_hit: number of acquisitions re-using the DMA descriptor pool
+ * @n_dma_pool_rebuild: number of DMA descriptor pool (re)allocations
+ * @n_dbuf_overrun: number of double buffer acquisitions overwritten
+ *                  before the end of their DMA transfer
+ * @dbuf_block: in double buffer mode, blocks of the acquisition running while
+ *              the DMA drains the previous one (NULL when nothing is
+ *              draining)
+ * @dbuf_n_shots: number of blocks in @dbuf_block
+ * @dbuf_wait: fa_irq_work() is waiting for the DMA to drain the previous
+ *             acquisition. The drain queues it again. Under the cset lock
+ * @dbuf_resume: fa_irq_work() runs again after the drain. Under the cset
+ *               lock
+ * @acq_start: start time of the acquisition under DMA. In double buffer
+ *             mode the registers already hold the one of the next
+ *             acquisition when the DMA is over
+ * @ring: memory mapped ring
+ * @stream: continuous acquisition
+ * @decim: host decimation
+ * @timetag: trigger time-tag ring
+ * @group: device group (0 when not in a group)
+ * @counters: acquisition counters, per CPU (fa_count_add())
+ * @shadow: copy of the registers only the driver changes (enum
+ *          fa_shadow_slot)
+ * @shadow_valid: slots of @shadow matching the hardware
+ * @shadow_dirty: slots of @shadow staged by fa_xact_writel(), not yet
+ *                written to the hardware
+ * @shadow_addr: register address of each slot of @shadow
+ * @n_mmio_read: number of bus reads
+ * @n_mmio_write: number of bus writes
+ * @n_shadow_hit: number of bus reads avoided by the shadow
+ * @ddr_size: size of the ADC DDR memory (bytes)
+ * @lat: acquisition latency instrumentation (debugfs)
  * @user_offset: user offset (micro-Volts)
  * @zero_offset: necessary offset to push the channel to zero (micro-Volts)
  */
@@ -399,15 +919,16 @@ struct fa_dev {
 	unsigned int fa_irq_adc_base;
 	unsigned int fa_utc_base;
 
-	/* DMA description */
-	struct zio_dma_sgt *zdma;
-
 	/* carrier specific functions (init/exit/reset/readout/irq handling) */
 	struct fa_carrier_op *carrier_op;
 	/* carrier private data */
 	void *carrier_data;
 	int irq_src; /* list of irq sources to listen */
+	struct workqueue_struct *wq; /* acquisition worker */
+	int work_cpu; /* CPU running irq_work, -1 for the IRQ one */
 	struct work_struct irq_work;
+	/* DMA_DONE completion out of the interrupt handler */
+	struct work_struct dma_done_work;
 	/*
 	 * keep last core having fired an IRQ
 	 * Used to check irq sequence: ACQ followed by DMA
@@ -421,8 +942,36 @@ struct fa_dev {
 
 	/* Statistic informations */
 	unsigned int		n_dma_err;
+	unsigned int		n_dma_pool_hit;
+	unsigned int		n_dma_pool_rebuild;
+	unsigned int		n_dbuf_overrun;
+
+	/* Double buffer acquisition */
+	struct zfad_block	*dbuf_block;
+	unsigned int		dbuf_n_shots;
+	bool			dbuf_wait;
+	bool			dbuf_resume;
+	struct zio_timestamp	acq_start;
+
+	struct fa_ring		ring;
+	struct fa_spi		spi;
+	struct fa_stream	stream;
+	struct fa_decim		decim;
+	struct fa_timetag	timetag;
+	unsigned int		group;
+	struct fa_counters __percpu *counters;
+
+	/* Register shadow */
+	uint32_t		shadow[__FA_SHADOW_N];
+	DECLARE_BITMAP(shadow_valid, __FA_SHADOW_N);
+	DECLARE_BITMAP(shadow_dirty, __FA_SHADOW_N);
+	unsigned long		shadow_addr[__FA_SHADOW_N];
+	unsigned long		n_mmio_read;
+	unsigned long		n_mmio_write;
+	unsigned long		n_shadow_hit;
 
 	/* Configuration */
+	unsigned int		ddr_size;
 	int32_t		user_offset[4]; /* one per channel */
 	int32_t		zero_offset[FA100M14B4C_NCHAN];
 	/* one-wire */
@@ -435,8 +984,18 @@ struct fa_dev {
 
 	/* flag  */
 	int enable_auto_start;
+	int enable_dbuf;
+	int enable_dma_coalesce;
+	int enable_stats;
+	int enable_pack;
+	enum fa100m14b4c_swap svec_swap;
+	/* SVEC swap cost of the last acquisition */
+	u64			svec_swap_ns;
+	unsigned long		svec_swap_bytes;
 
 	struct dentry *reg_dump;
+	struct dentry *lat_dump;
+	struct fa_latency *lat;
 };
 
 /*
@@ -445,11 +1004,15 @@ struct fa_dev {
  * @dev_mem_off is the offset in ADC internal memory. It points to the first
  *              sample of the stored shot
  * @first_nent is the index of the first nent used for this block
+ * @ring tells if the block lives in the memory mapped ring
+ * @ring_idx is the ring index of the block (when @ring)
  */
 struct zfad_block {
 	struct zio_block *block;
 	uint32_t	dev_mem_off;
 	unsigned int first_nent;
+	bool		ring;
+	uint32_t	ring_idx;
 };
 
 /*
@@ -474,6 +1037,7 @@ struct zfad_block {
 
 /* Global variable exported by fa-zio-trg.c */
 extern struct zio_trigger_type zfat_type;
+extern struct zio_buffer_type fa_zbuf_type;
 
 
 static inline struct fa_dev *get_zfadc(struct device *dev)
@@ -495,21 +1059,54 @@ static inline struct fa_dev *get_zfadc(struct device *dev)
 
 static inline u32 fa_ioread(struct fa_dev *fa, unsigned long addr)
 {
+	fa->n_mmio_read++;
 	return fmc_readl(fa->fmc, addr);
 }
 
 static inline void fa_iowrite(struct fa_dev *fa, u32 value, unsigned long addr)
 {
+	fa->n_mmio_write++;
 	fmc_writel(fa->fmc, value, addr);
 }
 
+/*
+ * It forgets the register shadow, the next accesses reload it from the
+ * hardware. To be used when the gateware resets its registers
+ */
+static inline void fa_shadow_invalidate(struct fa_dev *fa)
+{
+	bitmap_zero(fa->shadow_valid, __FA_SHADOW_N);
+	bitmap_zero(fa->shadow_dirty, __FA_SHADOW_N);
+}
+
+/*
+ * It returns the value of the register containing the field: from the
+ * shadow when the register has one, from the hardware otherwise
+ */
+static inline uint32_t fa_reg_get(struct fa_dev *fa, unsigned int base_off,
+				  const struct zfa_field_desc *field)
+{
+	unsigned int slot = field->shadow;
+
+	if (!slot)
+		return fa_ioread(fa, base_off + field->offset);
+	if (test_bit(slot, fa->shadow_valid)) {
+		fa->n_shadow_hit++;
+		return fa->shadow[slot];
+	}
+	fa->shadow_addr[slot] = base_off + field->offset;
+	fa->shadow[slot] = fa_ioread(fa, fa->shadow_addr[slot]);
+	set_bit(slot, fa->shadow_valid);
+	return fa->shadow[slot];
+}
+
 static inline uint32_t fa_readl(struct fa_dev *fa,
 				unsigned int base_off,
 				const struct zfa_field_desc *field)
 {
 	uint32_t cur;
 
-	cur = fa_ioread(fa, base_off+field->offset);
+	cur = fa_reg_get(fa, base_off, field);
 	if (field->is_bitfield) {
 		/* apply mask and shift right accordlying to the mask */
 		cur &= field->mask;
@@ -520,17 +1117,21 @@ static inline uint32_t fa_readl(struct fa_dev *fa,
 	return cur;
 }
 
-static inline void fa_writel(struct fa_dev *fa,
-				unsigned int base_off,
-				const struct zfa_field_desc *field,
-				uint32_t usr_val)
+/*
+ * It returns the value of the register containing the field, once the
+ * field is set to usr_val
+ */
+static inline uint32_t fa_field_merge(struct fa_dev *fa,
+				      unsigned int base_off,
+				      const struct zfa_field_desc *field,
+				      uint32_t usr_val)
 {
 	uint32_t cur, val;
 
 	val = usr_val;
 	/* Read current register value first if it's a bitfield */
 	if (field->is_bitfield) {
-		cur = fa_ioread(fa, base_off+field->offset);
+		cur = fa_reg_get(fa, base_off, field);
 		/* */
 		cur &= ~field->mask; /* clear bits according to the mask */
 		val = usr_val * (field->mask & -(field->mask));
@@ -541,13 +1142,34 @@ static inline void fa_writel(struct fa_dev *fa,
 		val &= field->mask;
 		val |= cur;
 	}
+	return val;
+}
+
+static inline void fa_writel(struct fa_dev *fa,
+				unsigned int base_off,
+				const struct zfa_field_desc *field,
+				uint32_t usr_val)
+{
+	uint32_t val;
+
+	val = fa_field_merge(fa, base_off, field, usr_val);
 	fa_iowrite(fa, val, base_off+field->offset);
+	if (field->shadow) {
+		/* self-clearing bits read back as 0 */
+		fa->shadow[field->shadow] = field->is_strobe ?
+			val & ~field->mask : val;
+		fa->shadow_addr[field->shadow] = base_off + field->offset;
+		set_bit(field->shadow, fa->shadow_valid);
+		/* the hardware is up to date, including staged fields */
+		clear_bit(field->shadow, fa->shadow_dirty);
+	}
 }
 
 extern struct bin_attribute dev_attr_calibration;
+extern struct bin_attribute dev_attr_counters;
 
 /* Global variable exported by fa-core.c */
-extern struct workqueue_struct *fa_workqueue;
+extern int fa_work_cpu;
 
 /* Global variable exported by fa-spec.c */
 extern struct fa_carrier_op fa_spec_op;
@@ -555,14 +1177,34 @@ extern struct fa_carrier_op fa_spec_op;
 /* Global variable exported by fa-svec.c */
 extern struct fa_carrier_op fa_svec_op;
 
+#ifdef CONFIG_FMC_ADC_SIM
+#define FA_SIM_CARRIER_NAME "SIM"
+/* Global variable exported by fa-sim.c */
+extern struct fa_carrier_op fa_sim_op;
+/* Functions exported by fa-sim.c */
+extern int fa_sim_register(void);
+extern void fa_sim_unregister(void);
+#endif
+
 /* Global variable exported by fa-regfield.c */
 extern const struct zfa_field_desc zfad_regs[];
 
 /* Functions exported by fa-core.c */
+extern int fa_probe(struct fmc_device *fmc);
+extern int fa_remove(struct fmc_device *fmc);
+extern int zfad_fsm_prepare(struct fa_dev *fa, uint32_t command);
 extern int zfad_fsm_command(struct fa_dev *fa, uint32_t command);
+extern void fa_xact_writel(struct fa_dev *fa, unsigned int base_off,
+			   const struct zfa_field_desc *field,
+			   uint32_t usr_val);
+extern unsigned int fa_xact_commit(struct fa_dev *fa);
 extern int zfad_apply_offset(struct zio_channel *chan);
+extern int zfad_apply_offsets(struct fa_dev *fa);
 extern void zfad_reset_offset(struct fa_dev *fa);
+extern void zfad_spi_work(struct work_struct *work);
 extern int zfad_convert_hw_range(uint32_t bitmask);
+extern int __zfad_set_range(struct fa_dev *fa, struct zio_channel *chan,
+			    int range);
 extern int zfad_set_range(struct fa_dev *fa, struct zio_channel *chan,
 			  int range);
 extern int zfad_get_chx_index(unsigned long addr, struct zio_channel *chan);
@@ -578,11 +1220,46 @@ extern void fa_zio_exit(struct fa_dev *fa);
 /* Functions exported by fa-zio-trg.c */
 extern int fa_trig_init(void);
 extern void fa_trig_exit(void);
+extern unsigned int zfat_shot_size(struct zio_ti *ti);
+extern struct zfad_block *zfat_blocks_alloc(struct zio_ti *ti,
+					    unsigned int n_shots,
+					    unsigned int size, gfp_t gfp);
+extern struct zfad_block *zfat_blocks_get(struct zio_ti *ti,
+					  unsigned int n_shots,
+					  unsigned int size);
+extern void zfat_blocks_free(struct zio_cset *cset,
+			     struct zfad_block *zfad_block,
+			     unsigned int n_shots);
+extern void zfat_blocks_store(struct zio_cset *cset,
+			      struct zfad_block *zfad_block,
+			      unsigned int n_shots, unsigned int n_fires);
+
+/* Functions exported by fa-zbuf.c */
+extern int fa_zbuf_init(void);
+extern void fa_zbuf_exit(void);
+extern unsigned int fa_zbuf_capacity(struct zio_bi *bi, size_t size);
+
+/* Functions exported by fa-ring.c */
+extern int fa_ring_init(struct fa_dev *fa);
+extern void fa_ring_exit(struct fa_dev *fa);
+extern int fa_ring_request_size(struct fa_dev *fa, size_t size);
+extern struct zfad_block *fa_ring_blocks_get(struct zio_cset *cset,
+					     unsigned int n_shots,
+					     unsigned int size);
+extern void fa_ring_blocks_store(struct zio_cset *cset,
+				 struct zfad_block *zfad_block,
+				 unsigned int n_shots, unsigned int n_fires);
+extern void fa_ring_blocks_free(struct zio_cset *cset,
+				struct zfad_block *zfad_block,
+				unsigned int n_shots);
 
 /* Functions exported by fa-irq.c */
 extern int zfad_dma_start(struct zio_cset *cset);
 extern void zfad_dma_done(struct zio_cset *cset);
 extern void zfad_dma_error(struct zio_cset *cset);
+extern void zfad_dma_complete(struct zio_cset *cset, int err);
+extern bool zfad_dbuf_usable(struct zio_cset *cset);
+extern void zfad_dma_done_defer(struct fa_dev *fa);
 extern void zfat_irq_trg_fire(struct zio_cset *cset);
 extern void zfat_irq_acq_end(struct zio_cset *cset);
 extern int fa_setup_irqs(struct fa_dev *fa);
@@ -590,6 +1267,89 @@ extern int fa_free_irqs(struct fa_dev *fa);
 extern int fa_enable_irqs(struct fa_dev *fa);
 extern int fa_disable_irqs(struct fa_dev *fa);
 
+/* Functions exported by fa-stream.c */
+extern void fa_stream_init(struct fa_dev *fa);
+extern void fa_stream_exit(struct fa_dev *fa);
+extern int fa_stream_set_chunk(struct fa_dev *fa, unsigned int chunk);
+extern void fa_stream_start(struct fa_dev *fa);
+extern void fa_stream_stop(struct fa_dev *fa);
+extern void fa_stream_dma_done(struct zio_cset *cset);
+
+/* Functions exported by fa-decim.c */
+extern void fa_decim_init(struct fa_dev *fa);
+extern int fa_decim_set(struct fa_dev *fa, unsigned int factor,
+			unsigned int order);
+extern void fa_decim_reset(struct fa_dev *fa);
+extern void fa_decim_block(struct fa_dev *fa, struct zio_block *block,
+			   bool cont);
+
+/* Functions exported by fa-timetag.c */
+extern int fa_timetag_init(struct fa_dev *fa);
+extern void fa_timetag_exit(struct fa_dev *fa);
+extern void fa_timetag_record(struct fa_dev *fa, struct zio_control *ctrl);
+
+/* Functions exported by fa-counters.c */
+extern int fa_counters_init(struct fa_dev *fa);
+extern void fa_counters_exit(struct fa_dev *fa);
+
+/**
+ * It updates an acquisition counter. It is safe in any context and it
+ * does not take locks: each CPU has its own copy
+ *
+ * @param fa the fmc-adc descriptor
+ * @param id the counter
+ * @param val the increment
+ */
+static inline void fa_count_add(struct fa_dev *fa,
+				enum fa100m14b4c_counter id, uint64_t val)
+{
+	this_cpu_add(fa->counters->cnt[id], val);
+}
+
+/* Functions exported by fa-group.c */
+extern int fa_group_init(struct fa_dev *fa);
+extern void fa_group_exit(struct fa_dev *fa);
+extern int fa_group_join(struct fa_dev *fa, unsigned int group);
+extern int fa_group_command(struct fa_dev *fa, uint32_t command);
+extern void fa_group_result(struct fa_dev *fa, uint32_t *skew,
+			    uint32_t *fire_ns);
+
+/* Functions exported by fa-stats.c */
+extern void fa_stats_block(struct fa_dev *fa, struct zio_block *block);
+
+/* Functions exported by fa-pack.c */
+extern void fa_pack_block(struct fa_dev *fa, struct zio_block *block);
+
+static inline bool fa_decim_enabled(struct fa_dev *fa)
+{
+	return fa->decim.factor > 1;
+}
+
+/* The samples need a pass of the CPU when the DMA transfer is over */
+static inline bool fa_dma_done_slow(struct fa_dev *fa)
+{
+	return fa_decim_enabled(fa) || fa->enable_stats || fa->enable_pack;
+}
+
+/* It puts the samples of a block flagged with DALARM_SWAP in CPU order */
+static inline void fa_block_cpu_order(struct zio_block *block)
+{
+	struct zio_control *ctrl = zio_get_ctrl(block);
+	uint32_t *word = block->data;
+	size_t i;
+
+	if (!(ctrl->drv_alarms & FA100M14B4C_DALARM_SWAP))
+		return;
+	for (i = 0; i < block->datalen / 4; ++i)
+		be32_to_cpus(&word[i]);
+	ctrl->drv_alarms &= ~FA100M14B4C_DALARM_SWAP;
+}
+
+static inline bool fa_stream_enabled(struct fa_dev *fa)
+{
+	return fa->stream.chunk && fa->zdev->cset->trig == &zfat_type;
+}
+
 /* Functions exported by onewire.c */
 extern int fa_onewire_init(struct fa_dev *fa);
 extern void fa_onewire_exit(struct fa_dev *fa);
@@ -598,6 +1358,8 @@ extern int fa_read_temp(struct fa_dev *fa, int verbose);
 /* functions exported by spi.c */
 extern int fa_spi_xfer(struct fa_dev *fa, int cs, int num_bits,
 		       uint32_t tx, uint32_t *rx);
+extern int fa_spi_xfer_batch(struct fa_dev *fa, struct fa_spi_msg *msg,
+			     unsigned int n);
 extern int fa_spi_init(struct fa_dev *fd);
 extern void fa_spi_exit(struct fa_dev *fd);
 
@@ -612,6 +1374,22 @@ extern void fa_read_eeprom_calib(struct fa_dev *fa);
 /* functions exported by fa-debug.c */
 extern int fa_debug_init(struct fa_dev *fa);
 extern void fa_debug_exit(struct fa_dev *fa);
+extern void fa_lat_push(struct fa_dev *fa);
+
+/*
+ * In double buffer mode two acquisitions overlap, so the stages of one
+ * would mix with the stages of the other: no latency capture
+ */
+static inline bool fa_lat_enabled(struct fa_dev *fa)
+{
+	return fa->lat && !READ_ONCE(fa->enable_dbuf);
+}
+
+static inline void fa_lat_stamp(struct fa_dev *fa, enum fa_lat_stage stage)
+{
+	if (fa_lat_enabled(fa))
+		fa->lat->cur[stage] = ktime_get_ns();
+}
 
 
 #endif /* __KERNEL__ */
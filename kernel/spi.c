@@ -4,9 +4,11 @@
  * Author: Federico Vaga <federico.vaga@gmail.com>
  */
 
-#include <linux/jiffies.h>
 #include <linux/io.h>
 #include <linux/delay.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
 #include "fmc-adc-100m14b4cha.h"
 
 /* SPI register */
@@ -27,38 +29,62 @@
 #define FA_SPI_CTRL_ASS		0x2000
 
 
-int fa_spi_xfer(struct fa_dev *fa, int cs, int num_bits,
-		uint32_t tx, uint32_t *rx)
+/*
+ * A 16-bit transfer takes about 50us with the divider we use. The
+ * transfers run in process context: we sleep FA_SPI_POLL_US between two
+ * checks of the busy flag. The controller interrupt (FA_SPI_CTRL_IE) is
+ * not routed to the carrier interrupt controller, so we cannot wait for it
+ */
+#define FA_SPI_POLL_US 20
+#define FA_SPI_TIMEOUT_NS (10 * NSEC_PER_MSEC)
+
+static int fa_spi_wait(struct fa_dev *fa)
+{
+	u64 timeout = ktime_get_ns() + FA_SPI_TIMEOUT_NS;
+
+	for (;;) {
+		usleep_range(FA_SPI_POLL_US, 2 * FA_SPI_POLL_US);
+		if (!(fa_ioread(fa, fa->fa_spi_base + FA_SPI_CTRL) &
+		      FA_SPI_CTRL_BUSY))
+			return 0;
+		if (ktime_get_ns() > timeout)
+			return -EIO;
+	}
+}
+
+static int fa_spi_xfer_one(struct fa_dev *fa, struct fa_spi_msg *msg)
 {
 	uint32_t regval;
-	unsigned long j = jiffies + HZ;
-	int err = 0;
+	u64 start;
+	int err;
 
 	/* Put out value (LSB-aligned) in the T0 register (bits 0..31) */
-	fa_iowrite(fa, tx, fa->fa_spi_base + FA_SPI_TX(0));
+	fa_iowrite(fa, msg->tx, fa->fa_spi_base + FA_SPI_TX(0));
 	/* Configure SPI controller */
 	regval = FA_SPI_CTRL_ASS |	/* Automatic Slave Select*/
 		FA_SPI_CTRL_Tx_NEG |	/* Change on falling edge */
-		num_bits;		/* In CHAR_LEN field */
+		msg->num_bits;		/* In CHAR_LEN field */
 	fa_iowrite(fa, regval, fa->fa_spi_base + FA_SPI_CTRL);
 	/* Set Chip Select */
-	fa_iowrite(fa, (1 << cs), fa->fa_spi_base + FA_SPI_CS);
+	fa_iowrite(fa, (1 << msg->cs), fa->fa_spi_base + FA_SPI_CS);
 	/* Start transfer */
+	start = ktime_get_ns();
 	fa_iowrite(fa, regval | FA_SPI_CTRL_GO,
 		   fa->fa_spi_base + FA_SPI_CTRL);
 	/* Wait transfer complete */
-	while (fa_ioread(fa, fa->fa_spi_base + FA_SPI_CTRL)
-	       & FA_SPI_CTRL_BUSY) {
-		if (jiffies > j) {
-			dev_err(fa->msgdev, "SPI transfer error\n");
-			err = -EIO;
-			goto out;
-		}
+	err = fa_spi_wait(fa);
+	msg->ns = min_t(u64, ktime_get_ns() - start, U32_MAX);
+	if (err) {
+		dev_err(fa->msgdev, "SPI transfer error\n");
+		goto out;
 	}
 	/* Transfer compleate, read data */
-	regval = fa_ioread(fa, fa->fa_spi_base + FA_SPI_RX(0));
-	if (rx)
-		*rx = regval;
+	msg->rx = fa_ioread(fa, fa->fa_spi_base + FA_SPI_RX(0));
+
+	fa->spi.n_xfer++;
+	fa->spi.total_ns += msg->ns;
+	fa->spi.last_ns = msg->ns;
+	fa->spi.max_ns = max(fa->spi.max_ns, msg->ns);
 out:
 	/* Clear Chip Select */
 	fa_iowrite(fa, 0, fa->fa_spi_base + FA_SPI_CTRL);
@@ -66,11 +92,60 @@ out:
 	return err;
 }
 
+/**
+ * It runs a sequence of SPI transfers as a single submission: no other
+ * transfer can run in between. It sleeps: the callers that may be atomic
+ * (attributes) go through zfad_spi_work()
+ * @param fa the fmc-adc descriptor
+ * @param msg transfers, on return they contain the received value and
+ *            the duration
+ * @param n number of transfers
+ *
+ * @return 0 on success, otherwise a negative error number (the
+ *         transfers after the failing one are not executed)
+ */
+int fa_spi_xfer_batch(struct fa_dev *fa, struct fa_spi_msg *msg,
+		      unsigned int n)
+{
+	int i, err = 0;
+
+	might_sleep();
+
+	mutex_lock(&fa->spi.lock);
+	fa->spi.n_batch++;
+	for (i = 0; i < n && !err; ++i)
+		err = fa_spi_xfer_one(fa, &msg[i]);
+	mutex_unlock(&fa->spi.lock);
+
+	return err;
+}
+
+int fa_spi_xfer(struct fa_dev *fa, int cs, int num_bits,
+		uint32_t tx, uint32_t *rx)
+{
+	struct fa_spi_msg msg = {
+		.cs = cs,
+		.num_bits = num_bits,
+		.tx = tx,
+	};
+	int err;
+
+	err = fa_spi_xfer_batch(fa, &msg, 1);
+	if (!err && rx)
+		*rx = msg.rx;
+
+	return err;
+}
+
 
 int fa_spi_init(struct fa_dev *fa)
 {
 	uint32_t rx;
 
+	mutex_init(&fa->spi.lock);
+	INIT_WORK(&fa->spi.work, zfad_spi_work);
+	fa->spi.pending = 0;
+
 	/* Divider must be 100, according to firmware guide */
 	fa_iowrite(fa, 100, fa->fa_spi_base + FA_SPI_DIV);
 
@@ -0,0 +1,436 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (C) 2019 CERN (www.cern.ch)
+ *
+ * Acquisition throughput benchmark. For each combination of number of
+ * shots, pre/post samples and trigger rate it runs a number of
+ * acquisitions with the automatic start and it reports, in JSON, the
+ * throughput, the arm latency and the dead time between acquisitions.
+ *
+ * Without hardware, use it on a simulated device (sim_ndev module
+ * parameter): the trigger rate is then the sim_trigger_hz parameter.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+
+#include <linux/zio-user.h>
+#include <fmc-adc-100m14b4cha.h>
+
+static char git_version[] = "version: " GIT_VERSION;
+
+#define FAU_SIM_TRG_HZ "/sys/module/fmc_adc_100m14b/parameters/sim_trigger_hz"
+#define FAU_TICK_NS 8 /* 125MHz coarse UTC counter */
+#define FAU_LIST_MAX 16
+
+static char basepath[128] = "/sys/bus/zio/devices/";
+
+enum fau_attribute {
+	FAU_FSM_CMD,
+	FAU_FSM_AUTO,
+	FAU_TRG_PRE,
+	FAU_TRG_POST,
+	FAU_TRG_NSHOTS,
+	FAU_TRG_ARM_LAT,
+	__FAU_ATTR_N,
+};
+
+static const char *attribute[] = {
+	[FAU_FSM_CMD] = "/cset0/fsm-command",
+	[FAU_FSM_AUTO] = "/cset0/fsm-auto-start",
+	[FAU_TRG_PRE] = "/cset0/trigger/pre-samples",
+	[FAU_TRG_POST] = "/cset0/trigger/post-samples",
+	[FAU_TRG_NSHOTS] = "/cset0/trigger/nshots",
+	[FAU_TRG_ARM_LAT] = "/cset0/trigger/arm-latency",
+};
+
+struct fau_list {
+	unsigned long val[FAU_LIST_MAX];
+	unsigned int n;
+};
+
+struct fau_stat {
+	unsigned long n;
+	double min, max, sum;
+};
+
+/**
+ * Benchmark point
+ * @nshots: number of shots per acquisition
+ * @pre: pre-samples
+ * @post: post-samples
+ * @hz: trigger rate, 0 when unknown
+ */
+struct fau_point {
+	unsigned long nshots;
+	unsigned long pre;
+	unsigned long post;
+	unsigned long hz;
+};
+
+static void fau_help(void)
+{
+	printf("\nfau-acq-bench [OPTIONS] <DEVICE>\n\n");
+	printf("  <DEVICE>: ZIO name of the device to use\n");
+	printf("  --nshots|-n <list>: number of shots (default 1)\n");
+	printf("  --pre|-p <list>: number of pre samples (default 0)\n");
+	printf("  --post|-P <list>: number of post samples (default 1000)\n");
+	printf("  --rate|-r <list>: simulated trigger rate in Hz (default: untouched)\n");
+	printf("  --acquisitions|-a <value>: acquisitions for each point (default 100)\n");
+	printf("  --timeout|-t <value>: timeout for a shot in ms (default 5000)\n");
+	printf("  --output|-o <file>: JSON output (default stdout)\n");
+	printf("  --version|-V: print version information\n");
+	printf("  --help|-h: show this help\n\n");
+	printf("A <list> is a comma separated list of values; the program measures\n");
+	printf("every combination of them\n\n");
+}
+
+static void print_version(char *pname)
+{
+	printf("%s %s\n", pname, git_version);
+}
+
+static double fau_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int fau_write_path(const char *path, unsigned long val)
+{
+	FILE *f;
+	int err = 0;
+
+	f = fopen(path, "w");
+	if (!f)
+		return -1;
+	if (fprintf(f, "%lu", val) < 0)
+		err = -1;
+	if (fclose(f))
+		err = -1;
+	if (err)
+		fprintf(stderr, "Cannot write %lu to %s: %s\n", val, path,
+			strerror(errno));
+	return err;
+}
+
+/* Write a sysfs attribute */
+static int fau_write_attribute(enum fau_attribute attr, unsigned long val)
+{
+	char fullpath[200];
+
+	snprintf(fullpath, sizeof(fullpath), "%s%s", basepath,
+		 attribute[attr]);
+	return fau_write_path(fullpath, val);
+}
+
+/* Read a sysfs attribute */
+static int fau_read_attribute(enum fau_attribute attr, unsigned long *val)
+{
+	char fullpath[200];
+	FILE *f;
+	int ret;
+
+	snprintf(fullpath, sizeof(fullpath), "%s%s", basepath,
+		 attribute[attr]);
+	f = fopen(fullpath, "r");
+	if (!f)
+		return -1;
+	ret = fscanf(f, "%lu", val);
+	fclose(f);
+
+	return ret == 1 ? 0 : -1;
+}
+
+static int fau_parse_list(struct fau_list *list, const char *str)
+{
+	char *end;
+
+	list->n = 0;
+	do {
+		if (list->n == FAU_LIST_MAX)
+			return -1;
+		list->val[list->n++] = strtoul(str, &end, 0);
+		if (end == str || (*end && *end != ','))
+			return -1;
+		str = end + 1;
+	} while (*end);
+
+	return 0;
+}
+
+static void fau_stat_add(struct fau_stat *stat, double val)
+{
+	if (!stat->n || val < stat->min)
+		stat->min = val;
+	if (!stat->n || val > stat->max)
+		stat->max = val;
+	stat->sum += val;
+	stat->n++;
+}
+
+static void fau_stat_print(FILE *out, const char *name, struct fau_stat *stat)
+{
+	fprintf(out, "\"%s\": {\"n\": %lu, \"min\": %.0f, \"avg\": %.0f, "
+		"\"max\": %.0f}", name, stat->n, stat->n ? stat->min : 0,
+		stat->n ? stat->sum / stat->n : 0, stat->n ? stat->max : 0);
+}
+
+/* Open the ZIO char device of the interleaved channel */
+static int fau_open_zio(const char *dev, const char *type, int flags)
+{
+	char path[128];
+	int fd;
+
+	snprintf(path, sizeof(path), "/dev/zio/%s-0-i-%s", dev, type);
+	fd = open(path, flags);
+	if (fd >= 0)
+		return fd;
+	snprintf(path, sizeof(path), "/dev/%s-0-i-%s", dev, type);
+	fd = open(path, flags);
+	if (fd < 0)
+		fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+	return fd;
+}
+
+/* Throw away blocks left in the buffer by a previous acquisition */
+static void fau_drain(int fdc, int fdd, void *buf, size_t size)
+{
+	struct zio_control ctrl;
+	struct pollfd p = {.fd = fdc, .events = POLLIN};
+
+	while (poll(&p, 1, 0) == 1 && (p.revents & POLLIN)) {
+		if (read(fdc, &ctrl, sizeof(ctrl)) != sizeof(ctrl))
+			break;
+		if (read(fdd, buf, size) < 0)
+			break;
+	}
+}
+
+static uint64_t fau_tstamp_ns(struct zio_control *ctrl)
+{
+	return ctrl->tstamp.secs * 1000000000ULL +
+		ctrl->tstamp.ticks * FAU_TICK_NS;
+}
+
+/**
+ * It runs a benchmark point and it prints its JSON object
+ * @out: output stream
+ * @fdc: ZIO control char device
+ * @fdd: ZIO data char device
+ * @pt: benchmark point
+ * @n_acq: number of acquisitions
+ * @timeout: timeout for a single shot (ms)
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int fau_run_point(FILE *out, int fdc, int fdd, struct fau_point *pt,
+			 unsigned long n_acq, int timeout)
+{
+	struct fau_stat arm = {0}, dead = {0};
+	struct pollfd p = {.fd = fdc, .events = POLLIN};
+	struct zio_control ctrl;
+	size_t size = (pt->pre + pt->post) * FA100M14B4C_NCHAN *
+		sizeof(int16_t) + 4096;
+	unsigned long a = 0, s, shots = 0, lat;
+	uint64_t first_ns, last_ns = 0;
+	double bytes = 0, t0, t1;
+	const char *error = NULL;
+	void *buf;
+	ssize_t n;
+
+	t0 = fau_now();
+	buf = malloc(size);
+	if (!buf) {
+		error = "out of memory";
+		goto out;
+	}
+	if (fau_write_attribute(FAU_FSM_CMD, FA100M14B4C_CMD_STOP) ||
+	    fau_write_attribute(FAU_TRG_PRE, pt->pre) ||
+	    fau_write_attribute(FAU_TRG_POST, pt->post) ||
+	    fau_write_attribute(FAU_TRG_NSHOTS, pt->nshots) ||
+	    fau_write_attribute(FAU_FSM_AUTO, 1) ||
+	    (pt->hz && fau_write_path(FAU_SIM_TRG_HZ, pt->hz))) {
+		error = "cannot configure";
+		goto out;
+	}
+	fau_drain(fdc, fdd, buf, size);
+
+	t0 = fau_now();
+	if (fau_write_attribute(FAU_FSM_CMD, FA100M14B4C_CMD_START)) {
+		error = "cannot start";
+		goto out;
+	}
+
+	for (a = 0; a < n_acq; ++a) {
+		for (s = 0; s < pt->nshots; ++s) {
+			n = poll(&p, 1, timeout);
+			if (n <= 0) {
+				error = n ? "poll" : "timeout";
+				goto out;
+			}
+			if (read(fdc, &ctrl, sizeof(ctrl)) != sizeof(ctrl)) {
+				error = "control read";
+				goto out;
+			}
+			n = read(fdd, buf, size);
+			if (n < 0) {
+				error = "data read";
+				goto out;
+			}
+			bytes += n;
+			shots++;
+
+			if (s == 0) {
+				first_ns = fau_tstamp_ns(&ctrl);
+				/* The gap between acquisitions, minus the period */
+				if (a > 0 && first_ns > last_ns) {
+					double gap = first_ns - last_ns;
+
+					if (pt->hz)
+						gap -= 1e9 / pt->hz;
+					fau_stat_add(&dead, gap > 0 ? gap : 0);
+				}
+			}
+			last_ns = fau_tstamp_ns(&ctrl);
+		}
+		if (!fau_read_attribute(FAU_TRG_ARM_LAT, &lat))
+			fau_stat_add(&arm, lat);
+	}
+out:
+	t1 = fau_now() - t0;
+	fau_write_attribute(FAU_FSM_CMD, FA100M14B4C_CMD_STOP);
+	free(buf);
+
+	fprintf(out, "    {\"nshots\": %lu, \"pre\": %lu, \"post\": %lu, "
+		"\"trigger_hz\": %lu, \"acquisitions\": %lu, \"shots\": %lu, "
+		"\"elapsed_s\": %.6f, \"shots_per_s\": %.1f, "
+		"\"mb_per_s\": %.3f, ", pt->nshots, pt->pre, pt->post, pt->hz,
+		a, shots, t1, shots / t1, bytes / t1 / 1e6);
+	fau_stat_print(out, "arm_latency_ns", &arm);
+	fprintf(out, ", ");
+	fau_stat_print(out, "dead_time_ns", &dead);
+	if (error)
+		fprintf(out, ", \"error\": \"%s\"", error);
+	fprintf(out, "}");
+
+	return error ? -1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+	static struct option options[] = {
+		{"nshots", required_argument, 0, 'n'},
+		{"pre", required_argument, 0, 'p'},
+		{"post", required_argument, 0, 'P'},
+		{"rate", required_argument, 0, 'r'},
+		{"acquisitions", required_argument, 0, 'a'},
+		{"timeout", required_argument, 0, 't'},
+		{"output", required_argument, 0, 'o'},
+		{"version", no_argument, 0, 'V'},
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+	struct fau_list nshots = {{1}, 1}, pre = {{0}, 1}, post = {{1000}, 1};
+	struct fau_list rate = {{0}, 1};
+	unsigned long n_acq = 100;
+	unsigned int in, ip, iP, ir;
+	struct fau_point pt;
+	int timeout = 5000;
+	int c, fdc, fdd, err = 0, first = 1;
+	FILE *out = stdout;
+
+	while ((c = getopt_long(argc, argv, "n:p:P:r:a:t:o:Vh",
+				options, NULL)) >= 0) {
+		switch (c) {
+		case 'n':
+			err = fau_parse_list(&nshots, optarg);
+			break;
+		case 'p':
+			err = fau_parse_list(&pre, optarg);
+			break;
+		case 'P':
+			err = fau_parse_list(&post, optarg);
+			break;
+		case 'r':
+			err = fau_parse_list(&rate, optarg);
+			break;
+		case 'a':
+			n_acq = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			timeout = strtol(optarg, NULL, 0);
+			break;
+		case 'o':
+			out = fopen(optarg, "w");
+			if (!out) {
+				fprintf(stderr, "%s: cannot open %s: %s\n",
+					argv[0], optarg, strerror(errno));
+				exit(1);
+			}
+			break;
+		case 'V':
+			print_version(argv[0]);
+			exit(0);
+		case 'h':
+		default:
+			fau_help();
+			exit(1);
+		}
+		if (err) {
+			fprintf(stderr, "%s: invalid list \"%s\"\n",
+				argv[0], optarg);
+			exit(1);
+		}
+	}
+
+	if (optind != argc - 1 || !n_acq) {
+		fprintf(stderr, "%s: DEVICE-ID is a mandatory argument\n",
+			argv[0]);
+		fau_help();
+		exit(1);
+	}
+	strncat(basepath, argv[optind], sizeof(basepath) - strlen(basepath) - 1);
+
+	fdc = fau_open_zio(argv[optind], "ctrl", O_RDONLY);
+	fdd = fau_open_zio(argv[optind], "data", O_RDONLY);
+	if (fdc < 0 || fdd < 0)
+		exit(1);
+
+	fprintf(out, "{\n  \"device\": \"%s\",\n  \"version\": \"%s\",\n"
+		"  \"results\": [\n", argv[optind], GIT_VERSION);
+	for (in = 0; in < nshots.n; ++in)
+	for (ip = 0; ip < pre.n; ++ip)
+	for (iP = 0; iP < post.n; ++iP)
+	for (ir = 0; ir < rate.n; ++ir) {
+		pt.nshots = nshots.val[in];
+		pt.pre = pre.val[ip];
+		pt.post = post.val[iP];
+		pt.hz = rate.val[ir];
+
+		if (!first)
+			fprintf(out, ",\n");
+		first = 0;
+		if (fau_run_point(out, fdc, fdd, &pt, n_acq, timeout))
+			err = 1;
+		fflush(out);
+	}
+	fprintf(out, "\n  ]\n}\n");
+
+	close(fdc);
+	close(fdd);
+	if (out != stdout)
+		fclose(out);
+
+	exit(err);
+}
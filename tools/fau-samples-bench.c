@@ -0,0 +1,246 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (C) 2019 CERN (www.cern.ch)
+ *
+ * It measures the throughput of the de-interleave, byte swap, unpack and
+ * conversion kernels of fau-samples, and it checks that all of them give
+ * the same result. It measures the packing done by the driver too.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "fau-samples.h"
+
+static char git_version[] = "version: " GIT_VERSION;
+
+enum fau_kernel {
+	FAU_K_DEINTERLEAVE = 0,
+	FAU_K_DEINTERLEAVE_SWAP,
+	FAU_K_SWAP,
+	FAU_K_PACK,
+	FAU_K_UNPACK,
+	FAU_K_UV,
+	FAU_K_VOLT,
+	__FAU_K_N,
+};
+
+static const char *fau_kernel_name[] = {
+	[FAU_K_DEINTERLEAVE] = "deinterleave",
+	[FAU_K_DEINTERLEAVE_SWAP] = "deinter-swap",
+	[FAU_K_SWAP] = "swap",
+	[FAU_K_PACK] = "pack",
+	[FAU_K_UNPACK] = "unpack",
+	[FAU_K_UV] = "convert-uv",
+	[FAU_K_VOLT] = "convert-volt",
+};
+
+static void fau_help(void)
+{
+	printf("\nfau-samples-bench [OPTIONS]\n\n");
+	printf("  --samples|-n <value>: samples per channel (default 1048576)\n");
+	printf("  --loops|-l <value>: repetitions for each kernel (default 100)\n");
+	printf("  --range|-r <value>: input range, 0 10V, 1 1V, 2 100mV (default 0)\n");
+	printf("  --version|-V: print version information\n");
+	printf("  --help|-h: show this help\n\n");
+	printf("The throughput is the size of the interleaved samples (not packed)\n");
+	printf("over the time\n\n");
+}
+
+static void print_version(char *pname)
+{
+	printf("%s %s\n", pname, git_version);
+}
+
+static double fau_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fau_run(enum fau_kernel k, void *dst[FA100M14B4C_NCHAN],
+		    const int16_t *src, const uint8_t *packed, size_t n,
+		    const struct fau_conv *conv)
+{
+	switch (k) {
+	case FAU_K_DEINTERLEAVE:
+		fau_deinterleave((int16_t **)dst, src, n);
+		break;
+	case FAU_K_DEINTERLEAVE_SWAP:
+		fau_deinterleave_swap((int16_t **)dst, src, n);
+		break;
+	case FAU_K_SWAP:
+		/* in place: the first buffer holds all the channels */
+		fau_swap(dst[0], n);
+		break;
+	case FAU_K_PACK:
+		fau_pack(dst[0], src, n);
+		break;
+	case FAU_K_UNPACK:
+		fau_unpack(dst[0], packed, n);
+		break;
+	case FAU_K_UV:
+		fau_convert_uv((int32_t **)dst, src, n, conv);
+		break;
+	case FAU_K_VOLT:
+		fau_convert_volt((float **)dst, src, n, conv);
+		break;
+	default:
+		break;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	static struct option options[] = {
+		{"samples", required_argument, 0, 'n'},
+		{"loops", required_argument, 0, 'l'},
+		{"range", required_argument, 0, 'r'},
+		{"version", no_argument, 0, 'V'},
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+	void *dst[FA100M14B4C_NCHAN], *ref[FA100M14B4C_NCHAN];
+	struct fa_calib_stanza stanza;
+	struct fau_conv conv;
+	size_t n = 1024 * 1024, i;
+	unsigned int loops = 100, l;
+	int range = FA100M14B4C_RANGE_10V;
+	enum fau_simd simd;
+	enum fau_kernel k;
+	uint8_t *packed;
+	int16_t *src;
+	double t, gbs;
+	int c, ch, err = 0;
+
+	while ((c = getopt_long(argc, argv, "n:l:r:Vh", options, NULL)) >= 0) {
+		switch (c) {
+		case 'n':
+			n = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			loops = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			range = strtol(optarg, NULL, 0);
+			break;
+		case 'V':
+			print_version(argv[0]);
+			exit(0);
+		case 'h':
+		default:
+			fau_help();
+			exit(1);
+		}
+	}
+	if (!n || !loops) {
+		fprintf(stderr, "%s: invalid number of samples or loops\n",
+			argv[0]);
+		exit(1);
+	}
+
+	/* Something that looks like a calibration, to exercise saturation */
+	for (ch = 0; ch < FA100M14B4C_NCHAN; ++ch) {
+		stanza.offset[ch] = -100 + 50 * ch;
+		stanza.gain[ch] = 0x8000 + 200 - 100 * ch;
+	}
+	if (fau_conv_init(&conv, &stanza, range)) {
+		fprintf(stderr, "%s: invalid range %d\n", argv[0], range);
+		exit(1);
+	}
+
+	src = malloc(n * FA100M14B4C_NCHAN * sizeof(*src));
+	packed = malloc(n * FA100M14B4C_PACK_FRAME_BYTES);
+	if (!src || !packed) {
+		fprintf(stderr, "%s: cannot allocate samples\n", argv[0]);
+		exit(1);
+	}
+	srand(0);
+	for (i = 0; i < n * FA100M14B4C_NCHAN; ++i)
+		src[i] = rand();
+	fau_pack(packed, src, n);
+	for (ch = 0; ch < FA100M14B4C_NCHAN; ++ch) {
+		/* large enough for the interleaved samples (swap) */
+		dst[ch] = malloc(n * FA100M14B4C_NCHAN * sizeof(*src));
+		ref[ch] = malloc(n * FA100M14B4C_NCHAN * sizeof(*src));
+		if (!dst[ch] || !ref[ch]) {
+			fprintf(stderr, "%s: cannot allocate samples\n",
+				argv[0]);
+			exit(1);
+		}
+	}
+
+	/* The unpacked samples lose the two least significant bits */
+	fau_unpack(dst[0], packed, n);
+	for (i = 0; i < n * FA100M14B4C_NCHAN; ++i) {
+		if (((int16_t *)dst[0])[i] != (src[i] & ~3)) {
+			fprintf(stderr, "%s: pack/unpack mismatch at %zu\n",
+				argv[0], i);
+			err = 1;
+			break;
+		}
+	}
+
+	printf("%zu samples per channel, %u loops, best %s\n", n, loops,
+	       fau_simd_name(fau_simd_best()));
+	for (k = 0; k < __FAU_K_N; ++k) {
+		size_t size = k == FAU_K_SWAP || k == FAU_K_UNPACK ?
+			n * FA100M14B4C_NCHAN * sizeof(*src) :
+			k == FAU_K_PACK ? n * FA100M14B4C_PACK_FRAME_BYTES :
+			k == FAU_K_DEINTERLEAVE || k == FAU_K_DEINTERLEAVE_SWAP ?
+			n * sizeof(int16_t) : n * sizeof(int32_t);
+		int nchan = k == FAU_K_SWAP || k == FAU_K_PACK ||
+			k == FAU_K_UNPACK ? 1 : FA100M14B4C_NCHAN;
+
+		fau_simd_set(FAU_SIMD_SCALAR);
+		if (k == FAU_K_SWAP)
+			memcpy(ref[0], src, size);
+		fau_run(k, ref, src, packed, n, &conv);
+
+		for (simd = 0; simd < __FAU_SIMD_N; ++simd) {
+			/* the driver packs: there is only the scalar one */
+			if (k == FAU_K_PACK && simd != FAU_SIMD_SCALAR)
+				continue;
+			if (fau_simd_set(simd))
+				continue;
+
+			for (ch = 0; ch < nchan; ++ch)
+				memset(dst[ch], 0, size);
+			if (k == FAU_K_SWAP)
+				memcpy(dst[0], src, size);
+			t = fau_now();
+			for (l = 0; l < loops; ++l)
+				fau_run(k, dst, src, packed, n, &conv);
+			t = fau_now() - t;
+			gbs = (double)n * FA100M14B4C_NCHAN * sizeof(*src) *
+				loops / t / 1e9;
+			/* an odd number of swaps is a single one */
+			if (k == FAU_K_SWAP && !(loops & 1))
+				fau_run(k, dst, src, packed, n, &conv);
+
+			for (ch = 0; ch < nchan; ++ch)
+				if (memcmp(dst[ch], ref[ch], size))
+					break;
+			printf("%-14s %-8s %8.3f GB/s%s\n", fau_kernel_name[k],
+			       fau_simd_name(simd), gbs,
+			       ch < nchan ? "  MISMATCH" : "");
+			if (ch < nchan)
+				err = 1;
+		}
+	}
+
+	for (ch = 0; ch < FA100M14B4C_NCHAN; ++ch) {
+		free(dst[ch]);
+		free(ref[ch]);
+	}
+	free(packed);
+	free(src);
+
+	exit(err);
+}
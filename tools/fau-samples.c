@@ -0,0 +1,865 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (C) 2019 CERN (www.cern.ch)
+ *
+ * De-interleave and convert the samples acquired by the FMC ADC.
+ *
+ * Every kernel has a scalar implementation and, on x86, an SSE2 and an
+ * AVX2 one. The SIMD implementations do exactly the same floating point
+ * operations as the scalar one, so they give the very same results.
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FAU_SAMPLES_X86
+#include <immintrin.h>
+#endif
+
+#include "fau-samples.h"
+
+#define FAU_NCHAN FA100M14B4C_NCHAN
+
+/* Half of the input range, in micro-volts */
+static const float fau_range_uv[] = {
+	[FA100M14B4C_RANGE_10V] = 5000000.0f,
+	[FA100M14B4C_RANGE_1V] = 500000.0f,
+	[FA100M14B4C_RANGE_100mV] = 50000.0f,
+};
+
+struct fau_samples_op {
+	const char *name;
+	void (*deinterleave)(int16_t *dst[FAU_NCHAN], const int16_t *src,
+			     size_t n);
+	void (*deinterleave_swap)(int16_t *dst[FAU_NCHAN],
+				  const int16_t *src, size_t n);
+	void (*swap)(int16_t *buf, size_t n);
+	void (*unpack)(int16_t *dst, const uint8_t *src, size_t n);
+	void (*convert_uv)(int32_t *dst[FAU_NCHAN], const int16_t *src,
+			   size_t n, const struct fau_conv *conv);
+	void (*convert_volt)(float *dst[FAU_NCHAN], const int16_t *src,
+			     size_t n, const struct fau_conv *conv);
+};
+
+/**
+ * It initializes the conversion parameters
+ * @conv: conversion parameters
+ * @stanza: ADC calibration data for the range (host endianess), NULL
+ *          when the samples are already calibrated by the gateware
+ * @range: input range used during the acquisition
+ *
+ * Return: 0 on success, -EINVAL for an invalid range
+ */
+int fau_conv_init(struct fau_conv *conv,
+		  const struct fa_calib_stanza *stanza,
+		  enum fa100m14b4c_input_range range)
+{
+	int i;
+
+	switch (range) {
+	case FA100M14B4C_RANGE_10V_CAL:
+	case FA100M14B4C_RANGE_1V_CAL:
+	case FA100M14B4C_RANGE_100mV_CAL:
+		range -= FA100M14B4C_RANGE_10V_CAL;
+		/* fall through */
+	case FA100M14B4C_RANGE_10V:
+	case FA100M14B4C_RANGE_1V:
+	case FA100M14B4C_RANGE_100mV:
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	for (i = 0; i < FAU_NCHAN; ++i) {
+		conv->offset[i] = stanza ? stanza->offset[i] : 0.0f;
+		conv->gain[i] = stanza ? stanza->gain[i] / 32768.0f : 1.0f;
+	}
+	conv->uv = fau_range_uv[range] / 32768.0f;
+	conv->volt = fau_range_uv[range] / 1e6f / 32768.0f;
+
+	return 0;
+}
+
+/*
+ * Apply the calibration to a raw code. Like the gateware, the corrected
+ * value saturates to the 16-bit range
+ */
+static inline float fau_calibrate(int16_t raw, float offset, float gain)
+{
+	float v = ((float)raw + offset) * gain;
+
+	if (v > 32767.0f)
+		v = 32767.0f;
+	if (v < -32768.0f)
+		v = -32768.0f;
+	return v;
+}
+
+static void fau_deinterleave_scalar(int16_t *dst[FAU_NCHAN],
+				    const int16_t *src, size_t n)
+{
+	size_t i;
+	int ch;
+
+	for (i = 0; i < n; ++i, src += FAU_NCHAN)
+		for (ch = 0; ch < FAU_NCHAN; ++ch)
+			dst[ch][i] = src[ch];
+}
+
+/*
+ * Blocks flagged with FA100M14B4C_DALARM_SWAP are in VME byte order:
+ * each 32-bit word, 2 samples, is byte swapped
+ */
+static inline void fau_swap_instant(int16_t out[FAU_NCHAN], const int16_t *in)
+{
+	uint32_t w[FAU_NCHAN / 2];
+	int i;
+
+	memcpy(w, in, sizeof(w));
+	for (i = 0; i < FAU_NCHAN / 2; ++i)
+		w[i] = __builtin_bswap32(w[i]);
+	memcpy(out, w, sizeof(w));
+}
+
+static void fau_deinterleave_swap_scalar(int16_t *dst[FAU_NCHAN],
+					 const int16_t *src, size_t n)
+{
+	int16_t s[FAU_NCHAN];
+	size_t i;
+	int ch;
+
+	for (i = 0; i < n; ++i, src += FAU_NCHAN) {
+		fau_swap_instant(s, src);
+		for (ch = 0; ch < FAU_NCHAN; ++ch)
+			dst[ch][i] = s[ch];
+	}
+}
+
+static void fau_swap_scalar(int16_t *buf, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; ++i, buf += FAU_NCHAN)
+		fau_swap_instant(buf, buf);
+}
+
+/*
+ * Packed blocks (FA100M14B4C_DALARM_PACKED): each sampling instant is a
+ * 56-bit little endian word with channel N in bits 14N..14N+13. The
+ * unpacked samples have the two least significant bits cleared
+ */
+#define FAU_PACK_BYTES FA100M14B4C_PACK_FRAME_BYTES
+
+/* The last instant of a block has no eighth byte to load */
+static inline uint64_t fau_pack_load(const uint8_t *src, bool last)
+{
+	uint64_t w = 0;
+	int i;
+
+	if (!last) {
+		memcpy(&w, src, sizeof(w));
+		return le64toh(w) & ((1ULL << (8 * FAU_PACK_BYTES)) - 1);
+	}
+	for (i = 0; i < FAU_PACK_BYTES; ++i)
+		w |= (uint64_t)src[i] << (8 * i);
+	return w;
+}
+
+static void fau_unpack_scalar(int16_t *dst, const uint8_t *src, size_t n)
+{
+	uint64_t w;
+	size_t i;
+	int ch;
+
+	for (i = 0; i < n; ++i, src += FAU_PACK_BYTES, dst += FAU_NCHAN) {
+		w = fau_pack_load(src, i + 1 == n);
+		for (ch = 0; ch < FAU_NCHAN; ++ch)
+			dst[ch] = (int16_t)(((w >> (14 * ch)) & 0x3fff) << 2);
+	}
+}
+
+static void fau_convert_uv_scalar(int32_t *dst[FAU_NCHAN],
+				  const int16_t *src, size_t n,
+				  const struct fau_conv *conv)
+{
+	size_t i;
+	int ch;
+
+	for (i = 0; i < n; ++i, src += FAU_NCHAN)
+		for (ch = 0; ch < FAU_NCHAN; ++ch)
+			dst[ch][i] = lrintf(fau_calibrate(src[ch],
+							  conv->offset[ch],
+							  conv->gain[ch]) *
+					    conv->uv);
+}
+
+static void fau_convert_volt_scalar(float *dst[FAU_NCHAN],
+				    const int16_t *src, size_t n,
+				    const struct fau_conv *conv)
+{
+	size_t i;
+	int ch;
+
+	for (i = 0; i < n; ++i, src += FAU_NCHAN)
+		for (ch = 0; ch < FAU_NCHAN; ++ch)
+			dst[ch][i] = fau_calibrate(src[ch],
+						   conv->offset[ch],
+						   conv->gain[ch]) *
+				     conv->volt;
+}
+
+#ifdef FAU_SAMPLES_X86
+/*
+ * SSE2: a 128-bit register holds 2 sampling instants. Once sign-extended
+ * to 32-bit, each register holds one instant with the channels in the
+ * same lane order as the calibration vectors; a 4x4 transpose gives the
+ * per-channel vectors
+ */
+__attribute__((target("sse2")))
+static inline __m128i fau_swap_reg_sse2(__m128i x)
+{
+	x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+	x = _mm_shufflelo_epi16(x, _MM_SHUFFLE(2, 3, 0, 1));
+	return _mm_shufflehi_epi16(x, _MM_SHUFFLE(2, 3, 0, 1));
+}
+
+__attribute__((target("sse2")))
+static inline void __fau_deinterleave_sse2(int16_t *dst[FAU_NCHAN],
+					   const int16_t *src, size_t n,
+					   bool swap)
+{
+	__m128i x0, x1, x2, x3, t0, t1, t2, t3;
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8, src += 8 * FAU_NCHAN) {
+		x0 = _mm_loadu_si128((const __m128i *)src + 0);
+		x1 = _mm_loadu_si128((const __m128i *)src + 1);
+		x2 = _mm_loadu_si128((const __m128i *)src + 2);
+		x3 = _mm_loadu_si128((const __m128i *)src + 3);
+		if (swap) {
+			x0 = fau_swap_reg_sse2(x0);
+			x1 = fau_swap_reg_sse2(x1);
+			x2 = fau_swap_reg_sse2(x2);
+			x3 = fau_swap_reg_sse2(x3);
+		}
+
+		t0 = _mm_unpacklo_epi16(x0, x1);
+		t1 = _mm_unpackhi_epi16(x0, x1);
+		t2 = _mm_unpacklo_epi16(x2, x3);
+		t3 = _mm_unpackhi_epi16(x2, x3);
+		/* ch0-ch1 and ch2-ch3 of instants 0..3 and 4..7 */
+		x0 = _mm_unpacklo_epi16(t0, t1);
+		x1 = _mm_unpackhi_epi16(t0, t1);
+		x2 = _mm_unpacklo_epi16(t2, t3);
+		x3 = _mm_unpackhi_epi16(t2, t3);
+
+		_mm_storeu_si128((__m128i *)(dst[0] + i),
+				 _mm_unpacklo_epi64(x0, x2));
+		_mm_storeu_si128((__m128i *)(dst[1] + i),
+				 _mm_unpackhi_epi64(x0, x2));
+		_mm_storeu_si128((__m128i *)(dst[2] + i),
+				 _mm_unpacklo_epi64(x1, x3));
+		_mm_storeu_si128((__m128i *)(dst[3] + i),
+				 _mm_unpackhi_epi64(x1, x3));
+	}
+
+	if (i < n) {
+		int16_t *tail[FAU_NCHAN] = {dst[0] + i, dst[1] + i,
+					    dst[2] + i, dst[3] + i};
+
+		if (swap)
+			fau_deinterleave_swap_scalar(tail, src, n - i);
+		else
+			fau_deinterleave_scalar(tail, src, n - i);
+	}
+}
+
+__attribute__((target("sse2")))
+static void fau_deinterleave_sse2(int16_t *dst[FAU_NCHAN],
+				  const int16_t *src, size_t n)
+{
+	__fau_deinterleave_sse2(dst, src, n, false);
+}
+
+__attribute__((target("sse2")))
+static void fau_deinterleave_swap_sse2(int16_t *dst[FAU_NCHAN],
+				       const int16_t *src, size_t n)
+{
+	__fau_deinterleave_sse2(dst, src, n, true);
+}
+
+/* 2 instants at a time */
+__attribute__((target("sse2")))
+static void fau_swap_sse2(int16_t *buf, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i + 2 <= n; i += 2, buf += 2 * FAU_NCHAN)
+		_mm_storeu_si128((__m128i *)buf, fau_swap_reg_sse2(
+				 _mm_loadu_si128((const __m128i *)buf)));
+	if (i < n)
+		fau_swap_scalar(buf, n - i);
+}
+
+/*
+ * 2 instants at a time, one in each 64-bit lane. SSE2 has no per-lane
+ * shifts: every channel has its own shift, then the low 16 bits of the
+ * lanes are gathered
+ */
+__attribute__((target("sse2")))
+static void fau_unpack_sse2(int16_t *dst, const uint8_t *src, size_t n)
+{
+	__m128i x, c0, c1, c2, c3, lo, hi;
+	__m128i mask = _mm_set1_epi16((int16_t)0xfffc);
+	size_t i;
+
+	/* the loads go one byte beyond the second instant */
+	for (i = 0; i + 3 <= n; i += 2, src += 2 * FAU_PACK_BYTES,
+				dst += 2 * FAU_NCHAN) {
+		x = _mm_unpacklo_epi64(
+			_mm_loadl_epi64((const __m128i *)src),
+			_mm_loadl_epi64((const __m128i *)(src +
+							  FAU_PACK_BYTES)));
+		c0 = _mm_slli_epi64(x, 2);
+		c1 = _mm_srli_epi64(x, 12);
+		c2 = _mm_srli_epi64(x, 26);
+		c3 = _mm_srli_epi64(x, 40);
+		/* instant 0 in the low 32 bits of lo, instant 1 of hi */
+		lo = _mm_unpacklo_epi32(_mm_unpacklo_epi16(c0, c1),
+					_mm_unpacklo_epi16(c2, c3));
+		hi = _mm_unpacklo_epi32(_mm_unpackhi_epi16(c0, c1),
+					_mm_unpackhi_epi16(c2, c3));
+		_mm_storeu_si128((__m128i *)dst,
+				 _mm_and_si128(_mm_unpacklo_epi64(lo, hi),
+					       mask));
+	}
+	if (i < n)
+		fau_unpack_scalar(dst, src, n - i);
+}
+
+/* Sign-extend the 16-bit samples to 32-bit: low and high instant */
+__attribute__((target("sse2")))
+static inline __m128 fau_cvt_lo_sse2(__m128i x)
+{
+	return _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16));
+}
+
+__attribute__((target("sse2")))
+static inline __m128 fau_cvt_hi_sse2(__m128i x)
+{
+	return _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16));
+}
+
+__attribute__((target("sse2")))
+static inline __m128 fau_calibrate_sse2(__m128 v, __m128 off, __m128 gain)
+{
+	v = _mm_mul_ps(_mm_add_ps(v, off), gain);
+	v = _mm_min_ps(v, _mm_set1_ps(32767.0f));
+	return _mm_max_ps(v, _mm_set1_ps(-32768.0f));
+}
+
+/*
+ * It converts 4 instants and it returns the per-channel vectors,
+ * already scaled
+ */
+__attribute__((target("sse2")))
+static inline void fau_convert4_sse2(__m128 v[FAU_NCHAN], const int16_t *src,
+				     __m128 off, __m128 gain, __m128 scale)
+{
+	__m128i x0 = _mm_loadu_si128((const __m128i *)src + 0);
+	__m128i x1 = _mm_loadu_si128((const __m128i *)src + 1);
+
+	v[0] = fau_calibrate_sse2(fau_cvt_lo_sse2(x0), off, gain);
+	v[1] = fau_calibrate_sse2(fau_cvt_hi_sse2(x0), off, gain);
+	v[2] = fau_calibrate_sse2(fau_cvt_lo_sse2(x1), off, gain);
+	v[3] = fau_calibrate_sse2(fau_cvt_hi_sse2(x1), off, gain);
+	_MM_TRANSPOSE4_PS(v[0], v[1], v[2], v[3]);
+	v[0] = _mm_mul_ps(v[0], scale);
+	v[1] = _mm_mul_ps(v[1], scale);
+	v[2] = _mm_mul_ps(v[2], scale);
+	v[3] = _mm_mul_ps(v[3], scale);
+}
+
+__attribute__((target("sse2")))
+static void fau_convert_uv_sse2(int32_t *dst[FAU_NCHAN],
+				const int16_t *src, size_t n,
+				const struct fau_conv *conv)
+{
+	__m128 off = _mm_loadu_ps(conv->offset);
+	__m128 gain = _mm_loadu_ps(conv->gain);
+	__m128 scale = _mm_set1_ps(conv->uv);
+	__m128 v[FAU_NCHAN];
+	size_t i;
+	int ch;
+
+	for (i = 0; i + 4 <= n; i += 4, src += 4 * FAU_NCHAN) {
+		fau_convert4_sse2(v, src, off, gain, scale);
+		for (ch = 0; ch < FAU_NCHAN; ++ch)
+			_mm_storeu_si128((__m128i *)(dst[ch] + i),
+					 _mm_cvtps_epi32(v[ch]));
+	}
+
+	if (i < n) {
+		int32_t *tail[FAU_NCHAN] = {dst[0] + i, dst[1] + i,
+					    dst[2] + i, dst[3] + i};
+
+		fau_convert_uv_scalar(tail, src, n - i, conv);
+	}
+}
+
+__attribute__((target("sse2")))
+static void fau_convert_volt_sse2(float *dst[FAU_NCHAN],
+				  const int16_t *src, size_t n,
+				  const struct fau_conv *conv)
+{
+	__m128 off = _mm_loadu_ps(conv->offset);
+	__m128 gain = _mm_loadu_ps(conv->gain);
+	__m128 scale = _mm_set1_ps(conv->volt);
+	__m128 v[FAU_NCHAN];
+	size_t i;
+	int ch;
+
+	for (i = 0; i + 4 <= n; i += 4, src += 4 * FAU_NCHAN) {
+		fau_convert4_sse2(v, src, off, gain, scale);
+		for (ch = 0; ch < FAU_NCHAN; ++ch)
+			_mm_storeu_ps(dst[ch] + i, v[ch]);
+	}
+
+	if (i < n) {
+		float *tail[FAU_NCHAN] = {dst[0] + i, dst[1] + i,
+					  dst[2] + i, dst[3] + i};
+
+		fau_convert_volt_scalar(tail, src, n - i, conv);
+	}
+}
+
+/*
+ * AVX2: the same algorithm as SSE2 on both 128-bit lanes. The lanes
+ * hold even and odd pairs of instants, so the result needs a final
+ * cross-lane permutation to put the instants back in order
+ */
+#define FAU_AVX2_ORDER _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7)
+
+/* It reverses the bytes of each 32-bit word */
+#define FAU_AVX2_SWAP _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, \
+					11, 10, 9, 8, 15, 14, 13, 12, \
+					3, 2, 1, 0, 7, 6, 5, 4, \
+					11, 10, 9, 8, 15, 14, 13, 12)
+
+__attribute__((target("avx2")))
+static inline void __fau_deinterleave_avx2(int16_t *dst[FAU_NCHAN],
+					   const int16_t *src, size_t n,
+					   bool swap)
+{
+	__m256i x0, x1, x2, x3, t0, t1, t2, t3;
+	__m256i order = FAU_AVX2_ORDER;
+	__m256i mask = FAU_AVX2_SWAP;
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16, src += 16 * FAU_NCHAN) {
+		x0 = _mm256_loadu_si256((const __m256i *)src + 0);
+		x1 = _mm256_loadu_si256((const __m256i *)src + 1);
+		x2 = _mm256_loadu_si256((const __m256i *)src + 2);
+		x3 = _mm256_loadu_si256((const __m256i *)src + 3);
+		if (swap) {
+			x0 = _mm256_shuffle_epi8(x0, mask);
+			x1 = _mm256_shuffle_epi8(x1, mask);
+			x2 = _mm256_shuffle_epi8(x2, mask);
+			x3 = _mm256_shuffle_epi8(x3, mask);
+		}
+
+		t0 = _mm256_unpacklo_epi16(x0, x1);
+		t1 = _mm256_unpackhi_epi16(x0, x1);
+		t2 = _mm256_unpacklo_epi16(x2, x3);
+		t3 = _mm256_unpackhi_epi16(x2, x3);
+		x0 = _mm256_unpacklo_epi16(t0, t1);
+		x1 = _mm256_unpackhi_epi16(t0, t1);
+		x2 = _mm256_unpacklo_epi16(t2, t3);
+		x3 = _mm256_unpackhi_epi16(t2, t3);
+
+		/* pairs of instants: 0 2 4 6 on the low lane, 1 3 5 7 high */
+		_mm256_storeu_si256((__m256i *)(dst[0] + i),
+			_mm256_permutevar8x32_epi32(
+				_mm256_unpacklo_epi64(x0, x2), order));
+		_mm256_storeu_si256((__m256i *)(dst[1] + i),
+			_mm256_permutevar8x32_epi32(
+				_mm256_unpackhi_epi64(x0, x2), order));
+		_mm256_storeu_si256((__m256i *)(dst[2] + i),
+			_mm256_permutevar8x32_epi32(
+				_mm256_unpacklo_epi64(x1, x3), order));
+		_mm256_storeu_si256((__m256i *)(dst[3] + i),
+			_mm256_permutevar8x32_epi32(
+				_mm256_unpackhi_epi64(x1, x3), order));
+	}
+
+	if (i < n) {
+		int16_t *tail[FAU_NCHAN] = {dst[0] + i, dst[1] + i,
+					    dst[2] + i, dst[3] + i};
+
+		__fau_deinterleave_sse2(tail, src, n - i, swap);
+	}
+}
+
+__attribute__((target("avx2")))
+static void fau_deinterleave_avx2(int16_t *dst[FAU_NCHAN],
+				  const int16_t *src, size_t n)
+{
+	__fau_deinterleave_avx2(dst, src, n, false);
+}
+
+__attribute__((target("avx2")))
+static void fau_deinterleave_swap_avx2(int16_t *dst[FAU_NCHAN],
+				       const int16_t *src, size_t n)
+{
+	__fau_deinterleave_avx2(dst, src, n, true);
+}
+
+/* 4 instants at a time */
+__attribute__((target("avx2")))
+static void fau_swap_avx2(int16_t *buf, size_t n)
+{
+	__m256i mask = FAU_AVX2_SWAP;
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4, buf += 4 * FAU_NCHAN)
+		_mm256_storeu_si256((__m256i *)buf, _mm256_shuffle_epi8(
+				    _mm256_loadu_si256((const __m256i *)buf),
+				    mask));
+	if (i < n)
+		fau_swap_sse2(buf, n - i);
+}
+
+/*
+ * 4 instants at a time. Each 32-bit lane gets the 4 bytes holding a
+ * sample, which the per-lane shift moves to the top; the arithmetic
+ * shift brings it back to a sign-extended 16-bit sample
+ */
+#define FAU_AVX2_UNPACK _mm256_setr_epi8(0, 1, 2, 3, 1, 2, 3, 4, \
+					 3, 4, 5, 6, 5, 6, 7, 8, \
+					 7, 8, 9, 10, 8, 9, 10, 11, \
+					 10, 11, 12, 13, 12, 13, 14, 15)
+#define FAU_AVX2_UNPACK_SHIFT _mm256_setr_epi32(18, 12, 14, 16, \
+						18, 12, 14, 16)
+
+__attribute__((target("avx2")))
+static inline __m256i fau_unpack2_avx2(const uint8_t *src)
+{
+	__m256i x = _mm256_broadcastsi128_si256(
+			_mm_loadu_si128((const __m128i *)src));
+
+	x = _mm256_shuffle_epi8(x, FAU_AVX2_UNPACK);
+	x = _mm256_sllv_epi32(x, FAU_AVX2_UNPACK_SHIFT);
+	return _mm256_srai_epi32(x, 16);
+}
+
+__attribute__((target("avx2")))
+static void fau_unpack_avx2(int16_t *dst, const uint8_t *src, size_t n)
+{
+	__m256i mask = _mm256_set1_epi16((int16_t)0xfffc);
+	__m256i x;
+	size_t i;
+
+	/* the loads go two bytes beyond the fourth instant */
+	for (i = 0; i + 5 <= n; i += 4, src += 4 * FAU_PACK_BYTES,
+				dst += 4 * FAU_NCHAN) {
+		/* instants 0 2 on the low lane, 1 3 on the high lane */
+		x = _mm256_packs_epi32(fau_unpack2_avx2(src),
+				       fau_unpack2_avx2(src +
+							2 * FAU_PACK_BYTES));
+		x = _mm256_permute4x64_epi64(x, _MM_SHUFFLE(3, 1, 2, 0));
+		_mm256_storeu_si256((__m256i *)dst, _mm256_and_si256(x, mask));
+	}
+	if (i < n)
+		fau_unpack_sse2(dst, src, n - i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256 fau_calibrate_avx2(__m256 v, __m256 off, __m256 gain)
+{
+	v = _mm256_mul_ps(_mm256_add_ps(v, off), gain);
+	v = _mm256_min_ps(v, _mm256_set1_ps(32767.0f));
+	return _mm256_max_ps(v, _mm256_set1_ps(-32768.0f));
+}
+
+/* 8 instants: the low lanes hold 0, 2, 4, 6 and the high lanes 1, 3, 5, 7 */
+__attribute__((target("avx2")))
+static inline void fau_convert8_avx2(__m256 v[FAU_NCHAN], const int16_t *src,
+				     __m256 off, __m256 gain, __m256 scale)
+{
+	__m256i order = FAU_AVX2_ORDER;
+	__m256 t0, t1, t2, t3;
+	int ch;
+
+	for (ch = 0; ch < FAU_NCHAN; ++ch)
+		v[ch] = fau_calibrate_avx2(_mm256_cvtepi32_ps(
+				_mm256_cvtepi16_epi32(_mm_loadu_si128(
+					(const __m128i *)src + ch))),
+				off, gain);
+
+	/* in-lane 4x4 transpose: the lanes are shuffled as a whole */
+	t0 = _mm256_unpacklo_ps(v[0], v[1]);
+	t1 = _mm256_unpacklo_ps(v[2], v[3]);
+	t2 = _mm256_unpackhi_ps(v[0], v[1]);
+	t3 = _mm256_unpackhi_ps(v[2], v[3]);
+	v[0] = _mm256_shuffle_ps(t0, t1, _MM_SHUFFLE(1, 0, 1, 0));
+	v[1] = _mm256_shuffle_ps(t0, t1, _MM_SHUFFLE(3, 2, 3, 2));
+	v[2] = _mm256_shuffle_ps(t2, t3, _MM_SHUFFLE(1, 0, 1, 0));
+	v[3] = _mm256_shuffle_ps(t2, t3, _MM_SHUFFLE(3, 2, 3, 2));
+
+	for (ch = 0; ch < FAU_NCHAN; ++ch)
+		v[ch] = _mm256_mul_ps(_mm256_permutevar8x32_ps(v[ch], order),
+				      scale);
+}
+
+__attribute__((target("avx2")))
+static void fau_convert_uv_avx2(int32_t *dst[FAU_NCHAN],
+				const int16_t *src, size_t n,
+				const struct fau_conv *conv)
+{
+	__m256 off = _mm256_broadcast_ps((const __m128 *)conv->offset);
+	__m256 gain = _mm256_broadcast_ps((const __m128 *)conv->gain);
+	__m256 scale = _mm256_set1_ps(conv->uv);
+	__m256 v[FAU_NCHAN];
+	size_t i;
+	int ch;
+
+	for (i = 0; i + 8 <= n; i += 8, src += 8 * FAU_NCHAN) {
+		fau_convert8_avx2(v, src, off, gain, scale);
+		for (ch = 0; ch < FAU_NCHAN; ++ch)
+			_mm256_storeu_si256((__m256i *)(dst[ch] + i),
+					    _mm256_cvtps_epi32(v[ch]));
+	}
+
+	if (i < n) {
+		int32_t *tail[FAU_NCHAN] = {dst[0] + i, dst[1] + i,
+					    dst[2] + i, dst[3] + i};
+
+		fau_convert_uv_sse2(tail, src, n - i, conv);
+	}
+}
+
+__attribute__((target("avx2")))
+static void fau_convert_volt_avx2(float *dst[FAU_NCHAN],
+				  const int16_t *src, size_t n,
+				  const struct fau_conv *conv)
+{
+	__m256 off = _mm256_broadcast_ps((const __m128 *)conv->offset);
+	__m256 gain = _mm256_broadcast_ps((const __m128 *)conv->gain);
+	__m256 scale = _mm256_set1_ps(conv->volt);
+	__m256 v[FAU_NCHAN];
+	size_t i;
+	int ch;
+
+	for (i = 0; i + 8 <= n; i += 8, src += 8 * FAU_NCHAN) {
+		fau_convert8_avx2(v, src, off, gain, scale);
+		for (ch = 0; ch < FAU_NCHAN; ++ch)
+			_mm256_storeu_ps(dst[ch] + i, v[ch]);
+	}
+
+	if (i < n) {
+		float *tail[FAU_NCHAN] = {dst[0] + i, dst[1] + i,
+					  dst[2] + i, dst[3] + i};
+
+		fau_convert_volt_sse2(tail, src, n - i, conv);
+	}
+}
+#endif /* FAU_SAMPLES_X86 */
+
+static const struct fau_samples_op fau_samples_op[__FAU_SIMD_N] = {
+	[FAU_SIMD_SCALAR] = {
+		.name = "scalar",
+		.deinterleave = fau_deinterleave_scalar,
+		.deinterleave_swap = fau_deinterleave_swap_scalar,
+		.swap = fau_swap_scalar,
+		.unpack = fau_unpack_scalar,
+		.convert_uv = fau_convert_uv_scalar,
+		.convert_volt = fau_convert_volt_scalar,
+	},
+#ifdef FAU_SAMPLES_X86
+	[FAU_SIMD_SSE2] = {
+		.name = "sse2",
+		.deinterleave = fau_deinterleave_sse2,
+		.deinterleave_swap = fau_deinterleave_swap_sse2,
+		.swap = fau_swap_sse2,
+		.unpack = fau_unpack_sse2,
+		.convert_uv = fau_convert_uv_sse2,
+		.convert_volt = fau_convert_volt_sse2,
+	},
+	[FAU_SIMD_AVX2] = {
+		.name = "avx2",
+		.deinterleave = fau_deinterleave_avx2,
+		.deinterleave_swap = fau_deinterleave_swap_avx2,
+		.swap = fau_swap_avx2,
+		.unpack = fau_unpack_avx2,
+		.convert_uv = fau_convert_uv_avx2,
+		.convert_volt = fau_convert_volt_avx2,
+	},
+#endif
+};
+
+static const struct fau_samples_op *fau_op;
+
+/**
+ * Return: the fastest implementation supported by this CPU
+ */
+enum fau_simd fau_simd_best(void)
+{
+#ifdef FAU_SAMPLES_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return FAU_SIMD_AVX2;
+	if (__builtin_cpu_supports("sse2"))
+		return FAU_SIMD_SSE2;
+#endif
+	return FAU_SIMD_SCALAR;
+}
+
+/**
+ * It selects the implementation to use. By default the library uses
+ * the fastest one
+ * @simd: implementation
+ *
+ * Return: 0 on success, -ENOTSUP when this CPU does not support it
+ */
+int fau_simd_set(enum fau_simd simd)
+{
+	if (simd >= __FAU_SIMD_N || simd > fau_simd_best() ||
+	    !fau_samples_op[simd].name)
+		return -ENOTSUP;
+	fau_op = &fau_samples_op[simd];
+
+	return 0;
+}
+
+enum fau_simd fau_simd_get(void)
+{
+	if (!fau_op)
+		fau_simd_set(fau_simd_best());
+
+	return fau_op - fau_samples_op;
+}
+
+const char *fau_simd_name(enum fau_simd simd)
+{
+	if (simd >= __FAU_SIMD_N || !fau_samples_op[simd].name)
+		return "unknown";
+
+	return fau_samples_op[simd].name;
+}
+
+/**
+ * It splits the interleaved samples in per-channel arrays
+ * @dst: one array of n samples for each channel
+ * @src: interleaved samples, n * FA100M14B4C_NCHAN
+ * @n: number of samples per channel
+ */
+void fau_deinterleave(int16_t *dst[FA100M14B4C_NCHAN],
+		      const int16_t *src, size_t n)
+{
+	fau_simd_get();
+	fau_op->deinterleave(dst, src, n);
+}
+
+/**
+ * Like fau_deinterleave(), for blocks flagged with FA100M14B4C_DALARM_SWAP:
+ * it swaps the samples to host byte order on the way
+ * @dst: one array of n samples for each channel
+ * @src: interleaved samples in VME byte order, n * FA100M14B4C_NCHAN
+ * @n: number of samples per channel
+ */
+void fau_deinterleave_swap(int16_t *dst[FA100M14B4C_NCHAN],
+			   const int16_t *src, size_t n)
+{
+	fau_simd_get();
+	fau_op->deinterleave_swap(dst, src, n);
+}
+
+/**
+ * It puts in host byte order, in place, the samples of a block flagged
+ * with FA100M14B4C_DALARM_SWAP. Use it before the conversions
+ * @buf: interleaved samples, n * FA100M14B4C_NCHAN
+ * @n: number of samples per channel
+ */
+void fau_swap(int16_t *buf, size_t n)
+{
+	fau_simd_get();
+	fau_op->swap(buf, n);
+}
+
+/**
+ * It unpacks the samples of a block flagged with FA100M14B4C_DALARM_PACKED.
+ * The result is like a block that was not packed, with the two least
+ * significant bits of the samples cleared
+ * @dst: interleaved samples, n * FA100M14B4C_NCHAN
+ * @src: packed samples, n * FA100M14B4C_PACK_FRAME_BYTES
+ * @n: number of samples per channel
+ */
+void fau_unpack(int16_t *dst, const uint8_t *src, size_t n)
+{
+	fau_simd_get();
+	fau_op->unpack(dst, src, n);
+}
+
+/**
+ * It packs the samples like the driver does (sample-pack), to store or
+ * transmit them in the packed format
+ * @dst: packed samples, n * FA100M14B4C_PACK_FRAME_BYTES
+ * @src: interleaved samples, n * FA100M14B4C_NCHAN
+ * @n: number of samples per channel
+ */
+void fau_pack(uint8_t *dst, const int16_t *src, size_t n)
+{
+	uint64_t w;
+	size_t i;
+	int ch;
+
+	for (i = 0; i < n; ++i, src += FAU_NCHAN, dst += FAU_PACK_BYTES) {
+		w = 0;
+		for (ch = 0; ch < FAU_NCHAN; ++ch)
+			w |= (uint64_t)((uint16_t)src[ch] >> 2) << (14 * ch);
+		/* the next instant overwrites the eighth byte */
+		if (i + 1 < n) {
+			w = htole64(w);
+			memcpy(dst, &w, sizeof(w));
+			continue;
+		}
+		for (ch = 0; ch < FAU_PACK_BYTES; ++ch)
+			dst[ch] = w >> (8 * ch);
+	}
+}
+
+/**
+ * It splits the interleaved samples in per-channel arrays of micro-volts
+ * @dst: one array of n values for each channel
+ * @src: interleaved samples, n * FA100M14B4C_NCHAN
+ * @n: number of samples per channel
+ * @conv: conversion parameters
+ */
+void fau_convert_uv(int32_t *dst[FA100M14B4C_NCHAN],
+		    const int16_t *src, size_t n,
+		    const struct fau_conv *conv)
+{
+	fau_simd_get();
+	fau_op->convert_uv(dst, src, n, conv);
+}
+
+/**
+ * It splits the interleaved samples in per-channel arrays of volts
+ * @dst: one array of n values for each channel
+ * @src: interleaved samples, n * FA100M14B4C_NCHAN
+ * @n: number of samples per channel
+ * @conv: conversion parameters
+ */
+void fau_convert_volt(float *dst[FA100M14B4C_NCHAN],
+		      const int16_t *src, size_t n,
+		      const struct fau_conv *conv)
+{
+	fau_simd_get();
+	fau_op->convert_volt(dst, src, n, conv);
+}
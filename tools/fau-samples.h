@@ -0,0 +1,65 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * Copyright (C) 2019 CERN (www.cern.ch)
+ *
+ * De-interleave and convert the samples acquired by the FMC ADC. The
+ * interleaved channel carries 4 signed 16-bit samples (ch0..ch3) for
+ * each sampling instant; these helpers split it in per-channel arrays
+ * and convert the ADC codes to micro-volts or volts. Blocks flagged with
+ * FA100M14B4C_DALARM_PACKED must be unpacked first.
+ */
+
+#ifndef __FAU_SAMPLES_H__
+#define __FAU_SAMPLES_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <fmc-adc-100m14b4cha.h>
+
+/* Available implementations, from the slowest to the fastest */
+enum fau_simd {
+	FAU_SIMD_SCALAR = 0,
+	FAU_SIMD_SSE2,
+	FAU_SIMD_AVX2,
+	__FAU_SIMD_N,
+};
+
+/**
+ * Conversion parameters for a given input range
+ * @offset: offset to add to the raw ADC code, one per channel
+ * @gain: gain to apply after the offset, one per channel (1.0 no gain)
+ * @uv: micro-volts per ADC code
+ * @volt: volts per ADC code
+ */
+struct fau_conv {
+	float offset[FA100M14B4C_NCHAN];
+	float gain[FA100M14B4C_NCHAN];
+	float uv;
+	float volt;
+};
+
+extern int fau_conv_init(struct fau_conv *conv,
+			 const struct fa_calib_stanza *stanza,
+			 enum fa100m14b4c_input_range range);
+
+extern enum fau_simd fau_simd_best(void);
+extern int fau_simd_set(enum fau_simd simd);
+extern enum fau_simd fau_simd_get(void);
+extern const char *fau_simd_name(enum fau_simd simd);
+
+extern void fau_deinterleave(int16_t *dst[FA100M14B4C_NCHAN],
+			     const int16_t *src, size_t n);
+extern void fau_deinterleave_swap(int16_t *dst[FA100M14B4C_NCHAN],
+				  const int16_t *src, size_t n);
+extern void fau_swap(int16_t *buf, size_t n);
+extern void fau_unpack(int16_t *dst, const uint8_t *src, size_t n);
+extern void fau_pack(uint8_t *dst, const int16_t *src, size_t n);
+extern void fau_convert_uv(int32_t *dst[FA100M14B4C_NCHAN],
+			   const int16_t *src, size_t n,
+			   const struct fau_conv *conv);
+extern void fau_convert_volt(float *dst[FA100M14B4C_NCHAN],
+			     const int16_t *src, size_t n,
+			     const struct fau_conv *conv);
+
+#endif /* __FAU_SAMPLES_H__ */